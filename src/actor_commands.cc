@@ -135,7 +135,21 @@ actor_commands (mlm_client_t *client, zmsg_t **message_p)
         zstr_free (&config_file);
     }
     else if (streq (cmd, FTY_METRIC_STORE_CONF_PREFIX)) {
-        log_debug ("%s is not yet implemented!", FTY_METRIC_STORE_CONF_PREFIX);
+        char *step = zmsg_popstr (message);
+        char *days = zmsg_popstr (message);
+
+        if (!step || !days) {
+            log_error (
+                    "Expected multipart string format: %s/step/days. "
+                    "Received %s/%s/nullptr", FTY_METRIC_STORE_CONF_PREFIX,
+                    FTY_METRIC_STORE_CONF_PREFIX, step ? step : "nullptr");
+        }
+        else {
+            retention_set_age (step, days);
+        }
+
+        zstr_free (&days);
+        zstr_free (&step);
     }
     else {
         log_warning ("Command '%s' is unknown or not implemented", cmd);
@@ -398,6 +412,34 @@ actor_commands_test (bool verbose)
 
     STDERR_NON_EMPTY
 
+    // --------------------------------------------------------------
+    fp = freopen (str_stderr_txt.c_str(), "w+", stderr);
+    // FTY_METRIC_STORE_AGE
+    message = zmsg_new ();
+    assert (message);
+    zmsg_addstr (message, FTY_METRIC_STORE_CONF_PREFIX);
+    zmsg_addstr (message, "15m");
+    zmsg_addstr (message, "7");
+    rv = actor_commands (client, &message);
+    assert (rv == 0);
+    assert (message == NULL);
+
+    STDERR_EMPTY
+
+    // --------------------------------------------------------------
+    fp = freopen (str_stderr_txt.c_str(), "w+", stderr);
+    // FTY_METRIC_STORE_AGE - expected fail
+    message = zmsg_new ();
+    assert (message);
+    zmsg_addstr (message, FTY_METRIC_STORE_CONF_PREFIX);
+    zmsg_addstr (message, "15m");
+    // missing days here
+    rv = actor_commands (client, &message);
+    assert (rv == 0);
+    assert (message == NULL);
+
+    STDERR_NON_EMPTY
+
     zmsg_destroy (&message);
     mlm_client_destroy (&client);
     zactor_destroy (&malamute);
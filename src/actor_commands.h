@@ -46,6 +46,10 @@ extern "C" {
 //      configure actor, where
 //      config_file - full path to mapping file
 //  ^^^ NOT IMPLEMETED YET - command logic is empty
+//
+//  FTY_METRIC_STORE_AGE/step/days
+//      keep the samples of 'step' (RT, 15m, ..., 1d, 7d, 30d) for 'days',
+//      older ones are deleted in background, non positive days keep them
 
 // Performs the actor commands logic
 // Destroys the message
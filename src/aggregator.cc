@@ -0,0 +1,334 @@
+/*  =========================================================================
+    aggregator - Aggregation of finer steps into the requested one, on the fly
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    aggregator - Aggregation of finer steps into the requested one, on the fly
+@discuss
+    Ad-hoc steps and aggregations do not need a new configuration of the
+    computation module, nor new stored topics. One pass over the rows of
+    the finer step is enough, whatever the length of the range.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+#include <cmath>
+
+// start of the bucket of the step holding timestamp
+static int64_t
+s_bucket_start (int64_t timestamp, int64_t step_s)
+{
+    return timestamp - ((timestamp % step_s) + step_s) % step_s;
+}
+
+bool
+Aggregator::is_supported (const std::string &aggregation)
+{
+    return aggregation == "min"
+        || aggregation == "max"
+        || aggregation == "arithmetic_mean"
+        || aggregation == "sum"
+        || aggregation == "count";
+}
+
+std::vector<std::string>
+Aggregator::finer_steps (const std::string &step)
+{
+    std::vector<std::string> steps;
+    int64_t step_s = step_to_seconds (step);
+    if (step_s <= 0)
+        return steps;
+
+    std::vector<std::string> stored = Rollup::parse_steps (ROLLUP_STEPS_DEFAULT);
+    for (auto it = stored.rbegin (); it != stored.rend (); ++it) {
+        int64_t finer_s = step_to_seconds (*it);
+        if (finer_s < step_s && step_s % finer_s == 0)
+            steps.push_back (*it);
+    }
+    steps.push_back (RETENTION_STEP_RT);
+    return steps;
+}
+
+std::string
+Aggregator::source_topic (
+    const std::string &quantity,
+    const std::string &aggregation,
+    const std::string &finer_step,
+    const std::string &asset)
+{
+    if (finer_step == RETENTION_STEP_RT)
+        return quantity + "@" + asset;
+    return quantity + "_" + aggregation + "_" + finer_step + "@" + asset;
+}
+
+Aggregator::Aggregator (
+    const std::string &aggregation,
+    int64_t step_s,
+    bool from_rt,
+    int64_t first,
+    int64_t last,
+    Output output) :
+    _step_s (step_s),
+    _from_rt (from_rt),
+    _first (first),
+    _last (last),
+    _output (output)
+{
+    assert (is_supported (aggregation));
+    assert (step_s > 0);
+    if (aggregation == "min")
+        _aggregate = AGGREGATE_MIN;
+    else if (aggregation == "max")
+        _aggregate = AGGREGATE_MAX;
+    else if (aggregation == "arithmetic_mean")
+        _aggregate = AGGREGATE_MEAN;
+    else if (aggregation == "sum")
+        _aggregate = AGGREGATE_SUM;
+    else
+        _aggregate = AGGREGATE_COUNT;
+}
+
+void
+Aggregator::add (int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+{
+    int64_t start = s_bucket_start (timestamp, _step_s);
+    if (_rows != 0 && start != _start) {
+        finish ();
+    }
+    if (_rows == 0) {
+        _start = start;
+        _sum = 0;
+    }
+
+    double v = value * std::pow (10.0, scale);
+    bool extreme =
+        (_aggregate == AGGREGATE_MIN && (_rows == 0 || v < _extreme)) ||
+        (_aggregate == AGGREGATE_MAX && (_rows == 0 || v > _extreme));
+    if (extreme) {
+        _extreme = v;
+        _extreme_value = value;
+        _extreme_scale = scale;
+    }
+    _sum += v;
+    _rows++;
+}
+
+void
+Aggregator::finish ()
+{
+    if (_rows == 0)
+        return;
+    size_t rows = _rows;
+    _rows = 0;
+    if (_start < _first || _start > _last)
+        return;
+
+    if (_aggregate == AGGREGATE_MIN || _aggregate == AGGREGATE_MAX) {
+        _output (_start, _extreme_value, _extreme_scale);
+        _buckets++;
+        return;
+    }
+
+    double v = _sum;
+    if (_aggregate == AGGREGATE_MEAN)
+        v = _sum / rows;
+    else if (_aggregate == AGGREGATE_COUNT && _from_rt)
+        v = (double) rows;
+
+    m_msrmnt_value_t value = 0;
+    int8_t scale = 0;
+    if (!dtobiosf (v, value, scale)) {
+        log_warning ("aggregation of the bucket %" PRIi64 " is out of range", _start);
+        return;
+    }
+    _output (_start, value, scale);
+    _buckets++;
+}
+
+AggregateCache::AggregateCache () :
+    AggregateCache (AGGREGATE_CACHE_DEFAULT)
+{
+    char *env_cache = getenv (EV_DBSTORE_AGGREGATE_CACHE);
+    if (env_cache) {
+        int buckets = atoi (env_cache);
+        if (buckets >= 0) _max_buckets = (size_t) buckets;
+        log_info ("use %s %zu as number of computed buckets kept", EV_DBSTORE_AGGREGATE_CACHE, _max_buckets);
+    }
+}
+
+AggregateCache::AggregateCache (size_t max_buckets) :
+    _max_buckets (max_buckets)
+{
+}
+
+bool
+AggregateCache::get (const std::string &key, int64_t first, int64_t last, Aggregator::Output &output)
+{
+    std::vector<Point> points;
+    {
+        std::lock_guard<std::mutex> lock (_mutex);
+        auto it = _entries.find (key);
+        if (it == _entries.end ())
+            return false;
+        Entry &entry = it->second;
+        if (first < entry.first || last > entry.last)
+            return false;
+        entry.used = ++_clock;
+        auto begin = std::lower_bound (entry.points.begin (), entry.points.end (), first,
+            [] (const Point &point, int64_t timestamp) { return point.timestamp < timestamp; });
+        for (auto point = begin; point != entry.points.end () && point->timestamp <= last; ++point)
+            points.push_back (*point);
+    }
+    // the reply is built without the lock
+    for (const Point &point : points)
+        output (point.timestamp, point.value, point.scale);
+    return true;
+}
+
+void
+AggregateCache::put (const std::string &key, int64_t first, int64_t last, std::vector<Point> &&points)
+{
+    if (first > last || points.size () > _max_buckets)
+        return;
+
+    std::lock_guard<std::mutex> lock (_mutex);
+    auto it = _entries.find (key);
+    if (it != _entries.end ()) {
+        _size -= it->second.points.size ();
+        _entries.erase (it);
+    }
+    while (!_entries.empty () && _size + points.size () > _max_buckets) {
+        auto oldest = _entries.begin ();
+        for (auto entry = _entries.begin (); entry != _entries.end (); ++entry) {
+            if (entry->second.used < oldest->second.used)
+                oldest = entry;
+        }
+        _size -= oldest->second.points.size ();
+        _entries.erase (oldest);
+    }
+
+    _size += points.size ();
+    Entry &entry = _entries [key];
+    entry.first = first;
+    entry.last = last;
+    entry.points = std::move (points);
+    entry.used = ++_clock;
+}
+
+size_t
+AggregateCache::size ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _size;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+aggregator_test (bool verbose)
+{
+    printf (" * aggregator: ");
+
+    //  @selftest
+    assert (Aggregator::is_supported ("arithmetic_mean"));
+    assert (!Aggregator::is_supported ("consumption"));
+
+    std::vector<std::string> steps = Aggregator::finer_steps ("2h");
+    assert ((steps == std::vector<std::string> { "1h", "30m", "15m", "RT" }));
+    steps = Aggregator::finer_steps ("30d");
+    assert ((steps == std::vector<std::string> { "24h", "8h", "1h", "30m", "15m", "RT" }));
+    steps = Aggregator::finer_steps ("45m");
+    assert ((steps == std::vector<std::string> { "15m", "RT" }));
+    assert (Aggregator::finer_steps ("RT").empty ());
+    assert (Aggregator::source_topic ("realpower.default", "max", "1h", "ups-1") == "realpower.default_max_1h@ups-1");
+    assert (Aggregator::source_topic ("realpower.default", "max", "RT", "ups-1") == "realpower.default@ups-1");
+
+    std::vector<AggregateCache::Point> points;
+    Aggregator::Output output = [&points] (int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+        {
+            points.push_back ({ timestamp, value, scale });
+        };
+
+    // 2h buckets of 1h rows, the first bucket starts before the range
+    Aggregator max ("max", 7200, false, 7200, 14400, output);
+    max.add (3600, 100, 0);
+    max.add (7200, 15, -1);
+    max.add (10800, 12, 0);
+    max.add (14400, 3, 0);
+    max.add (18000, 4, 0);
+    max.finish ();
+    assert (max.get_buckets () == 2);
+    assert (points.size () == 2);
+    assert (points [0].timestamp == 7200 && points [0].value == 12 && points [0].scale == 0);
+    assert (points [1].timestamp == 14400 && points [1].value == 4);
+
+    // the mean of the means
+    points.clear ();
+    Aggregator mean ("arithmetic_mean", 7200, false, 0, 14400, output);
+    mean.add (7200, 10, 0);
+    mean.add (10800, 205, -1);
+    mean.finish ();
+    assert (points.size () == 1 && points [0].value == 1525 && points [0].scale == -2);
+
+    // RT rows are counted, finer counts are added
+    points.clear ();
+    Aggregator rt_count ("count", 900, true, 0, 1800, output);
+    for (int64_t t = 0; t < 1800; t += 60)
+        rt_count.add (t, 42, 0);
+    rt_count.finish ();
+    assert (points.size () == 2 && points [0].value == 15 && points [1].value == 15);
+    points.clear ();
+    Aggregator count ("count", 1800, false, 0, 1800, output);
+    count.add (0, 15, 0);
+    count.add (900, 14, 0);
+    count.finish ();
+    assert (points.size () == 1 && points [0].value == 29);
+
+    AggregateCache disabled (0);
+    assert (!disabled.is_enabled ());
+
+    // the buckets of a range are kept, a request outside misses
+    AggregateCache cache (4);
+    std::vector<AggregateCache::Point> computed = { { 0, 1, 0 }, { 900, 2, 0 }, { 2700, 4, 0 } };
+    cache.put ("1_max_900", 0, 2700, std::move (computed));
+    assert (cache.size () == 3);
+    points.clear ();
+    assert (cache.get ("1_max_900", 900, 2700, output));
+    assert (points.size () == 2 && points [0].value == 2 && points [1].timestamp == 2700);
+    assert (!cache.get ("1_max_900", 0, 3600, output));
+    assert (!cache.get ("2_max_900", 0, 900, output));
+
+    // the least recently used entry is evicted
+    std::vector<AggregateCache::Point> other = { { 0, 5, 0 }, { 900, 6, 0 } };
+    cache.put ("2_max_900", 0, 900, std::move (other));
+    assert (cache.size () == 2);
+    assert (!cache.get ("1_max_900", 0, 900, output));
+    assert (cache.get ("2_max_900", 0, 900, output));
+    std::vector<AggregateCache::Point> too_many (5, { 0, 0, 0 });
+    cache.put ("3_max_900", 0, 0, std::move (too_many));
+    assert (cache.size () == 2);
+    //  @end
+
+    printf ("OK\n");
+}
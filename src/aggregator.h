@@ -0,0 +1,169 @@
+/*  =========================================================================
+    aggregator - Aggregation of finer steps into the requested one, on the fly
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef AGGREGATOR_H_INCLUDED
+#define AGGREGATOR_H_INCLUDED
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// buckets kept by the cache of the computed aggregations, 0 disables it
+#define AGGREGATE_CACHE_DEFAULT 0
+
+#define EV_DBSTORE_AGGREGATE_CACHE "BIOS_DBSTORE_AGGREGATE_CACHE"
+
+/*
+ * \brief Buckets of a step computed from the rows of a finer one
+ *
+ * A GET for a step which was never stored is answered from the nearest
+ * finer step which was, RT last: the min of the mins, the max of the maxs,
+ * the mean of the means, the sum of the sums and the sum of the counts, or
+ * the number of rows of RT. The rows come in order of time, each bucket is
+ * output as soon as a row of a later one comes, so only the current bucket
+ * is in memory. Buckets are labelled with their start, aligned on
+ * multiples of the step since the epoch, only the ones starting from
+ * first to last are output.
+ */
+class Aggregator {
+    public:
+        typedef std::function<void(
+            int64_t timestamp,
+            m_msrmnt_value_t value,
+            m_msrmnt_scale_t scale)> Output;
+
+        // min, max, arithmetic_mean, sum and count are computed
+        static bool is_supported (const std::string &aggregation);
+
+        /*
+         * \brief steps of the computation module the step can be computed
+         *  from, those dividing it, the nearest first, then RT
+         *  return an empty list if step is not a step
+         */
+        static std::vector<std::string> finer_steps (const std::string &step);
+
+        // topic of the rows for the aggregation in the finer step
+        static std::string source_topic (
+            const std::string &quantity,
+            const std::string &aggregation,
+            const std::string &finer_step,
+            const std::string &asset);
+
+        Aggregator (
+            const std::string &aggregation,
+            int64_t step_s,
+            bool from_rt,
+            int64_t first,
+            int64_t last,
+            Output output);
+
+        // rows of the finer step, in order of time
+        void add (int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale);
+        // output the current bucket
+        void finish ();
+
+        size_t get_buckets () const { return _buckets; }
+
+    private:
+        typedef enum {
+            AGGREGATE_MIN,
+            AGGREGATE_MAX,
+            AGGREGATE_MEAN,
+            AGGREGATE_SUM,
+            AGGREGATE_COUNT
+        } aggregate_t;
+
+        aggregate_t _aggregate;
+        int64_t _step_s;
+        bool _from_rt;
+        int64_t _first;
+        int64_t _last;
+        Output _output;
+        size_t _buckets = 0;
+
+        // current bucket
+        int64_t _start = 0;
+        size_t _rows = 0;
+        double _sum = 0;
+        // exact value of the min or max row
+        double _extreme = 0;
+        m_msrmnt_value_t _extreme_value = 0;
+        m_msrmnt_scale_t _extreme_scale = 0;
+};
+
+/*
+ * \brief Computed buckets of the recent GET requests
+ *
+ * Each entry holds the buckets of a source topic, aggregation and step
+ * from first to last, so a request within this range is answered without
+ * reading the rows again. Only the buckets which late rows can't change
+ * anymore are put. The least recently used entries are evicted to keep at
+ * most max_buckets buckets. All methods are thread safe.
+ */
+class AggregateCache {
+    public:
+        struct Point {
+            int64_t timestamp;
+            m_msrmnt_value_t value;
+            m_msrmnt_scale_t scale;
+        };
+
+        AggregateCache ();
+        explicit AggregateCache (size_t max_buckets);
+
+        bool is_enabled () const { return _max_buckets > 0; }
+        size_t get_max_buckets () const { return _max_buckets; }
+
+        /*
+         * \brief output the buckets of key from first to last
+         *  return false if they were not all computed
+         */
+        bool get (const std::string &key, int64_t first, int64_t last, Aggregator::Output &output);
+
+        // the buckets of key from first to last are points
+        void put (const std::string &key, int64_t first, int64_t last, std::vector<Point> &&points);
+
+        // buckets in the cache
+        size_t size ();
+
+    private:
+        struct Entry {
+            int64_t first;
+            int64_t last;
+            std::vector<Point> points;
+            uint64_t used;
+        };
+
+        size_t _max_buckets;
+        std::mutex _mutex;
+        std::map<std::string, Entry> _entries;
+        size_t _size = 0;
+        uint64_t _clock = 0;
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    aggregator_test (bool verbose);
+
+#endif
@@ -0,0 +1,298 @@
+/*  =========================================================================
+    asset_purger - Background purge of the measurements of deleted assets
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    asset_purger - Background purge of the measurements of deleted assets
+@discuss
+    Deleting the samples of an asset by a join on topic LIKE '%@asset' scans
+    the whole topic table and holds the locks of all the deleted samples. The
+    purger finds the topics by the device of the asset and deletes their
+    samples in small chunks, out of the actor thread.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+AssetPurger::AssetPurger () :
+    _limiter (EV_DBSTORE_PURGE_CHUNK, PURGE_CHUNK_DEFAULT,
+              EV_DBSTORE_PURGE_RATE, PURGE_RATE_DEFAULT)
+{
+}
+
+AssetPurger::AssetPurger (size_t chunk, size_t rate) :
+    _limiter (chunk, rate)
+{
+}
+
+AssetPurger::~AssetPurger ()
+{
+    stop ();
+}
+
+void
+AssetPurger::start (const std::string &url, std::function<void()> sync, Purged purged)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    if (_running)
+        return;
+
+    _url = url;
+    _sync = sync;
+    _purged = purged;
+    _stop = false;
+    _limiter.reset ();
+    _running = true;
+    _thread = std::thread (&AssetPurger::run, this);
+    log_info ("asset purger started");
+}
+
+void
+AssetPurger::stop ()
+{
+    {
+        std::lock_guard<std::mutex> lock (_mutex);
+        if (!_running)
+            return;
+        _stop = true;
+    }
+    _cond.notify_all ();
+    _limiter.stop ();
+    _thread.join ();
+
+    std::lock_guard<std::mutex> lock (_mutex);
+    _running = false;
+    for (const std::string &asset : _queue)
+        log_warning ("measurements of the deleted asset %s were not purged", asset.c_str ());
+    log_info ("asset purger stopped");
+}
+
+bool
+AssetPurger::is_running ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _running;
+}
+
+bool
+AssetPurger::purge (const std::string &asset)
+{
+    {
+        std::lock_guard<std::mutex> lock (_mutex);
+        if (!_dying.insert (asset).second)
+            return false;
+        _dying_count = _dying.size ();
+        _queue.push_back (asset);
+    }
+    _cond.notify_all ();
+    return true;
+}
+
+bool
+AssetPurger::is_dying (const std::string &asset)
+{
+    // called for every sample, nothing to lock in the usual case
+    if (_dying_count == 0)
+        return false;
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _dying.count (asset) != 0;
+}
+
+bool
+AssetPurger::is_dying_topic (m_msrmnt_tpc_id_t topic_id)
+{
+    if (_dying_topics_count == 0)
+        return false;
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _dying_topics.count (topic_id) != 0;
+}
+
+size_t
+AssetPurger::get_pending ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _queue.size ();
+}
+
+std::vector<m_msrmnt_tpc_id_t>
+AssetPurger::select_topics (tntdb::Connection &conn, const std::string &asset)
+{
+    // name of the device and device_id of the topic are both indexed
+    tntdb::Statement st = conn.prepareCached (
+        " SELECT "
+        "   mt.id, mt.topic "
+        " FROM "
+        "   t_bios_measurement_topic mt "
+        "   INNER JOIN t_bios_discovered_device d ON mt.device_id = d.id_discovered_device "
+        " WHERE "
+        "   d.name = :name ");
+
+    std::string suffix = "@" + asset;
+    std::vector<m_msrmnt_tpc_id_t> topic_ids;
+    for (tntdb::Statement::const_iterator it = st.set ("name", asset).begin ();
+         it != st.end (); ++it) {
+        std::string topic;
+        (*it)["topic"].get(topic);
+        // the device of a topic is set by its first sample, keep only the
+        // topics named after the asset like the purge used to
+        if (topic.size () < suffix.size () ||
+            topic.compare (topic.size () - suffix.size (), suffix.size (), suffix) != 0)
+            continue;
+        m_msrmnt_tpc_id_t topic_id = 0;
+        (*it)["id"].get(topic_id);
+        topic_ids.push_back (topic_id);
+    }
+    return topic_ids;
+}
+
+int64_t
+AssetPurger::purge_now (tntdb::Connection &conn, const std::string &asset)
+{
+    int64_t deleted = 0;
+    int64_t start = zclock_mono ();
+    try {
+        std::vector<m_msrmnt_tpc_id_t> topic_ids = select_topics (conn, asset);
+        if (topic_ids.empty ()) {
+            log_debug ("deleted asset %s has no measurements", asset.c_str ());
+            return 0;
+        }
+
+        {
+            // the rows handed over after the sync are checked against them
+            std::lock_guard<std::mutex> lock (_mutex);
+            _dying_topics.insert (topic_ids.begin (), topic_ids.end ());
+            _dying_topics_count = _dying_topics.size ();
+        }
+
+        // the rows of the asset prepared before its deletion must not
+        // recreate the deleted samples, nor fail on the deleted topics
+        if (_sync)
+            _sync ();
+
+        tntdb::Statement st = conn.prepareCached (
+            " DELETE FROM t_bios_measurement "
+            " WHERE topic_id = :topic_id "
+            " LIMIT " + std::to_string (_limiter.get_chunk ()));
+        tntdb::Statement st_topic = conn.prepareCached (
+            " DELETE FROM t_bios_measurement_topic "
+            " WHERE id = :topic_id ");
+
+        for (m_msrmnt_tpc_id_t topic_id : topic_ids) {
+            bool interrupted = false;
+            deleted += _limiter.delete_chunks ([&st, topic_id] ()
+                {
+                    return st.set ("topic_id", topic_id).execute ();
+                }, interrupted);
+            if (interrupted) {
+                log_info ("purge of the asset %s interrupted, %" PRIi64 " rows deleted", asset.c_str (), deleted);
+                return -2;
+            }
+            st_topic.set ("topic_id", topic_id).execute ();
+        }
+        log_info ("purge of the asset %s: %" PRIi64 " rows of %zu topics deleted in %" PRIi64 "ms",
+                  asset.c_str (), deleted, topic_ids.size (), zclock_mono () - start);
+        return deleted;
+    }
+    catch (const std::exception &e) {
+        log_error ("Purge of the asset %s failed after %" PRIi64 " deleted rows: %s", asset.c_str (), deleted, e.what ());
+        return -1;
+    }
+}
+
+void
+AssetPurger::run ()
+{
+    ConnectionManager connection (_url);
+    int attempts = 0;
+    while (true) {
+        std::string asset;
+        {
+            std::unique_lock<std::mutex> lock (_mutex);
+            _cond.wait (lock, [this] { return _stop || !_queue.empty (); });
+            if (_stop)
+                break;
+            asset = _queue.front ();
+        }
+
+        tntdb::Connection conn;
+        if (!connection.get (conn)) {
+            log_warning ("purge of the asset %s delayed, the database is %s",
+                         asset.c_str (), connection_state_to_string (connection.get_state ()));
+            if (!_limiter.wait_ms (1000))
+                break;
+            continue;
+        }
+
+        int64_t rv = purge_now (conn, asset);
+        if (rv == -2)
+            break;
+        if (rv == -1) {
+            connection.failure ();
+            if (++attempts < PURGE_ATTEMPTS)
+                continue;
+            log_error ("measurements of the deleted asset %s are not purged after %d attempts",
+                       asset.c_str (), attempts);
+        }
+        attempts = 0;
+
+        if (_purged)
+            _purged (asset);
+        std::lock_guard<std::mutex> lock (_mutex);
+        _queue.pop_front ();
+        _dying.erase (asset);
+        _dying_count = _dying.size ();
+        _dying_topics.clear ();
+        _dying_topics_count = 0;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+asset_purger_test (bool verbose)
+{
+    printf (" * asset_purger: ");
+
+    //  @selftest
+    AssetPurger purger (100, 1000);
+    assert (!purger.is_dying ("ups-1"));
+    assert (purger.purge ("ups-1"));
+    assert (purger.purge ("rack-1"));
+    // the second delete of an asset is not queued twice
+    assert (!purger.purge ("ups-1"));
+    assert (purger.get_pending () == 2);
+    assert (purger.is_dying ("ups-1"));
+    assert (purger.is_dying ("rack-1"));
+    assert (!purger.is_dying ("ups-10"));
+    // the topics are known once the purge of the asset begins
+    assert (!purger.is_dying_topic (1));
+
+    // the assets stay queued while the database is unreachable
+    purger.start ("mysql:db=box_utf8;user=nobody", NULL);
+    assert (purger.is_running ());
+    purger.stop ();
+    assert (!purger.is_running ());
+    assert (purger.is_dying ("ups-1"));
+    //  @end
+
+    printf ("OK\n");
+}
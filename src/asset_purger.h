@@ -0,0 +1,122 @@
+/*  =========================================================================
+    asset_purger - Background purge of the measurements of deleted assets
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef ASSET_PURGER_H_INCLUDED
+#define ASSET_PURGER_H_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// rows deleted by one statement
+#define PURGE_CHUNK_DEFAULT 1000
+// maximal number of deleted rows per second
+#define PURGE_RATE_DEFAULT 20000
+// failed purges of an asset before it is given up
+#define PURGE_ATTEMPTS 3
+
+#define EV_DBSTORE_PURGE_CHUNK "BIOS_DBSTORE_PURGE_CHUNK"
+#define EV_DBSTORE_PURGE_RATE "BIOS_DBSTORE_PURGE_RATE"
+
+/*
+ * \brief Deletion of the measurements and topics of deleted assets
+ *
+ * Deleted assets are queued and purged one by one in a thread with its own
+ * connection. The topics of an asset are resolved through its discovered
+ * device, then the samples of each topic are deleted by statements of at
+ * most chunk rows using the (topic_id, timestamp) key, at the bounded
+ * rate of a RateLimiter.
+ * An asset stays dying from its purge request until its topics are deleted,
+ * the samples of dying assets must be dropped instead of recreating the
+ * topics being deleted. The sync callback runs before the deletion, it
+ * must insert the rows prepared before the request. The topics to delete
+ * are dying from before the sync on, the rows prepared for them by a
+ * sample which passed is_dying () before the request are checked again
+ * against them once handed over after the sync. The purged callback
+ * runs once the asset is done with, before it stops dying, it must forget
+ * the ids of the deleted topics which a read may have cached meanwhile.
+ * All methods are thread safe.
+ */
+class AssetPurger {
+    public:
+        AssetPurger ();
+        AssetPurger (size_t chunk, size_t rate);
+        ~AssetPurger ();
+
+        typedef std::function<void(const std::string &asset)> Purged;
+
+        void start (const std::string &url, std::function<void()> sync, Purged purged = NULL);
+        // finish the current asset and stop, the queued ones are not purged
+        void stop ();
+        bool is_running ();
+
+        // queue the asset, return false if it is already queued
+        bool purge (const std::string &asset);
+
+        // true from the purge request until the asset is purged
+        bool is_dying (const std::string &asset);
+        // true for the topics of the asset being purged, from before the sync
+        bool is_dying_topic (m_msrmnt_tpc_id_t topic_id);
+
+        // assets waiting for their purge, including the current one
+        size_t get_pending ();
+
+        /*
+         * \brief delete the samples and the topics of the asset
+         *  return the number of deleted samples, -1 on error, -2 if stopped
+         */
+        int64_t purge_now (tntdb::Connection &conn, const std::string &asset);
+
+    private:
+        void run ();
+        std::vector<m_msrmnt_tpc_id_t> select_topics (tntdb::Connection &conn, const std::string &asset);
+
+        std::string _url;
+        RateLimiter _limiter;
+        std::function<void()> _sync;
+        Purged _purged;
+
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        std::deque<std::string> _queue;
+        std::set<std::string> _dying;
+        // size of _dying, lets the producers skip the lock
+        std::atomic<size_t> _dying_count { 0 };
+        // topics of the asset being purged
+        std::set<m_msrmnt_tpc_id_t> _dying_topics;
+        std::atomic<size_t> _dying_topics_count { 0 };
+        std::thread _thread;
+        bool _running = false;
+        bool _stop = false;
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    asset_purger_test (bool verbose);
+
+#endif
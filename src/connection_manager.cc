@@ -0,0 +1,164 @@
+/*  =========================================================================
+    connection_manager - Database connection with lazy health checks
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    connection_manager - Database connection with lazy health checks
+@discuss
+    Calling connectCached and ping for every stored metric costs a round
+    trip to the database per metric. A connection in use is known to be
+    healthy, so it is only checked after a while of inactivity, or when
+    a query on it failed.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+
+const char *
+connection_state_to_string (connection_state_t state)
+{
+    switch (state) {
+        case CONNECTION_UP:
+            return "up";
+        case CONNECTION_DOWN:
+            return "down";
+        default:
+            return "unknown";
+    }
+}
+
+ConnectionManager::ConnectionManager (const std::string &url) :
+    _url (url)
+{
+    _ping_interval_ms = PING_INTERVAL_DEFAULT * 1000;
+    _backoff_max_ms = RECONNECT_BACKOFF_MAX_DEFAULT * 1000;
+
+    char *env_interval = getenv (EV_DBSTORE_PING_INTERVAL);
+    if (env_interval) {
+        int interval = atoi (env_interval);
+        if (interval >= 0) _ping_interval_ms = (int64_t) interval * 1000;
+        log_info ("use %s %ds as interval of connection checks", EV_DBSTORE_PING_INTERVAL, interval);
+    }
+
+    char *env_backoff = getenv (EV_DBSTORE_RECONNECT_BACKOFF_MAX);
+    if (env_backoff) {
+        int backoff = atoi (env_backoff);
+        if (backoff > 0) _backoff_max_ms = (int64_t) backoff * 1000;
+        log_info ("use %s %ds as maximal delay of reconnection", EV_DBSTORE_RECONNECT_BACKOFF_MAX, backoff);
+    }
+}
+
+ConnectionManager::ConnectionManager (
+    const std::string &url,
+    int64_t ping_interval_ms,
+    int64_t backoff_max_ms) :
+    _url (url),
+    _ping_interval_ms (ping_interval_ms),
+    _backoff_max_ms (backoff_max_ms > 0 ? backoff_max_ms : 1)
+{
+}
+
+bool
+ConnectionManager::connect (int64_t now)
+{
+    try {
+        _conn = tntdb::connectCached (_url);
+        _conn.ping ();
+    }
+    catch (const std::exception &e) {
+        // 1s, 2s, 4s ... up to the maximum
+        int64_t backoff = _backoff_max_ms;
+        if (_failures < 16)
+            backoff = std::min<int64_t> ((int64_t) 1000 << _failures, _backoff_max_ms);
+        _failures++;
+        _next_attempt = now + backoff;
+        _conn = tntdb::Connection ();
+        if (_state != CONNECTION_DOWN)
+            log_error ("Can't connect to the database: %s", e.what ());
+        _state = CONNECTION_DOWN;
+        return false;
+    }
+
+    if (_state == CONNECTION_DOWN)
+        log_info ("Connection to the database restored after %u attempts", _failures);
+    _state = CONNECTION_UP;
+    _failures = 0;
+    _check = false;
+    return true;
+}
+
+bool
+ConnectionManager::get (tntdb::Connection &conn)
+{
+    int64_t now = zclock_mono ();
+
+    if (_state == CONNECTION_DOWN && now < _next_attempt)
+        return false;
+
+    if (_check || _state != CONNECTION_UP || now - _last_use >= _ping_interval_ms) {
+        if (!connect (now))
+            return false;
+    }
+
+    _last_use = now;
+    conn = _conn;
+    return true;
+}
+
+void
+ConnectionManager::failure ()
+{
+    _check = true;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+connection_manager_test (bool verbose)
+{
+    printf (" * connection_manager: ");
+
+    //  @selftest
+    assert (streq (connection_state_to_string (CONNECTION_UP), "up"));
+    assert (streq (connection_state_to_string (CONNECTION_DOWN), "down"));
+
+    // nothing listens there, so the connection fails
+    ConnectionManager manager ("mysql:db=box_utf8;user=nobody;host=127.0.0.1;port=1", 1000, 60000);
+    assert (manager.get_state () == CONNECTION_UNKNOWN);
+    tntdb::Connection conn;
+    assert (!manager.get (conn));
+    assert (manager.get_state () == CONNECTION_DOWN);
+    assert (manager.get_failures () == 1);
+
+    // the next attempt waits for the backoff to elapse
+    assert (!manager.get (conn));
+    assert (manager.get_failures () == 1);
+
+    manager.failure ();
+    assert (!manager.get (conn));
+    assert (manager.get_failures () == 1);
+    //  @end
+
+    printf ("OK\n");
+}
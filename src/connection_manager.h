@@ -0,0 +1,96 @@
+/*  =========================================================================
+    connection_manager - Database connection with lazy health checks
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef CONNECTION_MANAGER_H_INCLUDED
+#define CONNECTION_MANAGER_H_INCLUDED
+
+#include <string>
+
+// seconds of inactivity after which the connection is pinged before use
+#define PING_INTERVAL_DEFAULT 30
+// longest wait in seconds between two reconnection attempts
+#define RECONNECT_BACKOFF_MAX_DEFAULT 30
+
+#define EV_DBSTORE_PING_INTERVAL "BIOS_DBSTORE_PING_INTERVAL"
+#define EV_DBSTORE_RECONNECT_BACKOFF_MAX "BIOS_DBSTORE_RECONNECT_BACKOFF_MAX"
+
+typedef enum {
+    // no connection attempt was made yet
+    CONNECTION_UNKNOWN,
+    CONNECTION_UP,
+    // the last attempt failed, the next one is delayed by the backoff
+    CONNECTION_DOWN
+} connection_state_t;
+
+/*
+ * \brief One database connection of one thread
+ *
+ * The connection is pinged only when it was not used for ping_interval
+ * seconds or when a failure was reported, otherwise it is handed out as
+ * is. A failed connection is retried after 1, 2, 4 ... seconds up to the
+ * maximal backoff. It is not thread safe, each thread has its own manager.
+ */
+class ConnectionManager {
+    public:
+        explicit ConnectionManager (const std::string &url);
+        ConnectionManager (
+            const std::string &url,
+            int64_t ping_interval_ms,
+            int64_t backoff_max_ms);
+
+        /*
+         * \brief get the usable connection
+         *  return false if the database is not reachable, or the backoff
+         *  after the last failure did not elapse yet
+         */
+        bool get (tntdb::Connection &conn);
+
+        // report a failed query, the connection is checked on next use
+        void failure ();
+
+        connection_state_t get_state () { return _state; }
+        // number of failed connection attempts in a row
+        unsigned get_failures () { return _failures; }
+        const std::string &get_url () { return _url; }
+
+    private:
+        bool connect (int64_t now);
+
+        std::string _url;
+        tntdb::Connection _conn;
+        connection_state_t _state = CONNECTION_UNKNOWN;
+        bool _check = true;
+        unsigned _failures = 0;
+        int64_t _last_use = 0;
+        int64_t _next_attempt = 0;
+        int64_t _ping_interval_ms;
+        int64_t _backoff_max_ms;
+};
+
+FTY_METRIC_STORE_PRIVATE const char *
+    connection_state_to_string (connection_state_t state);
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    connection_manager_test (bool verbose);
+
+#endif
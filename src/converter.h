@@ -41,6 +41,25 @@ FTY_METRIC_STORE_EXPORT int64_t
 FTY_METRIC_STORE_EXPORT bool
     stobiosf_wrapper (const std::string& string, int32_t& integer, int8_t& scale);
 
+/**
+ *  \brief Parse the metric value in one pass, without allocation
+ *          integer x 10^scale, the same way as string_to_int64 for
+ *          values without a decimal point and stobiosf_wrapper for
+ *          the others, including the truncation to 2 decimal places
+ *          when the value does not fit otherwise
+ *          Unlike the former path, an integer outside of int32_t is
+ *          rejected, it was silently truncated to its low 32 bits
+ */
+FTY_METRIC_STORE_EXPORT bool
+    parse_biosf (const char *value, int32_t& integer, int8_t& scale);
+
+/**
+ *  \brief Representation integer x 10^scale of a computed value, rounded
+ *          to 2 decimal places as the values received with more
+ */
+FTY_METRIC_STORE_PRIVATE bool
+    dtobiosf (double value, int32_t& integer, int8_t& scale);
+
 //  Self test of this class
 //  Note: Keep this definition in sync with fty_metric_store_classes.h
 FTY_METRIC_STORE_PRIVATE void
@@ -0,0 +1,132 @@
+/*
+ *
+ * Copyright (C) 2016 - 2020 Eaton
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*!
+ * \file converter_bench.cc
+ * \brief compare the speed of parse_biosf with the former
+ *        string_to_int64 / stobiosf_wrapper parsing of metric values
+ */
+#include <getopt.h>
+#include <chrono>
+#include "fty_metric_store_classes.h"
+
+using namespace std;
+
+// typical values published by the computation module
+static const char *values[] = {
+    "230", "-1", "0", "3055.555556", "3000.000000", "12.835",
+    "178746.2332", "0.00004", "-12134.013", "49.98", "100.0", "2147483647"
+};
+static const size_t values_count = sizeof (values) / sizeof (values[0]);
+
+// the parsing done by the server before parse_biosf
+static bool
+former_parse (const char *value, int32_t &integer, int8_t &scale)
+{
+    if (!strstr (value, ".")) {
+        integer = string_to_int64 (value);
+        scale = 0;
+        if (errno != 0) {
+            errno = 0;
+            return false;
+        }
+        return true;
+    }
+    return stobiosf_wrapper (value, integer, scale);
+}
+
+static double
+run (bool (*parse) (const char *, int32_t &, int8_t &), long iterations, int64_t &checksum)
+{
+    int32_t integer = 0;
+    int8_t scale = 0;
+    auto begin = chrono::steady_clock::now ();
+    for (long i = 0; i < iterations; i++) {
+        if (parse (values[i % values_count], integer, scale))
+            checksum += integer + scale;
+    }
+    auto end = chrono::steady_clock::now ();
+    return chrono::duration<double, nano> (end - begin).count () / iterations;
+}
+
+void usage ()
+{
+    puts ("converter_bench [options] \n"
+          "  -n|--iterations       number of parsed values [10000000]\n"
+          "  -h|--help             print this information");
+}
+
+int main(int argc, char** argv) {
+    int help = 0;
+    long iterations = 10000000;
+
+    int c;
+// Some systems define struct option with non-"const" "char *"
+#if defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wwrite-strings"
+#endif
+    static const char *short_options = "hn:";
+    static struct option long_options[] =
+    {
+            {"help",       no_argument,       &help,    1},
+            {"iterations", required_argument, 0,'n'},
+            {NULL, 0, 0, 0}
+    };
+#if defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic pop
+#endif
+
+    while(true) {
+        int option_index = 0;
+        c = getopt_long (argc, argv, short_options, long_options, &option_index);
+        if (c == -1) break;
+        switch (c) {
+            case 'n':
+                iterations = atol (optarg);
+                break;
+            case 'h':
+            default:
+                help = 1;
+                break;
+        }
+    }
+    if (help || iterations <= 0) {
+        usage ();
+        exit (1);
+    }
+
+    // the former parser logs every fallback, keep the output readable
+    ManageFtyLog::setInstanceFtylog ("converter_bench");
+    ManageFtyLog::getInstanceFtylog ()->setLogLevelWarning ();
+
+    int64_t former_checksum = 0;
+    int64_t parse_checksum = 0;
+    double former_ns = run (former_parse, iterations, former_checksum);
+    double parse_ns = run (parse_biosf, iterations, parse_checksum);
+
+    printf ("string_to_int64/stobiosf_wrapper: %8.1f ns/value\n", former_ns);
+    printf ("parse_biosf:                      %8.1f ns/value (x%.1f)\n", parse_ns, former_ns / parse_ns);
+    if (former_checksum != parse_checksum) {
+        printf ("results differ: %" PRIi64 " != %" PRIi64 "\n", former_checksum, parse_checksum);
+        return 1;
+    }
+    return 0;
+}
@@ -21,176 +21,576 @@
 /*!
  * \file dbstore_bench.cc
  * \author Gerald Guillaume <GeraldGuillaume@Eaton.com>
- * \brief do intensive and endurance insertion job
+ * \brief run reproducible insertion and query workloads against a database
+ *        and report the latency distribution of every operation
+ *
+ * Every scenario runs the given number of threads, each with its own random
+ * generator seeded from the seed and its index, so two runs with the same
+ * options send the same samples and queries. The latency of an operation is
+ * measured from its scheduled start when a rate is set, a late operation is
+ * not hidden by the previous slow one. The results can be written as JSON or
+ * CSV and compared between two releases.
  */
 #include <getopt.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <ctime>
+#include <map>
+#include <random>
+#include <sstream>
+#include <thread>
 #include "fty_metric_store_classes.h"
 
 using namespace std;
 
+typedef chrono::steady_clock bench_clock;
+
 /**
  *  \brief A connection string to the database
- *
- *  TODO: if DB_USER or DB_PASSWD would be changed the daemon
- *          should be restarted in order to apply changes
  */
-
 static std::string url =
     std::string("mysql:db=box_utf8;user=") +
     ((getenv("DB_USER")   == NULL) ? "root" : getenv("DB_USER")) +
     ((getenv("DB_PASSWD") == NULL) ? ""     :
     std::string(";password=") + getenv("DB_PASSWD"));
 
-long get_clock_ms(){
-    struct timeval time;
-    gettimeofday(&time, NULL); // Get Time
-    return (time.tv_sec * 1000) + (time.tv_usec / 1000);
+// spans of the GET queries, from the 15m to the 30d aggregations
+static const struct {
+    const char *name;
+    int64_t seconds;
+} spans[] = {
+    { "15m", 15 * 60 },
+    { "1h", 3600 },
+    { "24h", 24 * 3600 },
+    { "7d", 7 * 24 * 3600 },
+    { "30d", 30 * 24 * 3600 }
+};
+static const size_t spans_count = sizeof (spans) / sizeof (spans[0]);
+
+// preloaded samples cover the longest span
+static const int64_t preload_window = 30 * 24 * 3600;
+
+struct options_t {
+    std::vector<std::string> scenarios;
+    int threads = 4;
+    uint32_t seed = 1;
+    int duration = 30;          // s per scenario, unless ops is set
+    long ops = 0;               // operations per thread
+    int rate = 0;               // operations per second and thread, 0 unlimited
+    int elements = 20;
+    int topics = 10;            // topics per element
+    int preload = 1000;         // samples per topic before get, mixed and delete
+    int burst = 1000;           // inserts of one burst
+    int idle = 1000;            // ms between two bursts
+    int read_ratio = 50;        // % of GET in the mixed scenario
+    bool flush_worker = true;
+    std::string output;
+    std::string format;
+};
+
+/*
+ * \brief Latencies of one operation, merged from all the threads
+ */
+class Latencies {
+    public:
+        void add (int64_t us, bool ok, uint64_t rows)
+        {
+            if (!ok) {
+                _errors++;
+                return;
+            }
+            _samples.push_back (us);
+            _rows += rows;
+        }
+
+        void merge (const Latencies &other)
+        {
+            _samples.insert (_samples.end (), other._samples.begin (), other._samples.end ());
+            _errors += other._errors;
+            _rows += other._rows;
+        }
+
+        void sort () { std::sort (_samples.begin (), _samples.end ()); }
+
+        // nearest rank, call sort first
+        int64_t percentile (double q) const
+        {
+            if (_samples.empty ())
+                return 0;
+            size_t rank = (size_t) (q * _samples.size ());
+            return _samples [std::min (rank, _samples.size () - 1)];
+        }
+
+        double mean () const
+        {
+            if (_samples.empty ())
+                return 0;
+            double sum = 0;
+            for (int64_t us : _samples)
+                sum += us;
+            return sum / _samples.size ();
+        }
+
+        size_t count () const { return _samples.size (); }
+        uint64_t errors () const { return _errors; }
+        uint64_t rows () const { return _rows; }
+
+    private:
+        std::vector<int64_t> _samples;
+        uint64_t _errors = 0;
+        uint64_t _rows = 0;
+};
+
+typedef std::map<std::string, Latencies> thread_results_t;
+
+struct result_t {
+    std::string scenario;
+    std::string operation;
+    double elapsed_s;
+    Latencies latencies;
+};
+
+static std::string
+s_asset_name (const char *prefix, int element)
+{
+    return std::string (prefix) + std::to_string (element);
+}
+
+// topics look like the outputs of the computation module
+static std::string
+s_topic_name (const std::string &asset, int topic)
+{
+    return "bench.quantity" + std::to_string (topic) + "_arithmetic_mean_15m@" + asset;
 }
 
-char clock_fmt[26];
-char *get_clock_fmt(){
-    time_t timer;
-    struct tm* tm_info;
-    time(&timer);
-    tm_info = localtime(&timer);
-    strftime(clock_fmt, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-    return clock_fmt; // ZZZ global ref
+static int64_t
+s_elapsed_us (bench_clock::time_point start)
+{
+    return chrono::duration_cast<chrono::microseconds> (bench_clock::now () - start).count ();
 }
 
-/* Insert one measurement on a random device, a random topic and a random value
+/*
+ * \brief Per thread workload, the elements of a thread are not written by
+ *  the others, so the samples of a topic never collide
  */
-void insert_new_measurement(
-        int device_id,
-        int topic_id,
-        tntdb::Connection conn
-        //persist::TopicCache &cache,
-        //persist::MultiRowCache &multi_row
-){
-    char topic_name[32];
-    char device_name[32];
-
-    snprintf(device_name,32,"bench.asset%d",device_id);
-    snprintf(topic_name,32,"bench.topic%d@%s",topic_id,device_name);
-
-    insert_into_measurement(
-            conn, topic_name, rand() % 999999, 0, time(NULL),
-            "%", device_name);
+class Worker {
+    public:
+        Worker (const options_t &options, int index) :
+            _options (options),
+            _index (index),
+            _rng (options.seed + (uint32_t) index)
+        {
+            for (int e = index; e < options.elements; e += options.threads)
+                _elements.push_back (e);
+            _interval = options.rate > 0 ? chrono::nanoseconds (1000000000L / options.rate) : chrono::nanoseconds (0);
+        }
+
+        bool connect ()
+        {
+            try {
+                _conn = tntdb::connect (url);
+                return true;
+            }
+            catch (const std::exception &e) {
+                log_error ("thread %d can't connect to the database: %s", _index, e.what ());
+                return false;
+            }
+        }
+
+        // true while the scenario goes on, waits for the next scheduled
+        // operation and returns its start time
+        bool next (long done, bench_clock::time_point end, bench_clock::time_point &start)
+        {
+            if (zsys_interrupted)
+                return false;
+            if (_options.ops > 0 ? done >= _options.ops : bench_clock::now () >= end)
+                return false;
+            if (_interval.count () == 0) {
+                start = bench_clock::now ();
+                return true;
+            }
+            if (_scheduled == bench_clock::time_point ())
+                _scheduled = bench_clock::now ();
+            start = _scheduled;
+            _scheduled += _interval;
+            std::this_thread::sleep_until (start);
+            return true;
+        }
+
+        void insert (const char *prefix, int64_t timestamp, const char *operation, bench_clock::time_point start)
+        {
+            std::string asset = s_asset_name (prefix, random_element ());
+            std::string topic = s_topic_name (asset, random_int (_options.topics));
+            int rv = insert_into_measurement (_conn, topic.c_str (), random_value (), random_scale (),
+                                              timestamp, "W", asset.c_str ());
+            _results [operation].add (s_elapsed_us (start), rv == 0, 1);
+        }
+
+        void steady (bench_clock::time_point end)
+        {
+            // one second per row, the timestamps of the thread never repeat
+            int64_t timestamp = time (NULL);
+            bench_clock::time_point start;
+            for (long done = 0; next (done, end, start); done++)
+                insert ("bench.asset", timestamp++, "insert", start);
+        }
+
+        void burst (bench_clock::time_point end)
+        {
+            int64_t timestamp = time (NULL);
+            bench_clock::time_point start;
+            for (long done = 0; next (done, end, start); done++) {
+                for (int i = 0; i < _options.burst; i++)
+                    insert ("bench.asset", timestamp++, "insert", bench_clock::now ());
+                _results ["burst"].add (s_elapsed_us (start), true, (uint64_t) _options.burst);
+                std::this_thread::sleep_for (chrono::milliseconds (_options.idle));
+            }
+        }
+
+        // every cycle stores all the topics of the elements at once, as the
+        // pull of the shared memory does
+        void shm (bench_clock::time_point end)
+        {
+            int64_t timestamp = time (NULL);
+            MultiRowCache rows;
+            bench_clock::time_point start;
+            for (long done = 0; next (done, end, start); done++) {
+                bool ok = true;
+                for (int element : _elements) {
+                    std::string asset = s_asset_name ("bench.asset", element);
+                    for (int t = 0; t < _options.topics; t++) {
+                        std::string topic = s_topic_name (asset, t);
+                        if (prepare_measurement (_conn, topic.c_str (), random_value (), random_scale (),
+                                                 timestamp, "W", asset.c_str (), rows) != 0)
+                            ok = false;
+                    }
+                }
+                size_t count = rows.size ();
+                insert_rows_into_measurement (_conn, rows);
+                _results ["shm_cycle"].add (s_elapsed_us (start), ok, count);
+                timestamp++;
+            }
+        }
+
+        void get (const char *prefix, bench_clock::time_point start)
+        {
+            std::string asset = s_asset_name (prefix, random_element ());
+            std::string topic = s_topic_name (asset, random_int (_options.topics));
+            size_t span = (size_t) random_int ((int) spans_count);
+            int64_t now = time (NULL);
+            int64_t end_timestamp = now - std::uniform_int_distribution<int64_t> (0, preload_window - spans [span].seconds) (_rng);
+
+            uint64_t points = 0;
+            std::vector<m_msrmnt_tpc_id_t> topic_ids;
+            std::string units;
+            int rv = resolve_topic (url, topic, topic_ids, units);
+            if (rv == 0) {
+                std::function<void(int64_t, m_msrmnt_value_t, m_msrmnt_scale_t)> cb =
+                    [&points](int64_t, m_msrmnt_value_t, m_msrmnt_scale_t) { points++; };
+                rv = select_measurements_by_id (url, topic_ids, end_timestamp - spans [span].seconds,
+                                                end_timestamp, cb, true);
+            }
+            _results [std::string ("get_") + spans [span].name].add (s_elapsed_us (start), rv == 0, points);
+        }
+
+        void get (bench_clock::time_point end)
+        {
+            bench_clock::time_point start;
+            for (long done = 0; next (done, end, start); done++)
+                get ("bench.asset", start);
+        }
+
+        void mixed (bench_clock::time_point end)
+        {
+            int64_t timestamp = time (NULL);
+            bench_clock::time_point start;
+            for (long done = 0; next (done, end, start); done++) {
+                if (random_int (100) < _options.read_ratio)
+                    get ("bench.asset", start);
+                else
+                    insert ("bench.asset", timestamp++, "insert", start);
+            }
+        }
+
+        // the elements of the thread are deleted one by one, each once
+        void remove (bench_clock::time_point end)
+        {
+            bench_clock::time_point start;
+            for (size_t i = 0; i < _elements.size () && next ((long) i, end, start); i++) {
+                std::string asset = s_asset_name ("bench.delete.asset", _elements [i]);
+                int rv = delete_measurements (_conn, asset.c_str ());
+                _results ["delete_asset"].add (s_elapsed_us (start), rv == 0,
+                                               (uint64_t) _options.topics * _options.preload);
+            }
+        }
+
+        // samples of all the topics of the elements, evenly spread over
+        // the preload window
+        int preload (const char *prefix)
+        {
+            if (_options.preload <= 0)
+                return 0;
+            int64_t now = time (NULL);
+            int64_t step = std::max<int64_t> (preload_window / _options.preload, 1);
+            MultiRowCache rows;
+            for (int element : _elements) {
+                std::string asset = s_asset_name (prefix, element);
+                for (int t = 0; t < _options.topics && !zsys_interrupted; t++) {
+                    std::string topic = s_topic_name (asset, t);
+                    for (int i = 0; i < _options.preload; i++) {
+                        if (prepare_measurement (_conn, topic.c_str (), random_value (), random_scale (),
+                                                 now - preload_window + i * step, "W", asset.c_str (), rows) != 0)
+                            return -1;
+                    }
+                    insert_rows_into_measurement (_conn, rows);
+                }
+            }
+            return 0;
+        }
+
+        thread_results_t &results () { return _results; }
+
+    private:
+        int random_int (int bound) { return std::uniform_int_distribution<int> (0, bound - 1) (_rng); }
+        int random_element () { return _elements [(size_t) random_int ((int) _elements.size ())]; }
+        m_msrmnt_value_t random_value () { return std::uniform_int_distribution<m_msrmnt_value_t> (0, 999999) (_rng); }
+        m_msrmnt_scale_t random_scale () { return (m_msrmnt_scale_t) -random_int (3); }
 
+        const options_t &_options;
+        int _index;
+        std::mt19937 _rng;
+        std::vector<int> _elements;
+        chrono::nanoseconds _interval;
+        bench_clock::time_point _scheduled;
+        tntdb::Connection _conn;
+        thread_results_t _results;
+};
+
+static bool
+s_is_scenario (const std::string &name)
+{
+    return name == "steady" || name == "burst" || name == "shm" ||
+           name == "get" || name == "mixed" || name == "delete";
 }
 
 /*
- * do the bench insertion
- * \param delay       - pause between each insertion (in ms), 0 means no delay
- * \param num_device  - number of simulated device
- * \param topic_per_device  - number of topic per device simulated
- * \param total_duration    - bench duration in minute, -1 means infinite loop
- * \param insertion         - number of maximum row before inserting in multi-row
- * \param periodic_display  - Each periodic_display seconds, output
- *  time; total rows; row over since periodic_display s  ; average since periodic_display s
+ * \brief run one scenario in all the threads, return false if it failed
+ *  before any operation
  */
-void bench(
-        int delay=100,
-        int num_device=100,
-        int topic_per_device=100,
-        int periodic_display=10,
-        int total_duration=-1,
-        int insertion=10){
-
-    log_info("delay=%dms periodic=%ds minute=%dm element=%d topic=%d insert_every=%d",
-            delay,periodic_display,total_duration,num_device,topic_per_device,insertion);
-    tntdb::Connection conn;
-    try {
-        conn = tntdb::connectCached(url);
-        conn.ping();
-    } catch (const std::exception &e) {
-        log_error("Can't connect to the database");
-        return;
+static bool
+s_run_scenario (const options_t &options, const std::string &scenario, std::vector<result_t> &results)
+{
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < options.threads; i++) {
+        workers.emplace_back (new Worker (options, i));
+        if (!workers.back ()->connect ())
+            return false;
     }
 
-    int stat_total_row=0;
-    int stat_periodic_row=0;
+    // the queries need samples, the deletes need assets of their own
+    const char *preload_prefix = NULL;
+    if (scenario == "get" || scenario == "mixed")
+        preload_prefix = "bench.asset";
+    else if (scenario == "delete")
+        preload_prefix = "bench.delete.asset";
+    if (preload_prefix) {
+        log_info ("%s: preload %d samples of %d topics", scenario.c_str (), options.preload,
+                  options.elements * options.topics);
+        std::atomic<int> failed (0);
+        std::vector<std::thread> threads;
+        for (auto &worker : workers)
+            threads.emplace_back ([&failed, &worker, preload_prefix] {
+                if (worker->preload (preload_prefix) != 0) failed++;
+            });
+        for (auto &thread : threads)
+            thread.join ();
+        flush_measurement (url);
+        if (failed != 0) {
+            log_error ("%s: preload failed", scenario.c_str ());
+            return false;
+        }
+    }
 
-    zsys_catch_interrupts ();
+    log_info ("%s: %d threads, seed %" PRIu32, scenario.c_str (), options.threads, options.seed);
+    bench_clock::time_point begin = bench_clock::now ();
+    bench_clock::time_point end = begin + chrono::seconds (options.duration);
+    std::vector<std::thread> threads;
+    for (auto &worker : workers) {
+        Worker *w = worker.get ();
+        if (scenario == "steady")
+            threads.emplace_back (&Worker::steady, w, end);
+        else if (scenario == "burst")
+            threads.emplace_back (&Worker::burst, w, end);
+        else if (scenario == "shm")
+            threads.emplace_back (&Worker::shm, w, end);
+        else if (scenario == "get")
+            threads.emplace_back ([w, end] { w->get (end); });
+        else if (scenario == "mixed")
+            threads.emplace_back (&Worker::mixed, w, end);
+        else
+            threads.emplace_back (&Worker::remove, w, end);
+    }
+    for (auto &thread : threads)
+        thread.join ();
+    // the samples not inserted yet belong to the scenario
+    flush_measurement (url);
+    double elapsed_s = s_elapsed_us (begin) / 1000000.0;
 
-    long begin_overall_ms = get_clock_ms();
-    long begin_periodic_ms = get_clock_ms();
-
-    int dev_by_topic=num_device * topic_per_device;
-
-    log_info("time;total;rows; mean over last %ds (row/s)",periodic_display);
-    while(!zsys_interrupted) {
-        insert_new_measurement(stat_total_row%dev_by_topic/topic_per_device, stat_total_row%topic_per_device,
-                conn);
-        //count stat
-        stat_total_row++;
-        stat_periodic_row++;
-        //time to display stat ?
-        long now_ms = get_clock_ms();
-        long elapsed_periodic_ms = (now_ms - begin_periodic_ms);
-        //every period seconds display current total row count and the trend over the last periodic_display second
-        if(elapsed_periodic_ms > periodic_display * 1000 ){
-            log_info("%s;%d;%d;%.2lf",get_clock_fmt(),stat_total_row,stat_periodic_row,stat_periodic_row/(elapsed_periodic_ms/1000.0));
-            stat_periodic_row=0;
-            begin_periodic_ms = now_ms;
-        }
-        if (total_duration>0 && (now_ms - begin_overall_ms)/1000.0/60.0>total_duration)goto exit;
-
-        //sleep before loop
-        if(delay>0)usleep(delay*1000);
+    std::map<std::string, Latencies> merged;
+    for (auto &worker : workers)
+        for (auto &it : worker->results ())
+            merged [it.first].merge (it.second);
+    for (auto &it : merged) {
+        it.second.sort ();
+        results.push_back (result_t { scenario, it.first, elapsed_s, std::move (it.second) });
     }
+    return true;
+}
 
-exit:
-    flush_measurement(url);
-    long elapsed_overall_ms = (get_clock_ms() - begin_overall_ms);
+static void
+s_print_results (const std::vector<result_t> &results)
+{
+    printf ("%-8s %-12s %10s %8s %12s %12s %10s %10s %10s %10s\n",
+            "scenario", "operation", "count", "errors", "ops/s", "rows/s",
+            "p50_us", "p99_us", "p999_us", "max_us");
+    for (const result_t &r : results) {
+        printf ("%-8s %-12s %10zu %8" PRIu64 " %12.1f %12.1f %10" PRIi64 " %10" PRIi64 " %10" PRIi64 " %10" PRIi64 "\n",
+                r.scenario.c_str (), r.operation.c_str (), r.latencies.count (), r.latencies.errors (),
+                r.latencies.count () / r.elapsed_s, r.latencies.rows () / r.elapsed_s,
+                r.latencies.percentile (0.5), r.latencies.percentile (0.99),
+                r.latencies.percentile (0.999), r.latencies.percentile (1.0));
+    }
+}
 
-    log_info("%d rows inserted in  %.2lf seconds, overall avg=%.2lf row/s",stat_total_row,elapsed_overall_ms/1000.0,stat_total_row/(elapsed_overall_ms/1000.0));
+static void
+s_write_csv (FILE *file, const options_t &options, const std::vector<result_t> &results)
+{
+    fprintf (file, "scenario,operation,threads,seed,count,errors,elapsed_s,ops_per_s,rows_per_s,"
+                   "mean_us,p50_us,p99_us,p999_us,max_us\n");
+    for (const result_t &r : results) {
+        fprintf (file, "%s,%s,%d,%" PRIu32 ",%zu,%" PRIu64 ",%.3f,%.1f,%.1f,%.1f,%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 "\n",
+                 r.scenario.c_str (), r.operation.c_str (), options.threads, options.seed,
+                 r.latencies.count (), r.latencies.errors (), r.elapsed_s,
+                 r.latencies.count () / r.elapsed_s, r.latencies.rows () / r.elapsed_s, r.latencies.mean (),
+                 r.latencies.percentile (0.5), r.latencies.percentile (0.99),
+                 r.latencies.percentile (0.999), r.latencies.percentile (1.0));
+    }
+}
+
+static void
+s_write_json (FILE *file, const options_t &options, const std::vector<result_t> &results)
+{
+    char started [32];
+    time_t now = time (NULL);
+    struct tm tm;
+    gmtime_r (&now, &tm);
+    strftime (started, sizeof (started), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    fprintf (file, "{\n");
+    fprintf (file, "  \"version\": \"%d.%d.%d\",\n", FTY_METRIC_STORE_VERSION_MAJOR,
+             FTY_METRIC_STORE_VERSION_MINOR, FTY_METRIC_STORE_VERSION_PATCH);
+    fprintf (file, "  \"finished\": \"%s\",\n", started);
+    fprintf (file, "  \"options\": { \"threads\": %d, \"seed\": %" PRIu32 ", \"duration_s\": %d, \"ops\": %ld, "
+                   "\"rate\": %d, \"elements\": %d, \"topics\": %d, \"preload\": %d, \"burst\": %d, "
+                   "\"idle_ms\": %d, \"read_ratio\": %d, \"flush_worker\": %s },\n",
+             options.threads, options.seed, options.duration, options.ops, options.rate,
+             options.elements, options.topics, options.preload, options.burst, options.idle,
+             options.read_ratio, options.flush_worker ? "true" : "false");
+    fprintf (file, "  \"results\": [");
+    for (size_t i = 0; i < results.size (); i++) {
+        const result_t &r = results [i];
+        fprintf (file, "%s\n    { \"scenario\": \"%s\", \"operation\": \"%s\", \"count\": %zu, \"errors\": %" PRIu64 ", "
+                       "\"elapsed_s\": %.3f, \"ops_per_s\": %.1f, \"rows_per_s\": %.1f, \"mean_us\": %.1f, "
+                       "\"p50_us\": %" PRIi64 ", \"p99_us\": %" PRIi64 ", \"p999_us\": %" PRIi64 ", \"max_us\": %" PRIi64 " }",
+                 i == 0 ? "" : ",", r.scenario.c_str (), r.operation.c_str (),
+                 r.latencies.count (), r.latencies.errors (), r.elapsed_s,
+                 r.latencies.count () / r.elapsed_s, r.latencies.rows () / r.elapsed_s, r.latencies.mean (),
+                 r.latencies.percentile (0.5), r.latencies.percentile (0.99),
+                 r.latencies.percentile (0.999), r.latencies.percentile (1.0));
+    }
+    fprintf (file, "\n  ]\n}\n");
+}
+
+static int
+s_write_output (const options_t &options, const std::vector<result_t> &results)
+{
+    if (options.output.empty ())
+        return 0;
+
+    std::string format = options.format;
+    if (format.empty ()) {
+        size_t dot = options.output.rfind ('.');
+        format = dot != std::string::npos && options.output.substr (dot) == ".csv" ? "csv" : "json";
+    }
+
+    FILE *file = options.output == "-" ? stdout : fopen (options.output.c_str (), "w");
+    if (!file) {
+        log_error ("can't write %s: %s", options.output.c_str (), strerror (errno));
+        return 1;
+    }
+    if (format == "csv")
+        s_write_csv (file, options, results);
+    else
+        s_write_json (file, options, results);
+    if (file != stdout)
+        fclose (file);
+    return 0;
 }
 
 void usage ()
 {
     puts ("dbstore_bench [options] \n"
           "  -u|--url              mysql:db=box_utf8;user=bios;password=test (or set DB_PASSWD and DB_USER env variable)\n"
-          "  -d|--delay            pause between each insertion (in ms), 0 means no delay [100]\n"
-          "  -p|--periodic         output time; row; average each periodic_display seconds [10]\n"
-          "  -m|--minute           bench duration in minute, -1 means infinite loop [-1]\n"
-          "  -e|--element          number of simulated elements [100]\n"
-          "  -t|--topic            number of simulated topic per element [100]\n"
-          "  -i|--insert_every     do a multi row insertion on every X measurement[10]\n"
+          "  -s|--scenario         comma separated list of steady, burst, shm, get, mixed, delete or all [steady]\n"
+          "  -c|--concurrency      number of threads [4]\n"
+          "  -S|--seed             seed of the random workload [1]\n"
+          "  -d|--duration         duration of each scenario in seconds [30]\n"
+          "  -n|--ops              number of operations per thread instead of a duration [0]\n"
+          "  -r|--rate             operations per second and thread, 0 means no limit [0]\n"
+          "  -e|--element          number of simulated elements [20]\n"
+          "  -t|--topic            number of simulated topic per element [10]\n"
+          "  -P|--preload          samples per topic inserted before get, mixed and delete [1000]\n"
+          "  -b|--burst            inserts of one burst [1000]\n"
+          "  -i|--idle             pause between two bursts in ms [1000]\n"
+          "  -R|--read-ratio       percentage of GET in the mixed scenario [50]\n"
+          "  -W|--no-flush-worker  insert the rows in the producing thread\n"
+          "  -o|--output           write the results to this file, - for stdout\n"
+          "  -f|--format           json or csv, guessed from the output file name [json]\n"
           "  -h|--help             print this information");
 }
 
-/*
- *
- */
 int main(int argc, char** argv) {
-    // set default
     int help = 0;
-    int delay=100; //ms
-    int periodic=10; //s
-    int minute=-1; //min
-    int element=100;
-    int topic=100;
-    int insert_every=10;
-
-     // get options
+    options_t options;
+    std::string scenarios = "steady";
+
     int c;
 // Some systems define struct option with non-"const" "char *"
 #if defined(__GNUC__) || defined(__GNUG__)
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wwrite-strings"
 #endif
-    static const char *short_options = "h:u:d:p:m:e:t:i:";
+    static const char *short_options = "hu:s:c:S:d:n:r:e:t:P:b:i:R:Wo:f:";
     static struct option long_options[] =
     {
-            {"help",       no_argument,       &help,    1},
-            {"url",        required_argument, 0,'u'},
-            {"delay",      required_argument, 0,'d'},
-            {"periodic",   required_argument, 0,'p'},
-            {"minute",     required_argument, 0,'m'},
-            {"element",    required_argument, 0,'e'},
-            {"topic",      required_argument, 0,'t'},
-            {"insert_every",  required_argument, 0,'i'},
+            {"help",            no_argument,       &help,    1},
+            {"url",             required_argument, 0,'u'},
+            {"scenario",        required_argument, 0,'s'},
+            {"concurrency",     required_argument, 0,'c'},
+            {"seed",            required_argument, 0,'S'},
+            {"duration",        required_argument, 0,'d'},
+            {"ops",             required_argument, 0,'n'},
+            {"rate",            required_argument, 0,'r'},
+            {"element",         required_argument, 0,'e'},
+            {"topic",           required_argument, 0,'t'},
+            {"preload",         required_argument, 0,'P'},
+            {"burst",           required_argument, 0,'b'},
+            {"idle",            required_argument, 0,'i'},
+            {"read-ratio",      required_argument, 0,'R'},
+            {"no-flush-worker", no_argument,       0,'W'},
+            {"output",          required_argument, 0,'o'},
+            {"format",          required_argument, 0,'f'},
             {NULL, 0, 0, 0}
     };
 #if defined(__GNUC__) || defined(__GNUG__)
@@ -205,23 +605,50 @@ int main(int argc, char** argv) {
         case 'u':
             url = optarg;
             break;
+        case 's':
+            scenarios = optarg;
+            break;
+        case 'c':
+            options.threads = atoi(optarg);
+            break;
+        case 'S':
+            options.seed = (uint32_t) strtoul(optarg, NULL, 10);
+            break;
         case 'd':
-            delay = atoi(optarg);
+            options.duration = atoi(optarg);
             break;
-        case 'p':
-            periodic = atoi(optarg);
+        case 'n':
+            options.ops = atol(optarg);
             break;
-        case 'm':
-            minute = atoi(optarg);
+        case 'r':
+            options.rate = atoi(optarg);
             break;
         case 'e':
-            element = atoi(optarg);
+            options.elements = atoi(optarg);
             break;
         case 't':
-            topic = atoi(optarg);
+            options.topics = atoi(optarg);
+            break;
+        case 'P':
+            options.preload = atoi(optarg);
+            break;
+        case 'b':
+            options.burst = atoi(optarg);
             break;
         case 'i':
-            insert_every = atoi(optarg);
+            options.idle = atoi(optarg);
+            break;
+        case 'R':
+            options.read_ratio = atoi(optarg);
+            break;
+        case 'W':
+            options.flush_worker = false;
+            break;
+        case 'o':
+            options.output = optarg;
+            break;
+        case 'f':
+            options.format = optarg;
             break;
         case 0:
             // just now walking trough some long opt
@@ -232,11 +659,55 @@ int main(int argc, char** argv) {
             break;
         }
     }
+
+    if (scenarios == "all")
+        scenarios = "steady,burst,shm,get,mixed,delete";
+    std::stringstream list (scenarios);
+    std::string scenario;
+    while (std::getline (list, scenario, ',')) {
+        if (!s_is_scenario (scenario)) {
+            fprintf (stderr, "unknown scenario '%s'\n", scenario.c_str ());
+            help = 1;
+        }
+        options.scenarios.push_back (scenario);
+    }
+    if (options.threads <= 0 || options.elements <= 0 || options.topics <= 0 ||
+        options.duration <= 0 || options.read_ratio < 0 || options.read_ratio > 100 ||
+        (!options.format.empty () && options.format != "json" && options.format != "csv"))
+        help = 1;
     if (help) { usage(); exit(1); }
 
+    if (options.threads > options.elements) {
+        // a thread owns its elements, the samples of two threads never collide
+        fprintf (stderr, "%d threads for %d elements, use %d threads\n",
+                 options.threads, options.elements, options.elements);
+        options.threads = options.elements;
+    }
+
     ManageFtyLog::setInstanceFtylog("dbstore_bench", LOG_CONFIG);
     log_debug("## bench started ##");
+    zsys_catch_interrupts ();
 
-    bench(delay,element, topic,  periodic, minute, insert_every);
-    return 0;
+    // same insertion path as the agent
+    if (options.flush_worker)
+        flush_worker_start (url);
+
+    std::vector<result_t> results;
+    int rv = 0;
+    for (const std::string &name : options.scenarios) {
+        if (zsys_interrupted)
+            break;
+        if (!s_run_scenario (options, name, results)) {
+            rv = 1;
+            break;
+        }
+    }
+
+    if (options.flush_worker)
+        flush_worker_stop ();
+
+    s_print_results (results);
+    if (s_write_output (options, results) != 0)
+        rv = 1;
+    return rv;
 }
@@ -0,0 +1,428 @@
+/*  =========================================================================
+    downsampler - Reduce a series of points to a maximal count
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    downsampler - Reduce a series of points to a maximal count
+@discuss
+    A graph is a few hundred pixels wide, a year of 15m averages is 35k
+    points. The downsampler reduces the points while they are read from
+    the database, so the reply is never bigger than the client asked for.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <ctime>
+
+bool
+downsample_method_from_string (const std::string &name, downsample_method_t &method)
+{
+    if (name == "min")
+        method = DOWNSAMPLE_MIN;
+    else if (name == "max")
+        method = DOWNSAMPLE_MAX;
+    else if (name == "avg")
+        method = DOWNSAMPLE_AVG;
+    else if (name == "minmax")
+        method = DOWNSAMPLE_MINMAX;
+    else if (name == "lttb")
+        method = DOWNSAMPLE_LTTB;
+    else
+        return false;
+    return true;
+}
+
+size_t
+downsample_min_points (downsample_method_t method)
+{
+    switch (method) {
+        case DOWNSAMPLE_MINMAX:
+            return 2;
+        case DOWNSAMPLE_LTTB:
+            // the first point, the last point and one bucket
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * \brief value and scale of the real value, with the finest scale such
+ *  that the value fits into m_msrmnt_value_t
+ */
+static void
+s_quantize (double real, m_msrmnt_scale_t finest_scale, m_msrmnt_value_t &value, m_msrmnt_scale_t &scale)
+{
+    for (int s = finest_scale; s < SCHAR_MAX; s++) {
+        double v = std::llround (real / std::pow (10, s));
+        if (v >= INT32_MIN && v <= INT32_MAX) {
+            value = (m_msrmnt_value_t) v;
+            scale = (m_msrmnt_scale_t) s;
+            return;
+        }
+    }
+    value = real < 0 ? INT32_MIN : INT32_MAX;
+    scale = SCHAR_MAX;
+}
+
+double
+Downsampler::Point::real () const
+{
+    return value * std::pow (10, scale);
+}
+
+void
+Downsampler::Bucket::add (const Point &point, bool keep)
+{
+    if (count == 0) {
+        first = min = max = point;
+        finest_scale = point.scale;
+    }
+    else {
+        double real = point.real ();
+        if (real < min.real ()) min = point;
+        if (real > max.real ()) max = point;
+        finest_scale = std::min (finest_scale, point.scale);
+    }
+    count++;
+    sum += point.real ();
+    time_sum += point.timestamp;
+    if (keep)
+        points.push_back (point);
+}
+
+void
+Downsampler::Bucket::clear ()
+{
+    count = 0;
+    sum = 0;
+    time_sum = 0;
+    points.clear ();
+}
+
+Downsampler::Downsampler (
+    downsample_method_t method,
+    size_t max_points,
+    int64_t end,
+    Output output) :
+    _method (method),
+    _end (end),
+    _output (output)
+{
+    assert (max_points >= downsample_min_points (method));
+    switch (method) {
+        case DOWNSAMPLE_MINMAX:
+            _buckets = max_points / 2;
+            break;
+        case DOWNSAMPLE_LTTB:
+            _buckets = max_points - 2;
+            break;
+        default:
+            _buckets = max_points;
+    }
+}
+
+size_t
+Downsampler::bucket_of (int64_t timestamp)
+{
+    if (_end <= _start || timestamp <= _start)
+        return 0;
+    double id = (double) (timestamp - _start) * _buckets / (_end - _start + 1);
+    return std::min ((size_t) id, _buckets - 1);
+}
+
+void
+Downsampler::emit (const Point &point)
+{
+    _output (point.timestamp, point.value, point.scale);
+}
+
+void
+Downsampler::emit_bucket (Bucket &bucket)
+{
+    if (bucket.count == 0)
+        return;
+
+    switch (_method) {
+        case DOWNSAMPLE_MIN:
+            emit (bucket.min);
+            break;
+        case DOWNSAMPLE_MAX:
+            emit (bucket.max);
+            break;
+        case DOWNSAMPLE_MINMAX:
+            if (bucket.min.timestamp == bucket.max.timestamp)
+                emit (bucket.min);
+            else if (bucket.min.timestamp < bucket.max.timestamp) {
+                emit (bucket.min);
+                emit (bucket.max);
+            }
+            else {
+                emit (bucket.max);
+                emit (bucket.min);
+            }
+            break;
+        case DOWNSAMPLE_AVG:
+            if (bucket.count == 1)
+                emit (bucket.first);
+            else {
+                Point point;
+                point.timestamp = bucket.time_sum / (int64_t) bucket.count;
+                // the decimals of the mean like the aggregated steps, a mean
+                // beyond the range of the values keeps the coarser scales
+                double mean = bucket.sum / bucket.count;
+                int8_t scale = 0;
+                if (dtobiosf (mean, point.value, scale))
+                    point.scale = scale;
+                else
+                    s_quantize (mean, bucket.finest_scale, point.value, point.scale);
+                emit (point);
+            }
+            break;
+        case DOWNSAMPLE_LTTB:
+            // buckets are selected by emit_largest_triangle ()
+            break;
+    }
+}
+
+void
+Downsampler::emit_largest_triangle (Bucket &bucket, double next_time, double next_value)
+{
+    // times relative to the start keep the precision of the doubles
+    double a_time = _selected.timestamp - _start;
+    double a_value = _selected.real ();
+    next_time -= _start;
+
+    double max_area = -1;
+    const Point *selected = NULL;
+    for (const Point &point : bucket.points) {
+        double area = std::fabs (
+            (a_time - next_time) * (point.real () - a_value)
+            - (a_time - (point.timestamp - _start)) * (next_value - a_value));
+        if (area > max_area) {
+            max_area = area;
+            selected = &point;
+        }
+    }
+    assert (selected);
+    _selected = *selected;
+    emit (_selected);
+}
+
+void
+Downsampler::add (int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+{
+    Point point { timestamp, value, scale };
+
+    if (!_started) {
+        // buckets cover the range from the first point to the end, not
+        // later than now as there are no points in future
+        _start = timestamp;
+        _end = std::min<int64_t> (_end, std::max<int64_t> (time (NULL), _start));
+        _started = true;
+        if (_method == DOWNSAMPLE_LTTB) {
+            _selected = point;
+            emit (point);
+            return;
+        }
+    }
+
+    if (_method != DOWNSAMPLE_LTTB) {
+        size_t id = bucket_of (timestamp);
+        if (_current.count != 0 && id != _current.id) {
+            emit_bucket (_current);
+            _current.clear ();
+        }
+        _current.id = id;
+        _current.add (point, false);
+        return;
+    }
+
+    // the last point is always emitted, keep it out of the buckets until
+    // another point comes
+    if (_next.count == 0 && _current.count == 0 && !_has_last) {
+        _last = point;
+        _has_last = true;
+        return;
+    }
+    Point previous = _last;
+    _last = point;
+
+    size_t id = bucket_of (previous.timestamp);
+    if (_next.count != 0 && id != _next.id) {
+        if (_current.count != 0)
+            emit_largest_triangle (_current, (double) _next.time_sum / _next.count, _next.sum / _next.count);
+        std::swap (_current, _next);
+        _next.clear ();
+    }
+    _next.id = id;
+    _next.add (previous, true);
+}
+
+void
+Downsampler::finish ()
+{
+    if (_method != DOWNSAMPLE_LTTB) {
+        emit_bucket (_current);
+        _current.clear ();
+        return;
+    }
+
+    if (!_has_last)
+        return;
+    if (_current.count != 0)
+        emit_largest_triangle (_current, (double) _next.time_sum / _next.count, _next.sum / _next.count);
+    if (_next.count != 0)
+        emit_largest_triangle (_next, _last.timestamp, _last.real ());
+    emit (_last);
+    _current.clear ();
+    _next.clear ();
+    _has_last = false;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+downsampler_test (bool verbose)
+{
+    printf (" * downsampler: ");
+
+    //  @selftest
+    struct Out { int64_t timestamp; m_msrmnt_value_t value; m_msrmnt_scale_t scale; };
+    std::vector<Out> out;
+    Downsampler::Output output = [&out](int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+        {
+            out.push_back (Out { timestamp, value, scale });
+        };
+
+    downsample_method_t method;
+    assert (downsample_method_from_string ("lttb", method) && method == DOWNSAMPLE_LTTB);
+    assert (downsample_method_from_string ("minmax", method) && method == DOWNSAMPLE_MINMAX);
+    assert (!downsample_method_from_string ("median", method));
+    assert (downsample_min_points (DOWNSAMPLE_LTTB) == 3);
+
+    // 100 points 0..99 at 1000..1990, 10 buckets of 100s
+    {
+        Downsampler avg (DOWNSAMPLE_AVG, 10, 1999, output);
+        for (int i = 0; i != 100; i++)
+            avg.add (1000 + i * 10, i, 0);
+        avg.finish ();
+        assert (out.size () == 10);
+        // mean of 0..9 is 4.5, not rounded to the scale of the points
+        assert (out [0].timestamp == 1045 && out [0].value == 45 && out [0].scale == -1);
+        assert (out [9].timestamp == 1945 && out [9].value == 945 && out [9].scale == -1);
+        out.clear ();
+
+        Downsampler min (DOWNSAMPLE_MIN, 10, 1999, output);
+        Downsampler max (DOWNSAMPLE_MAX, 10, 1999, output);
+        for (int i = 0; i != 100; i++) {
+            min.add (1000 + i * 10, i, 0);
+        }
+        min.finish ();
+        assert (out.size () == 10);
+        assert (out [3].timestamp == 1300 && out [3].value == 30);
+        out.clear ();
+        for (int i = 0; i != 100; i++) {
+            max.add (1000 + i * 10, i % 2 ? -i : i, 0);
+        }
+        max.finish ();
+        assert (out.size () == 10);
+        assert (out [3].timestamp == 1380 && out [3].value == 38);
+        out.clear ();
+    }
+
+    // minmax emits the extremes in time order, only once a flat bucket
+    {
+        Downsampler minmax (DOWNSAMPLE_MINMAX, 4, 1399, output);
+        int values[] = { 5, 9, 1, 3, 7, 7, 7, 7 };
+        for (int i = 0; i != 8; i++)
+            minmax.add (1000 + i * 50, values [i], 0);
+        minmax.finish ();
+        assert (minmax.get_buckets () == 2);
+        assert (out.size () == 3);
+        assert (out [0].timestamp == 1050 && out [0].value == 9);
+        assert (out [1].timestamp == 1100 && out [1].value == 1);
+        assert (out [2].timestamp == 1200 && out [2].value == 7);
+        out.clear ();
+    }
+
+    // an average not fitting the finest scale moves to a coarser one
+    {
+        Downsampler avg (DOWNSAMPLE_AVG, 1, 2000, output);
+        avg.add (1000, INT32_MAX, 1);
+        avg.add (1002, 1, 0);
+        avg.finish ();
+        assert (out.size () == 1);
+        assert (out [0].timestamp == 1001 && out [0].scale == 1);
+        assert (out [0].value == 1073741824);
+        out.clear ();
+    }
+
+    // lttb keeps the first point, the last point and the peaks
+    {
+        Downsampler lttb (DOWNSAMPLE_LTTB, 7, 1999, output);
+        assert (lttb.get_buckets () == 5);
+        for (int i = 0; i != 100; i++)
+            lttb.add (1000 + i * 10, i == 33 ? 1000 : (i == 71 ? -1000 : 0), 0);
+        lttb.finish ();
+        assert (out.size () == 7);
+        assert (out [0].timestamp == 1000);
+        assert (out [6].timestamp == 1990);
+        bool peak = false, pit = false;
+        for (size_t i = 0; i != out.size (); i++) {
+            if (i > 0) assert (out [i].timestamp > out [i - 1].timestamp);
+            if (out [i].timestamp == 1330) peak = out [i].value == 1000;
+            if (out [i].timestamp == 1710) pit = out [i].value == -1000;
+        }
+        assert (peak && pit);
+        out.clear ();
+    }
+
+    // fewer points than buckets are emitted as they are
+    {
+        Downsampler lttb (DOWNSAMPLE_LTTB, 100, 1999, output);
+        for (int i = 0; i != 5; i++)
+            lttb.add (1000 + i * 200, i, -1);
+        lttb.finish ();
+        assert (out.size () == 5);
+        for (int i = 0; i != 5; i++)
+            assert (out [i].timestamp == 1000 + i * 200 && out [i].value == i && out [i].scale == -1);
+        out.clear ();
+
+        Downsampler avg (DOWNSAMPLE_AVG, 100, 1999, output);
+        avg.add (1500, 42, 0);
+        avg.finish ();
+        assert (out.size () == 1 && out [0].value == 42);
+        out.clear ();
+
+        Downsampler empty (DOWNSAMPLE_LTTB, 3, 1999, output);
+        empty.finish ();
+        assert (out.empty ());
+    }
+    //  @end
+
+    printf ("OK\n");
+}
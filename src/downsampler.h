@@ -0,0 +1,129 @@
+/*  =========================================================================
+    downsampler - Reduce a series of points to a maximal count
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef DOWNSAMPLER_H_INCLUDED
+#define DOWNSAMPLER_H_INCLUDED
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// points of the aggregated data reduced when max_points is requested
+#define DOWNSAMPLE_METHOD_DEFAULT DOWNSAMPLE_AVG
+
+typedef enum {
+    // one point per bucket: minimal, maximal or average value
+    DOWNSAMPLE_MIN,
+    DOWNSAMPLE_MAX,
+    DOWNSAMPLE_AVG,
+    // the minimal and the maximal point of each bucket, in time order
+    DOWNSAMPLE_MINMAX,
+    // largest triangle three buckets, keeps the visual shape
+    DOWNSAMPLE_LTTB
+} downsample_method_t;
+
+// return false if the name is not one of "min", "max", "avg", "minmax", "lttb"
+FTY_METRIC_STORE_PRIVATE bool
+    downsample_method_from_string (const std::string &name, downsample_method_t &method);
+
+// smallest max_points the method can respect
+FTY_METRIC_STORE_PRIVATE size_t
+    downsample_min_points (downsample_method_t method);
+
+/*
+ * \brief Streaming reduction of time ordered points
+ *
+ * The time range from the first point to the end is split into buckets
+ * of equal duration, the points of each bucket are reduced as soon as
+ * a point of a following bucket comes. Only min/max/avg of the current
+ * bucket are kept, LTTB keeps the points of two buckets. Points of
+ * reduced buckets are given to output, averages keep two decimals like
+ * the aggregated steps.
+ */
+class Downsampler {
+    public:
+        typedef std::function<void(
+            int64_t timestamp,
+            m_msrmnt_value_t value,
+            m_msrmnt_scale_t scale)> Output;
+
+        Downsampler (
+            downsample_method_t method,
+            size_t max_points,
+            int64_t end,
+            Output output);
+
+        // points must come in time order
+        void add (int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale);
+
+        // reduce the remaining points
+        void finish ();
+
+        size_t get_buckets () { return _buckets; }
+
+    private:
+        struct Point {
+            int64_t timestamp;
+            m_msrmnt_value_t value;
+            m_msrmnt_scale_t scale;
+            double real () const;
+        };
+
+        struct Bucket {
+            size_t id = 0;
+            size_t count = 0;
+            Point first, min, max;
+            double sum = 0;
+            int64_t time_sum = 0;
+            m_msrmnt_scale_t finest_scale = 0;
+            // only for LTTB
+            std::vector<Point> points;
+
+            void add (const Point &point, bool keep);
+            void clear ();
+        };
+
+        size_t bucket_of (int64_t timestamp);
+        void emit (const Point &point);
+        void emit_bucket (Bucket &bucket);
+        void emit_largest_triangle (Bucket &bucket, double next_time, double next_value);
+
+        downsample_method_t _method;
+        size_t _buckets;
+        int64_t _start = 0;
+        int64_t _end;
+        bool _started = false;
+        Output _output;
+
+        Bucket _current;
+        // LTTB selects the point of _current once _next is complete
+        Bucket _next;
+        Point _selected;
+        Point _last;
+        bool _has_last = false;
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    downsampler_test (bool verbose);
+
+#endif
@@ -0,0 +1,255 @@
+/*  =========================================================================
+    flush_policy - Adaptive limits of the multi row cache flushes
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    flush_policy - Adaptive limits of the multi row cache flushes
+@discuss
+    With fixed limits, a quiet system inserts a few rows every second and
+    a burst builds statements as big as the row limit allows, whatever the
+    database can take. The adaptive policy waits as long as the target
+    delay allows and sizes the batches by the measured cost of a row.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+
+// weight of the newest observation in the moving averages
+#define EWMA_ALPHA 0.2
+
+FlushPolicy::FlushPolicy (size_t max_row, long max_delay_ms)
+{
+    _enabled = false;
+    _min_row = MIN_ROW_DEFAULT;
+    _max_row = max_row;
+    _max_delay_ms = max_delay_ms;
+    _target_delay_ms = TARGET_DELAY_DEFAULT;
+
+    char *env_adaptive = getenv (EV_DBSTORE_ADAPTIVE);
+    if (env_adaptive) {
+        _enabled = atoi (env_adaptive) != 0;
+        log_info ("use %s %d as adaptive flush mode", EV_DBSTORE_ADAPTIVE, _enabled ? 1 : 0);
+    }
+
+    char *env_target = getenv (EV_DBSTORE_TARGET_DELAY);
+    if (env_target) {
+        int target = atoi (env_target);
+        if (target > 0) _target_delay_ms = target;
+        log_info ("use %s %ldms as target delay of insertion", EV_DBSTORE_TARGET_DELAY, _target_delay_ms);
+    }
+
+    char *env_min_row = getenv (EV_DBSTORE_MIN_ROW);
+    if (env_min_row) {
+        int min_row = atoi (env_min_row);
+        if (min_row > 0) _min_row = (size_t) min_row;
+        log_info ("use %s %zu as min row insertion bulk limit", EV_DBSTORE_MIN_ROW, _min_row);
+    }
+
+    _min_row = std::min (_min_row, _max_row);
+    _target_delay_ms = std::max<long> (_target_delay_ms, MIN_DELAY_MS);
+    _row_limit = _max_row;
+    _delay_ms = _max_delay_ms;
+}
+
+FlushPolicy::FlushPolicy (
+    bool enabled,
+    size_t min_row,
+    size_t max_row,
+    long max_delay_ms,
+    long target_delay_ms) :
+    _enabled (enabled),
+    _min_row (std::min (min_row, max_row)),
+    _max_row (max_row),
+    _max_delay_ms (max_delay_ms),
+    _target_delay_ms (std::max<long> (target_delay_ms, MIN_DELAY_MS)),
+    _row_limit (max_row),
+    _delay_ms (max_delay_ms)
+{
+}
+
+void
+FlushPolicy::observe (size_t rows, long latency_ms)
+{
+    observe (rows, latency_ms, zclock_mono ());
+}
+
+void
+FlushPolicy::observe (size_t rows, long latency_ms, int64_t now_ms)
+{
+    if (rows == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock (_mutex);
+
+    double row_cost_ms = (double) latency_ms / rows;
+    if (!_observed) {
+        _latency_ms = latency_ms;
+        _row_cost_ms = row_cost_ms;
+    }
+    else {
+        _latency_ms += EWMA_ALPHA * (latency_ms - _latency_ms);
+        _row_cost_ms += EWMA_ALPHA * (row_cost_ms - _row_cost_ms);
+
+        int64_t elapsed_ms = now_ms - _last_observe_ms;
+        if (elapsed_ms > 0) {
+            double rate = rows * 1000.0 / elapsed_ms;
+            _rate = _rate == 0 ? rate : _rate + EWMA_ALPHA * (rate - _rate);
+        }
+    }
+    _last_observe_ms = now_ms;
+    _observed = true;
+
+    if (_enabled)
+        update ();
+    publish_locked ();
+}
+
+void
+FlushPolicy::update ()
+{
+    // called with _mutex held
+    double delay_ms = _target_delay_ms - 2 * _latency_ms;
+    delay_ms = std::max<double> (delay_ms, MIN_DELAY_MS);
+
+    double rows = _rate * delay_ms / 1000;
+    if (_row_cost_ms > 0)
+        rows = std::min (rows, _target_delay_ms / 2 / _row_cost_ms);
+    rows = std::max (rows, (double) _min_row);
+    rows = std::min (rows, (double) _max_row);
+
+    size_t row_limit = (size_t) rows;
+    long delay = (long) delay_ms;
+    if (row_limit != _row_limit || delay != _delay_ms) {
+        log_debug ("flush policy: %zu rows, %ldms (latency %.1fms, %.3fms/row, %.1f rows/s)",
+                   row_limit, delay, _latency_ms, _row_cost_ms, _rate);
+    }
+    _row_limit = row_limit;
+    _delay_ms = delay;
+}
+
+size_t
+FlushPolicy::get_row_limit ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _row_limit;
+}
+
+long
+FlushPolicy::get_delay_ms ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _delay_ms;
+}
+
+double
+FlushPolicy::get_latency_ms ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _latency_ms;
+}
+
+double
+FlushPolicy::get_row_cost_ms ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _row_cost_ms;
+}
+
+double
+FlushPolicy::get_rate ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _rate;
+}
+
+void
+FlushPolicy::publish ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    publish_locked ();
+}
+
+void
+FlushPolicy::publish_locked ()
+{
+    // called with _mutex held
+    store_stats ().set_gauge (STATS_FLUSH_ROW_LIMIT, (int64_t) _row_limit);
+    store_stats ().set_gauge (STATS_FLUSH_DELAY_MS, (int64_t) _delay_ms);
+    store_stats ().set_gauge (STATS_FLUSH_LATENCY_MS, (int64_t) _latency_ms);
+    store_stats ().set_gauge (STATS_FLUSH_ROW_COST_US, (int64_t) (_row_cost_ms * 1000));
+    store_stats ().set_gauge (STATS_FLUSH_RATE, (int64_t) _rate);
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+flush_policy_test (bool verbose)
+{
+    printf (" * flush_policy: ");
+
+    //  @selftest
+    // fixed limits, observations do not change them
+    FlushPolicy fixed (false, 10, 1000, 1000, 5000);
+    fixed.observe (100, 50, 0);
+    fixed.observe (100, 50, 1000);
+    assert (fixed.get_row_limit () == 1000);
+    assert (fixed.get_delay_ms () == 1000);
+    assert (fixed.get_latency_ms () == 50);
+
+    // 100 rows/s on a fast database: wait almost the target delay
+    FlushPolicy policy (true, 10, 1000, 1000, 5000);
+    assert (policy.get_row_limit () == 1000);
+    assert (policy.get_delay_ms () == 1000);
+    for (int i = 0; i != 10; i++)
+        policy.observe (100, 50, i * 1000);
+    assert (policy.get_rate () > 99 && policy.get_rate () < 101);
+    assert (policy.get_delay_ms () == 4900);
+    assert (policy.get_row_limit () >= 480 && policy.get_row_limit () <= 500);
+
+    // the database slows down: shorter delay, smaller batches
+    for (int i = 10; i != 40; i++)
+        policy.observe (100, 2000, i * 1000);
+    assert (policy.get_delay_ms () < 1100);
+    assert (policy.get_row_limit () < 150);
+    assert (policy.get_row_limit () >= 10);
+
+    // a burst on a fast database is capped by the max row
+    FlushPolicy burst (true, 10, 1000, 1000, 5000);
+    for (int i = 0; i != 10; i++)
+        burst.observe (1000, 20, i * 100);
+    assert (burst.get_row_limit () == 1000);
+
+    // nothing is observed for empty flushes
+    burst.observe (0, 1000, 2000);
+    assert (burst.get_latency_ms () == 20);
+
+    // the decisions and estimates are published as gauges
+    policy.publish ();
+    assert (store_stats ().get_gauge (STATS_FLUSH_ROW_LIMIT) == (int64_t) policy.get_row_limit ());
+    assert (store_stats ().get_gauge (STATS_FLUSH_DELAY_MS) == policy.get_delay_ms ());
+    assert (store_stats ().get_gauge (STATS_FLUSH_RATE) == (int64_t) policy.get_rate ());
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,104 @@
+/*  =========================================================================
+    flush_policy - Adaptive limits of the multi row cache flushes
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FLUSH_POLICY_H_INCLUDED
+#define FLUSH_POLICY_H_INCLUDED
+
+#include <mutex>
+
+// longest time in ms a sample may wait before it is in the database
+#define TARGET_DELAY_DEFAULT 5000
+#define MIN_ROW_DEFAULT 32
+#define MIN_DELAY_MS 100
+
+#define EV_DBSTORE_ADAPTIVE "BIOS_DBSTORE_ADAPTIVE"
+#define EV_DBSTORE_TARGET_DELAY "BIOS_DBSTORE_TARGET_DELAY"
+#define EV_DBSTORE_MIN_ROW "BIOS_DBSTORE_MIN_ROW"
+
+/*
+ * \brief Row and delay limits of the flushes tuned by the observed load
+ *
+ * Every successful flush reports its number of rows and its latency. The
+ * policy keeps moving averages of the latency, of the cost of one row and
+ * of the rate of incoming rows, and derives from them:
+ *  - delay: the time the cache may fill, the target delay minus the
+ *    latency of two flushes, as one may be still in progress
+ *  - row limit: the rows coming during the delay, but no more than can be
+ *    inserted in half of the target delay
+ * Both stay within [MIN_DELAY_MS, target delay] and [min row, max row].
+ * When not enabled, the limits are the fixed max row and max delay.
+ * All methods are thread safe.
+ */
+class FlushPolicy {
+    public:
+        FlushPolicy (size_t max_row, long max_delay_ms);
+        FlushPolicy (
+            bool enabled,
+            size_t min_row,
+            size_t max_row,
+            long max_delay_ms,
+            long target_delay_ms);
+
+        bool is_enabled () { return _enabled; }
+
+        // report a successful flush
+        void observe (size_t rows, long latency_ms);
+        void observe (size_t rows, long latency_ms, int64_t now_ms);
+
+        // current decisions
+        size_t get_row_limit ();
+        long get_delay_ms ();
+
+        // current estimates
+        double get_latency_ms ();
+        double get_row_cost_ms ();
+        double get_rate ();
+
+        // set the flush gauges of the store stats to the values above
+        void publish ();
+
+    private:
+        void update ();
+        void publish_locked ();
+
+        std::mutex _mutex;
+        bool _enabled;
+        size_t _min_row;
+        size_t _max_row;
+        long _max_delay_ms;
+        long _target_delay_ms;
+
+        size_t _row_limit;
+        long _delay_ms;
+
+        double _latency_ms = 0;
+        double _row_cost_ms = 0;
+        double _rate = 0;
+        int64_t _last_observe_ms = 0;
+        bool _observed = false;
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    flush_policy_test (bool verbose);
+
+#endif
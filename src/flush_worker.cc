@@ -0,0 +1,489 @@
+/*  =========================================================================
+    flush_worker - Write full multi row caches to the database in background
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    flush_worker - Write full multi row caches to the database in background
+@discuss
+    The INSERT of a full cache can take a while on a loaded database. Doing
+    it in a dedicated thread keeps the malamute mailbox, the stream and the
+    shm pull actor responsive while the rows are written.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+FlushWorker::FlushWorker ()
+{
+    _max_inflight = MAX_INFLIGHT_DEFAULT;
+
+    char *env_max_inflight = getenv (EV_DBSTORE_MAX_INFLIGHT);
+    if (env_max_inflight) {
+        int max_inflight = atoi (env_max_inflight);
+        if (max_inflight > 0) _max_inflight = (size_t) max_inflight;
+        log_info ("use %s %zu as max number of batches waiting for insertion",
+                  EV_DBSTORE_MAX_INFLIGHT, _max_inflight);
+    }
+}
+
+FlushWorker::FlushWorker (size_t max_inflight)
+{
+    _max_inflight = max_inflight > 0 ? max_inflight : 1;
+}
+
+FlushWorker::~FlushWorker ()
+{
+    stop ();
+}
+
+void
+FlushWorker::start (const std::string &url)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    if (_running)
+        return;
+
+    _url = url;
+    {
+        std::lock_guard<std::mutex> write_lock (_write_mutex);
+        _connection.reset (new ConnectionManager (url));
+    }
+    _stop = false;
+    _running = true;
+    _thread = std::thread (&FlushWorker::run, this);
+    log_info ("flush worker started");
+}
+
+void
+FlushWorker::stop ()
+{
+    {
+        std::lock_guard<std::mutex> lock (_mutex);
+        if (!_running)
+            return;
+        _stop = true;
+    }
+    _cond_work.notify_all ();
+    _thread.join ();
+
+    std::lock_guard<std::mutex> lock (_mutex);
+    _running = false;
+    _free.clear ();
+    log_info ("flush worker stopped");
+}
+
+bool
+FlushWorker::is_running ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _running;
+}
+
+std::unique_ptr<MultiRowCache>
+FlushWorker::acquire (MultiRowCache &like)
+{
+    // called with _mutex held
+    if (!_free.empty ()) {
+        std::unique_ptr<MultiRowCache> batch = std::move (_free.front ());
+        _free.pop_front ();
+        return batch;
+    }
+    return std::unique_ptr<MultiRowCache> (
+        new MultiRowCache (like.get_max_row (), like.get_max_delay ()));
+}
+
+std::unique_ptr<MultiRowCache>
+FlushWorker::submit (std::unique_ptr<MultiRowCache> batch)
+{
+    assert (batch);
+
+    std::unique_lock<std::mutex> lock (_mutex);
+    if (!_running) {
+        // nobody to hand over to, write it ourselves
+        lock.unlock ();
+        std::lock_guard<std::mutex> write_lock (_write_mutex);
+        write (*batch);
+        return batch;
+    }
+
+    // back-pressure: wait for the writer to catch up
+    _cond_done.wait (lock, [this] { return _queue.size () + _busy < _max_inflight; });
+
+    std::unique_ptr<MultiRowCache> empty = acquire (*batch);
+    _queue.push_back (std::move (batch));
+    store_stats ().set_gauge (STATS_FLUSH_INFLIGHT, (int64_t) (_queue.size () + _busy));
+    lock.unlock ();
+    _cond_work.notify_one ();
+
+    empty->reset_clock ();
+    return empty;
+}
+
+void
+FlushWorker::wait_idle ()
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    _cond_done.wait (lock, [this] { return _queue.empty () && _busy == 0; });
+}
+
+size_t
+FlushWorker::get_inflight ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _queue.size () + _busy;
+}
+
+bool
+FlushWorker::write (MultiRowCache &batch, tntdb::Connection &conn, FlushPolicy *policy)
+{
+    try {
+        if (batch.size () == 0) {
+            batch.reset_clock ();
+            return true;
+        }
+        int64_t start = zclock_usecs ();
+        uint32_t affected_rows = batch.insert (conn);
+        // the duplicated rows were coalesced by the insert
+        size_t rows = batch.size ();
+        log_debug ("[t_bios_measurement]: flush measurements from cache, inserted %" PRIu32 " rows ", affected_rows);
+        uint64_t elapsed_us = stats_elapsed_us (start);
+        if (policy) {
+            policy->observe (rows, (long) (elapsed_us / 1000));
+        }
+        store_stats ().add (STATS_FLUSHES);
+        store_stats ().add (STATS_ROWS_INSERTED, rows);
+        store_stats ().record (STATS_FLUSH_US, elapsed_us);
+        store_stats ().record (STATS_FLUSH_ROWS, rows);
+        batch.clear ();
+        return true;
+    }
+    catch (const std::exception &e) {
+        log_error ("Abnormal flush termination: %s", e.what ());
+        store_stats ().add (STATS_FLUSH_ERRORS);
+        return false;
+    }
+}
+
+void
+FlushWorker::write (MultiRowCache &batch)
+{
+    if (!_connection) {
+        // never started
+        _connection.reset (new ConnectionManager (_url));
+    }
+
+    // the rows of the failed batches go first
+    if (_spool && _spool->needs_replay () && !replay ()) {
+        log_warning ("%zu measurements are kept in the spool, the database is %s",
+                     batch.size (), connection_state_to_string (_connection->get_state ()));
+        batch.clear ();
+        return;
+    }
+    uint64_t spool_end = batch.get_spool_end ();
+    if (_spool && spool_end != 0 && spool_end <= _spool->get_head ()) {
+        // inserted by the replay already
+        batch.clear ();
+        return;
+    }
+
+    // without a spool, the rows of the failed batches go first
+    if (!_spool && !retry ()) {
+        keep (batch);
+        return;
+    }
+
+    tntdb::Connection conn;
+    if (!_connection->get (conn)) {
+        if (_spool) {
+            log_warning ("%zu measurements are kept in the spool, the database is %s",
+                         batch.size (), connection_state_to_string (_connection->get_state ()));
+            _spool->set_needs_replay (true);
+            batch.clear ();
+        }
+        else {
+            keep (batch);
+        }
+        return;
+    }
+
+    if (!write (batch, conn, _policy)) {
+        _connection->failure ();
+        if (_spool) {
+            log_warning ("%zu measurements were not inserted, they are kept in the spool", batch.size ());
+            _spool->set_needs_replay (true);
+            batch.clear ();
+        }
+        else {
+            keep (batch);
+        }
+        return;
+    }
+    if (_spool && spool_end != 0) {
+        _spool->commit (spool_end);
+    }
+}
+
+void
+FlushWorker::keep (MultiRowCache &batch)
+{
+    if (!_retry) {
+        // as many rows as the batches in flight, the row cache of the
+        // producers is full by then anyway
+        _retry.reset (new MultiRowCache (batch.get_max_row () * _max_inflight, 0));
+    }
+    size_t kept = _retry->append (batch, 0);
+    if (kept < batch.size ()) {
+        log_error ("%zu measurements were not inserted, the retry cache is full, they are dropped",
+                   batch.size () - kept);
+        store_stats ().add (STATS_ROWS_DROPPED, batch.size () - kept);
+        if (_drop_hook)
+            _drop_hook (batch, kept);
+    }
+    if (kept != 0) {
+        log_warning ("%zu measurements were not inserted, the database is %s, they are kept for a retry",
+                     kept, connection_state_to_string (_connection->get_state ()));
+    }
+    batch.clear ();
+}
+
+bool
+FlushWorker::retry ()
+{
+    if (!_retry || _retry->size () == 0)
+        return true;
+    tntdb::Connection conn;
+    if (!_connection->get (conn))
+        return false;
+
+    size_t rows = _retry->size ();
+    if (!write_or_split (*_retry, conn)) {
+        _connection->failure ();
+        return false;
+    }
+    log_info ("%zu measurements inserted or dropped on retry", rows);
+    return true;
+}
+
+bool
+FlushWorker::write_or_split (MultiRowCache &batch, tntdb::Connection &conn)
+{
+    if (write (batch, conn, NULL))
+        return true;
+    try {
+        conn.ping ();
+    }
+    catch (const std::exception &e) {
+        return false;
+    }
+    if (batch.size () == 1) {
+        // refused by a database which is there, e.g. for a topic deleted
+        // meanwhile, it would block the retry or the spool forever
+        log_error ("measurement of topic %" PRIu32 " at %" PRIi64 " was refused, it is dropped",
+                   (uint32_t) batch.get_topic_id (0), batch.get_time (0));
+        store_stats ().add (STATS_ROWS_DROPPED);
+        if (_drop_hook)
+            _drop_hook (batch, 0);
+        batch.clear ();
+        return true;
+    }
+
+    // one bad row must not take the whole batch with it
+    size_t half = batch.size () / 2;
+    MultiRowCache head (half, 0);
+    MultiRowCache tail (batch.size () - half, 0);
+    head.append (batch, 0);
+    tail.append (batch, half);
+    bool written = write_or_split (head, conn) && write_or_split (tail, conn);
+    batch.clear ();
+    if (!written) {
+        batch.append (head, 0);
+        batch.append (tail, 0);
+    }
+    return written;
+}
+
+size_t
+FlushWorker::get_retry_rows ()
+{
+    std::lock_guard<std::mutex> write_lock (_write_mutex);
+    return _retry ? _retry->size () : 0;
+}
+
+bool
+FlushWorker::replay ()
+{
+    if (!_spool)
+        return true;
+    if (!_connection) {
+        _connection.reset (new ConnectionManager (_url));
+    }
+    tntdb::Connection conn;
+    if (!_connection->get (conn))
+        return false;
+
+    // rows appended meanwhile belong to batches which are written anyway
+    uint64_t end = _spool->get_tail ();
+    uint64_t replayed = 0;
+    int64_t start = zclock_mono ();
+    MultiRowCache batch (SPOOL_REPLAY_ROWS, 0);
+    while (_spool->get_head () < end) {
+        uint64_t position = _spool->read (batch, SPOOL_REPLAY_ROWS);
+        size_t rows = batch.size ();
+        if (!write_or_split (batch, conn)) {
+            batch.clear ();
+            _connection->failure ();
+            log_warning ("replay of the spool interrupted after %" PRIu64 " measurements", replayed);
+            return false;
+        }
+        replayed += rows;
+        _spool->commit (position);
+    }
+    _spool->set_needs_replay (false);
+    if (replayed != 0) {
+        log_info ("%" PRIu64 " measurements of the spool replayed in %" PRIi64 "ms", replayed, zclock_mono () - start);
+    }
+    return true;
+}
+
+void
+FlushWorker::run ()
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    while (true) {
+        if ((_spool && _spool->needs_replay ()) || (_retry && _retry->size () != 0)) {
+            // retry the replay even when no batch comes
+            _cond_work.wait_for (lock, std::chrono::seconds (SPOOL_RETRY_S),
+                                 [this] { return _stop || !_queue.empty (); });
+        }
+        else {
+            _cond_work.wait (lock, [this] { return _stop || !_queue.empty (); });
+        }
+        if (_queue.empty ()) {
+            if (_stop) {
+                // everything is written, or kept in the spool or for a retry
+                break;
+            }
+            lock.unlock ();
+            {
+                std::lock_guard<std::mutex> write_lock (_write_mutex);
+                if (_spool)
+                    replay ();
+                else
+                    retry ();
+            }
+            lock.lock ();
+            continue;
+        }
+
+        std::unique_ptr<MultiRowCache> batch = std::move (_queue.front ());
+        _queue.pop_front ();
+        _busy++;
+        lock.unlock ();
+
+        {
+            std::lock_guard<std::mutex> write_lock (_write_mutex);
+            write (*batch);
+        }
+
+        lock.lock ();
+        _busy--;
+        store_stats ().set_gauge (STATS_FLUSH_INFLIGHT, (int64_t) (_queue.size () + _busy));
+        _free.push_back (std::move (batch));
+        _cond_done.notify_all ();
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+flush_worker_test (bool verbose)
+{
+    printf (" * flush_worker: ");
+
+    //  @selftest
+    // no database is available in selftest, the rows of the batches are
+    // kept for a retry after a failed connection
+    FlushWorker worker (2);
+    assert (!worker.is_running ());
+    worker.start ("selftest:");
+    assert (worker.is_running ());
+
+    std::unique_ptr<MultiRowCache> cache (new MultiRowCache (10, 1));
+    for (int i = 0; i != 5; i++) {
+        cache->push_back (1234567890 + i, 42, 0, 1);
+        assert (cache->size () == 1);
+        cache = worker.submit (std::move (cache));
+        assert (cache);
+        assert (cache->size () == 0);
+        assert (cache->get_max_row () == 10);
+        assert (worker.get_inflight () <= worker.get_max_inflight ());
+    }
+
+    worker.wait_idle ();
+    assert (worker.get_inflight () == 0);
+    worker.stop ();
+    assert (!worker.is_running ());
+    assert (worker.get_retry_rows () == 5);
+
+    // stopped worker writes in the caller thread
+    cache->push_back (1234567890, 42, 0, 1);
+    cache = worker.submit (std::move (cache));
+    assert (cache->size () == 0);
+    assert (worker.get_retry_rows () == 6);
+
+    // at most max_inflight full batches are kept, the others are dropped
+    size_t dropped = 0;
+    worker.set_drop_hook ([&dropped] (const MultiRowCache &batch, size_t first)
+        {
+            assert (batch.get_time (first) == 1234567914);
+            dropped += batch.size () - first;
+        });
+    for (int i = 0; i != 20; i++)
+        cache->push_back (1234567900 + i, 42, 0, 1);
+    cache = worker.submit (std::move (cache));
+    assert (cache->size () == 0);
+    assert (worker.get_retry_rows () == 20);
+    assert (dropped == 6);
+
+    // with a spool, the rows of the failed batches are kept for the replay
+    const char *path = "src/selftest-rw/flush_worker.spool";
+    std::remove (path);
+    Spool spool (path, 1);
+    assert (spool.open ());
+    FlushWorker spooled (2);
+    spooled.set_spool (&spool);
+    spooled.start ("selftest:");
+    for (int i = 0; i != 3; i++) {
+        cache->push_back (1234567890 + i, 42, 0, 1);
+        cache->set_spool_end (spool.append (*cache, 0));
+        cache = spooled.submit (std::move (cache));
+    }
+    spooled.wait_idle ();
+    spooled.stop ();
+    assert (spool.size () == 3);
+    assert (spool.needs_replay ());
+    spool.close ();
+    std::remove (path);
+    //  @end
+
+    printf ("OK\n");
+}
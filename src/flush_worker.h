@@ -0,0 +1,144 @@
+/*  =========================================================================
+    flush_worker - Write full multi row caches to the database in background
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FLUSH_WORKER_H_INCLUDED
+#define FLUSH_WORKER_H_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define MAX_INFLIGHT_DEFAULT 2
+
+#define EV_DBSTORE_MAX_INFLIGHT "BIOS_DBSTORE_MAX_INFLIGHT"
+
+class MultiRowCache;
+class ConnectionManager;
+class FlushPolicy;
+class Spool;
+
+/*
+ * \brief Writer thread of the multi row caches
+ *
+ * Producers fill one cache and exchange it for an empty one when it is
+ * ready for insertion, the full one is then written by the worker thread.
+ * At most max_inflight batches are waiting or being written, a producer
+ * handing over one more batch is blocked until the writer catches up.
+ * With a spool, the rows of the batches which fail stay in the spool and
+ * are replayed before the next batch, or every few seconds while there is
+ * none; the batches are committed to the spool once written. Without one,
+ * they are kept in memory and retried the same way, up to max_inflight
+ * full batches, the rows beyond are dropped.
+ */
+class FlushWorker {
+    public:
+        // rows of batch from first on are dropped, they are not going to be stored
+        typedef std::function<void(const MultiRowCache &batch, size_t first)> DropHook;
+
+        FlushWorker ();
+        explicit FlushWorker (size_t max_inflight);
+        ~FlushWorker ();
+
+        void start (const std::string &url);
+        // write all the pending batches and stop the thread
+        void stop ();
+        bool is_running ();
+
+        // hand over a full batch, return an empty one to fill next
+        std::unique_ptr<MultiRowCache> submit (std::unique_ptr<MultiRowCache> batch);
+
+        // block until all the submitted batches are written
+        void wait_idle ();
+
+        size_t get_inflight ();
+        size_t get_max_inflight () { return _max_inflight; }
+        // rows kept for a retry
+        size_t get_retry_rows ();
+
+        /*
+         * \brief write the batch and clear it
+         *  return false if the insertion failed, the batch is kept then
+         */
+        static bool write (MultiRowCache &batch, tntdb::Connection &conn, FlushPolicy *policy = NULL);
+
+        // successful writes are reported to the policy
+        void set_policy (FlushPolicy *policy) { _policy = policy; }
+        // spool of the submitted rows, set before the start
+        void set_spool (Spool *spool) { _spool = spool; }
+        // called with the rows dropped, set before the start
+        void set_drop_hook (DropHook hook) { _drop_hook = hook; }
+
+    private:
+        void run ();
+        // the methods below are called with _write_mutex held
+        void write (MultiRowCache &batch);
+        /*
+         * \brief insert the uncommitted rows of the spool and commit them
+         *  return false if the database is not available
+         */
+        bool replay ();
+        /*
+         * \brief write the batch, split it in halves when a live database
+         *  refuses it, down to the single rows which are dropped then
+         *  return false if the database is not available, the rows not
+         *  written yet are left in the batch
+         */
+        bool write_or_split (MultiRowCache &batch, tntdb::Connection &conn);
+        // keep the rows of a failed batch for a retry and clear it
+        void keep (MultiRowCache &batch);
+        // write the kept rows, return false if the database is not available
+        bool retry ();
+        std::unique_ptr<MultiRowCache> acquire (MultiRowCache &like);
+
+        std::string _url;
+        // serializes the writes of the worker thread and of the callers of
+        // submit () once it is stopped, it guards _connection and _retry
+        std::mutex _write_mutex;
+        std::unique_ptr<ConnectionManager> _connection;
+        FlushPolicy *_policy = NULL;
+        Spool *_spool = NULL;
+        DropHook _drop_hook;
+        // rows of the failed batches without a spool
+        std::unique_ptr<MultiRowCache> _retry;
+        std::thread _thread;
+        std::mutex _mutex;
+        std::condition_variable _cond_work;
+        std::condition_variable _cond_done;
+        // batches waiting for the writer
+        std::deque<std::unique_ptr<MultiRowCache>> _queue;
+        // empty batches ready for reuse
+        std::deque<std::unique_ptr<MultiRowCache>> _free;
+        size_t _max_inflight;
+        size_t _busy = 0;
+        bool _running = false;
+        bool _stop = false;
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    flush_worker_test (bool verbose);
+
+#endif
@@ -100,6 +100,16 @@ int main (int argc, char *argv [])
     zstr_sendx (ms_server, "CONNECT", ENDPOINT, AGENT_NAME, NULL);
     //zstr_sendx (ms_server, "CONSUMER", FTY_PROTO_STREAM_METRICS, ".*", NULL);
     zstr_sendx (ms_server, "CONSUMER", FTY_PROTO_STREAM_ASSETS, ".*", NULL);
+    char *rollup_filter = getenv (EV_DBSTORE_ROLLUP_FILTER);
+    if (rollup_filter && rollup_filter[0]) {
+        // the computed metrics come from shm, only the real time ones are
+        // taken from the stream, to be aggregated by the agent itself
+        zstr_sendx (ms_server, "CONSUMER", FTY_PROTO_STREAM_METRICS, ROLLUP_STREAM_PATTERN, NULL);
+    }
+    if (store_stats ().get_publish_interval () > 0) {
+        // stats of the store itself
+        zstr_sendx (ms_server, "PRODUCER", FTY_PROTO_STREAM_METRICS, NULL);
+    }
 
     // setup the storage age
     for (int i = 0; i != STEPS_SIZE; i++) {
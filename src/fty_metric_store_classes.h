@@ -49,6 +49,70 @@ typedef struct _persistance_t persistance_t;
 typedef struct _multi_row_t multi_row_t;
 #define MULTI_ROW_T_DEFINED
 #endif
+#ifndef TOPIC_CACHE_T_DEFINED
+typedef struct _topic_cache_t topic_cache_t;
+#define TOPIC_CACHE_T_DEFINED
+#endif
+#ifndef FLUSH_WORKER_T_DEFINED
+typedef struct _flush_worker_t flush_worker_t;
+#define FLUSH_WORKER_T_DEFINED
+#endif
+#ifndef POINT_CODEC_T_DEFINED
+typedef struct _point_codec_t point_codec_t;
+#define POINT_CODEC_T_DEFINED
+#endif
+#ifndef TAIL_CACHE_T_DEFINED
+typedef struct _tail_cache_t tail_cache_t;
+#define TAIL_CACHE_T_DEFINED
+#endif
+#ifndef CONNECTION_MANAGER_T_DEFINED
+typedef struct _connection_manager_t connection_manager_t;
+#define CONNECTION_MANAGER_T_DEFINED
+#endif
+#ifndef SHM_INDEX_T_DEFINED
+typedef struct _shm_index_t shm_index_t;
+#define SHM_INDEX_T_DEFINED
+#endif
+#ifndef FLUSH_POLICY_T_DEFINED
+typedef struct _flush_policy_t flush_policy_t;
+#define FLUSH_POLICY_T_DEFINED
+#endif
+#ifndef DOWNSAMPLER_T_DEFINED
+typedef struct _downsampler_t downsampler_t;
+#define DOWNSAMPLER_T_DEFINED
+#endif
+#ifndef RATE_LIMITER_T_DEFINED
+typedef struct _rate_limiter_t rate_limiter_t;
+#define RATE_LIMITER_T_DEFINED
+#endif
+#ifndef RETENTION_T_DEFINED
+typedef struct _retention_t retention_t;
+#define RETENTION_T_DEFINED
+#endif
+#ifndef PARTITION_MANAGER_T_DEFINED
+typedef struct _partition_manager_t partition_manager_t;
+#define PARTITION_MANAGER_T_DEFINED
+#endif
+#ifndef ASSET_PURGER_T_DEFINED
+typedef struct _asset_purger_t asset_purger_t;
+#define ASSET_PURGER_T_DEFINED
+#endif
+#ifndef STORE_STATS_T_DEFINED
+typedef struct _store_stats_t store_stats_t;
+#define STORE_STATS_T_DEFINED
+#endif
+#ifndef SPOOL_T_DEFINED
+typedef struct _spool_t spool_t;
+#define SPOOL_T_DEFINED
+#endif
+#ifndef ROLLUP_T_DEFINED
+typedef struct _rollup_t rollup_t;
+#define ROLLUP_T_DEFINED
+#endif
+#ifndef AGGREGATOR_T_DEFINED
+typedef struct _aggregator_t aggregator_t;
+#define AGGREGATOR_T_DEFINED
+#endif
 
 //  Extra headers
 
@@ -58,6 +122,22 @@ typedef struct _multi_row_t multi_row_t;
 #include "converter.h"
 #include "persistance.h"
 #include "multi_row.h"
+#include "topic_cache.h"
+#include "flush_worker.h"
+#include "point_codec.h"
+#include "tail_cache.h"
+#include "connection_manager.h"
+#include "shm_index.h"
+#include "flush_policy.h"
+#include "downsampler.h"
+#include "rate_limiter.h"
+#include "retention.h"
+#include "partition_manager.h"
+#include "asset_purger.h"
+#include "store_stats.h"
+#include "spool.h"
+#include "rollup.h"
+#include "aggregator.h"
 
 //  *** To avoid double-definitions, only define if building without draft ***
 #ifndef FTY_METRIC_STORE_BUILD_DRAFT_API
@@ -82,6 +162,86 @@ FTY_METRIC_STORE_PRIVATE void
 FTY_METRIC_STORE_PRIVATE void
     multi_row_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    topic_cache_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    flush_worker_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    point_codec_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    tail_cache_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    connection_manager_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    shm_index_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    flush_policy_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    downsampler_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    rate_limiter_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    retention_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    partition_manager_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    asset_purger_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    store_stats_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    spool_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    rollup_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_STORE_PRIVATE void
+    aggregator_test (bool verbose);
+
 //  Self test for private classes
 FTY_METRIC_STORE_PRIVATE void
     fty_metric_store_private_selftest (bool verbose, const char *subtest);
@@ -46,6 +46,38 @@ fty_metric_store_private_selftest (bool verbose, const char *subtest)
         persistance_test (verbose);
     if (streq (subtest, "$ALL") || streq (subtest, "multi_row_test"))
         multi_row_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "topic_cache_test"))
+        topic_cache_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "flush_worker_test"))
+        flush_worker_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "point_codec_test"))
+        point_codec_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "tail_cache_test"))
+        tail_cache_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "connection_manager_test"))
+        connection_manager_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "shm_index_test"))
+        shm_index_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "flush_policy_test"))
+        flush_policy_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "downsampler_test"))
+        downsampler_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "rate_limiter_test"))
+        rate_limiter_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "retention_test"))
+        retention_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "partition_manager_test"))
+        partition_manager_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "asset_purger_test"))
+        asset_purger_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "store_stats_test"))
+        store_stats_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "spool_test"))
+        spool_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "rollup_test"))
+        rollup_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "aggregator_test"))
+        aggregator_test (verbose);
 }
 /*
 ################################################################################
@@ -46,6 +46,22 @@ all_tests [] = {
     { "converter", NULL, true, false, "converter_test" },
     { "persistance", NULL, true, false, "persistance_test" },
     { "multi_row", NULL, true, false, "multi_row_test" },
+    { "topic_cache", NULL, true, false, "topic_cache_test" },
+    { "flush_worker", NULL, true, false, "flush_worker_test" },
+    { "point_codec", NULL, true, false, "point_codec_test" },
+    { "tail_cache", NULL, true, false, "tail_cache_test" },
+    { "connection_manager", NULL, true, false, "connection_manager_test" },
+    { "shm_index", NULL, true, false, "shm_index_test" },
+    { "flush_policy", NULL, true, false, "flush_policy_test" },
+    { "downsampler", NULL, true, false, "downsampler_test" },
+    { "rate_limiter", NULL, true, false, "rate_limiter_test" },
+    { "retention", NULL, true, false, "retention_test" },
+    { "partition_manager", NULL, true, false, "partition_manager_test" },
+    { "asset_purger", NULL, true, false, "asset_purger_test" },
+    { "store_stats", NULL, true, false, "store_stats_test" },
+    { "spool", NULL, true, false, "spool_test" },
+    { "rollup", NULL, true, false, "rollup_test" },
+    { "aggregator", NULL, true, false, "aggregator_test" },
     { "private_classes", NULL, false, false, "$ALL" }, // compat option for older projects
 #endif // FTY_METRIC_STORE_BUILD_DRAFT_API
 // Tests for stable public classes:
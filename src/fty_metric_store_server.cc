@@ -33,13 +33,40 @@
     Example reply on error:
                 "8CB3E9A9649B"/"ERROR"/"BAD_MESSAGE"
 
+    Command GET_STREAM takes the same fields, the reply is sent in chunks of at
+    most chunk_size points (optional "chunk_size=N" frame, default 1000) with
+    the sequence number and the final marker after the unit:
+                "8CB3E9A9649B"/"OK"/"asset_test"/"realpower.default"/"24h"/"min"/"1234567"/"1234567890"/"0"/"W"/"0"/"0"/"1234567"/"88.0"
+                "8CB3E9A9649B"/"OK"/"asset_test"/"realpower.default"/"24h"/"min"/"1234567"/"1234567890"/"0"/"W"/"1"/"1"/"123456556"/"99.8"
+
+    With optional "encoding=binary" or "encoding=delta" frame, the points are
+    sent as the name of the encoding and one frame of packed points, see
+    point_codec:
+                "8CB3E9A9649B"/"OK"/"asset_test"/"realpower.default"/"24h"/"min"/"1234567"/"1234567890"/"0"/"W"/"binary"/<28 bytes>
+
+    The optional frames are "key=value", the trailing frames in another
+    format are ignored.
+
+    Command GET_MULTI requests several series sharing the time range, the
+    reply has a section per series with the number of its points:
+                "8CB3E9A9649B"/"GET_MULTI"/"1234567"/"1234567890"/"2"/"asset_test"/"realpower.default"/"24h"/"min"/"asset_test"/"voltage.input"/"24h"/"min"
+                "8CB3E9A9649B"/"OK"/"1234567"/"1234567890"/"2"/"asset_test"/"realpower.default"/"24h"/"min"/"OK"/"W"/"1"/"1234567"/"88.0"/"asset_test"/"voltage.input"/"24h"/"min"/"ERROR"/"BAD_REQUEST"
+
+    Subject STATS requests the counters, gauges and latency histograms of the
+    store, the reply has the name and the value of each:
+                "8CB3E9A9649B"
+                "8CB3E9A9649B"/"OK"/"samples_received"/"1200"/ ... /"get_15m_us.p99"/"1151"
+
     Supported reasons for errors are:
             "BAD_MESSAGE" when REQ does not conform to the expected message structure (but still includes <uuid>)
             "BAD_TIMERANGE" when in REQ fields 'start' and 'end' do not form correct time interval
             "INTERNAL_ERROR" when error occured during fetching the rows
             "BAD_REQUEST" requested information is not monitored by the system
-                    (missing record in the t_bios_measurement_table)
+                    (missing record in the t_bios_measurement_table), nor
+                    computable from a finer step
             "BAD_ORDERED" when parameter 'ordering_flag' does not have allowed value
+            "TOO_MANY_POINTS" when the series of GET_MULTI have more than
+                    MULTI_POINTS_MAX points together
 
     If the request message does not include <uuid>, behaviour is undefined.
     If the subject is incorrect, fty-metric-store server responds with ERROR/UNSUPPORTED_SUBJECT.
@@ -48,13 +75,24 @@
 */
 
 #include "fty_metric_store_classes.h"
+#include <cmath>
+#include <condition_variable>
+#include <map>
 #include <mutex>
-
-static std::mutex g_row_mutex;
+#include <thread>
 
 #define POLL_INTERVAL 1000
 #define AVG_GRAPH "aggregated data"
 
+// points per reply of GET_STREAM
+#define CHUNK_SIZE_DEFAULT 1000
+#define CHUNK_SIZE_MAX     100000
+
+// series in one GET_MULTI request
+#define MULTI_SERIES_MAX   256
+// points of all the series of one GET_MULTI reply, it is built in memory
+#define MULTI_POINTS_MAX   100000
+
 /**
  *  \brief A connection string to the database
  *
@@ -68,8 +106,196 @@ static std::string url =
     ((getenv("DB_PASSWD") == NULL) ? ""     :
     std::string(";password=") + getenv("DB_PASSWD"));
 
+// buckets computed from finer steps for the recent GET requests
+static AggregateCache g_AggregateCache;
+
+/**
+ *  \brief Reply of the "aggregated data" request
+ *
+ *  Without chunk size, all the points are appended to one message returned
+ *  by finish (). Otherwise each full chunk is sent right away with header
+ *  frames, sequence number and final marker, so only one chunk is kept in
+ *  memory, and finish () returns the last chunk.
+ */
+class AggregateReply {
+    public:
+        AggregateReply (
+            mlm_client_t *client,
+            const char *uuid,
+            size_t chunk_size,
+            point_encoding_t encoding) :
+            _client (client),
+            _sender (mlm_client_sender (client)),
+            _subject (mlm_client_subject (client)),
+            _uuid (uuid),
+            _chunk_size (chunk_size),
+            _encoding (encoding)
+        {
+            _header = zmsg_new ();
+            _points = zmsg_new ();
+            if (encoding != POINT_ENCODING_TEXT) {
+                _encoder = new PointEncoder (encoding);
+            }
+        }
+
+        ~AggregateReply ()
+        {
+            delete _encoder;
+            zmsg_destroy (&_points);
+            zmsg_destroy (&_header);
+        }
+
+        // frames repeated in front of the points of each chunk
+        zmsg_t *header () { return _header; }
+
+        void add_point (int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+        {
+            if (_encoder) {
+                _encoder->append (timestamp, value, scale);
+            }
+            else {
+                double real_value = value * std::pow (10, scale);
+                zmsg_addstr (_points, std::to_string(timestamp).c_str());
+                zmsg_addstr (_points, std::to_string(real_value).c_str());
+            }
+            if (_chunk_size != 0 && ++_count == _chunk_size) {
+                send_chunk ();
+            }
+        }
+
+        // return the last message of the reply, without uuid
+        zmsg_t *finish ()
+        {
+            return make_chunk (true);
+        }
+
+    private:
+        mlm_client_t *_client;
+        const char *_sender;
+        const char *_subject;
+        const char *_uuid;
+        size_t _chunk_size;
+        point_encoding_t _encoding;
+        PointEncoder *_encoder = NULL;
+        size_t _count = 0;
+        uint64_t _seq = 0;
+        zmsg_t *_header;
+        zmsg_t *_points;
+
+        zmsg_t *make_chunk (bool last)
+        {
+            zmsg_t *msg = zmsg_dup (_header);
+            if (_chunk_size != 0) {
+                zmsg_addstr (msg, std::to_string(_seq++).c_str());
+                zmsg_addstr (msg, last ? "1" : "0");
+            }
+            if (_encoder) {
+                zmsg_addstr (msg, point_encoding_to_string (_encoding));
+                zmsg_addmem (msg, _encoder->data ().data (), _encoder->size ());
+                _encoder->clear ();
+            }
+            else {
+                // move the frames, do not copy them
+                zframe_t *frame;
+                while ((frame = zmsg_pop (_points))) {
+                    zmsg_append (msg, &frame);
+                }
+            }
+            _count = 0;
+            return msg;
+        }
+
+        void send_chunk ()
+        {
+            zmsg_t *msg = make_chunk (false);
+            zmsg_pushstr (msg, _uuid);
+            int rv = mlm_client_sendto (_client, _sender, _subject, NULL, 1000, &msg);
+            if (rv != 0) {
+                log_error ("Cannot send chunk of the reply to %s", _sender);
+            }
+            zmsg_destroy (&msg);
+        }
+};
+
+/**
+ *  \brief Pop the optional trailing frames of the request, "key=value" each
+ *  the frames in another format are ignored, as they were before options
+ */
+static void
+s_pop_options (zmsg_t *msg, std::map <std::string, std::string> &options)
+{
+    char *frame;
+    while ((frame = zmsg_popstr (msg))) {
+        const char *eq = strchr (frame, '=');
+        if (!eq || eq == frame) {
+            log_debug ("trailing frame '%s' is not an option, ignored", frame);
+        }
+        else {
+            options [std::string (frame, eq - frame)] = std::string (eq + 1);
+        }
+        zstr_free (&frame);
+    }
+}
+
+// Compute the buckets of the step starting from start_date to end_date from
+// the rows of the finer source topic, and output them
+static int
+s_select_aggregated (
+        const std::vector<m_msrmnt_tpc_id_t> &source_ids,
+        const std::string &source_step,
+        const std::string &aggregation,
+        int64_t step_s,
+        int64_t start_date,
+        int64_t end_date,
+        Aggregator::Output &add_measurement)
+{
+    // the first bucket starting in the range, the last bucket starting in it
+    int64_t first = start_date + ((step_s - start_date % step_s) % step_s);
+    int64_t last = end_date - ((end_date % step_s) + step_s) % step_s;
+    if (first > last)
+        return 0;
+
+    std::string key;
+    for (m_msrmnt_tpc_id_t source_id : source_ids)
+        key += std::to_string (source_id) + "_";
+    key += aggregation + "_" + std::to_string (step_s);
+    if (g_AggregateCache.get (key, first, last, add_measurement))
+        return 0;
+
+    // late rows of the source may still change the recent buckets
+    int64_t stable = (int64_t) time (NULL) - step_s - step_to_seconds (source_step) - ROLLUP_GRACE_S;
+    int64_t cache_last = std::min (last, stable - ((stable % step_s) + step_s) % step_s);
+    bool cached = g_AggregateCache.is_enabled () && first <= cache_last
+        && (uint64_t) ((cache_last - first) / step_s) < g_AggregateCache.get_max_buckets ();
+    std::vector<AggregateCache::Point> points;
+
+    Aggregator aggregator (aggregation, step_s, source_step == RETENTION_STEP_RT, first, last,
+        [&] (int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+        {
+            if (cached && timestamp <= cache_last)
+                points.push_back ({ timestamp, value, scale });
+            add_measurement (timestamp, value, scale);
+        });
+    std::function <void(int64_t, m_msrmnt_value_t, m_msrmnt_scale_t)> add_row =
+        [&aggregator] (int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+        {
+            aggregator.add (timestamp, value, scale);
+        };
+    // the rows of the last bucket go beyond end_date
+    int rv = select_measurements_by_id (url, source_ids, first, last + step_s - 1, add_row, true);
+    if (rv != 0)
+        return rv;
+    aggregator.finish ();
+
+    store_stats ().add (STATS_GET_AGGREGATED);
+    if (cached) {
+        g_AggregateCache.put (key, first, cache_last, std::move (points));
+    }
+    return 0;
+}
+
 static zmsg_t*
-s_process_mailbox_aggregate (mlm_client_t *client, zmsg_t **message_p)
+s_process_mailbox_aggregate (mlm_client_t *client, const char *uuid, zmsg_t **message_p)
 {
     assert (client);
     assert (message_p && *message_p);
@@ -91,7 +317,7 @@ s_process_mailbox_aggregate (mlm_client_t *client, zmsg_t **message_p)
     }
 
     char *cmd = zmsg_popstr (msg);
-    if (!cmd || (!streq(cmd, "GET") && !streq(cmd, "GET_TEST"))) {
+    if (!cmd || (!streq(cmd, "GET") && !streq(cmd, "GET_TEST") && !streq(cmd, "GET_STREAM"))) {
         log_error ("GET command is missing (cmd: %s)", cmd);
         zmsg_destroy (message_p);
         zmsg_addstr (msg_out, "ERROR");
@@ -99,6 +325,7 @@ s_process_mailbox_aggregate (mlm_client_t *client, zmsg_t **message_p)
         return msg_out;
     }
     bool bTest = streq(cmd, "GET_TEST");
+    bool bStream = streq(cmd, "GET_STREAM");
 
     // All declarations are before first "goto"
     char *asset_name = zmsg_popstr (msg);
@@ -113,9 +340,19 @@ s_process_mailbox_aggregate (mlm_client_t *client, zmsg_t **message_p)
     int64_t start_date = 0;
     int64_t end_date = 0;
     std::string topic;
-    std::function <void(const tntdb::Row &)> add_measurement;
-    std::function <void(const tntdb::Row &)> select_units;
+    std::function <void(int64_t, m_msrmnt_value_t, m_msrmnt_scale_t)> add_measurement;
     std::string units;
+    // one per units or device the topic was stored with
+    std::vector <m_msrmnt_tpc_id_t> topic_ids;
+    // set when the step is computed from this finer one
+    std::string source_step;
+    std::map <std::string, std::string> options;
+    size_t chunk_size = 0;
+    point_encoding_t encoding = POINT_ENCODING_TEXT;
+    size_t max_points = 0;
+    downsample_method_t method = DOWNSAMPLE_METHOD_DEFAULT;
+    AggregateReply *reply = NULL;
+    Downsampler *downsampler = NULL;
     int rv;
 
     #define ERROR_MSG_EXIT(REASON) { \
@@ -172,6 +409,38 @@ s_process_mailbox_aggregate (mlm_client_t *client, zmsg_t **message_p)
         log_error ("ordered is not 1/0");
         ERROR_MSG_EXIT("BAD_ORDERED");
     }
+    s_pop_options (msg, options);
+    if (bStream) {
+        chunk_size = CHUNK_SIZE_DEFAULT;
+        if (options.count ("chunk_size")) {
+            int64_t n = string_to_int64 (options ["chunk_size"].c_str ());
+            if (errno != 0 || n <= 0 || n > CHUNK_SIZE_MAX) {
+                errno = 0;
+                log_error ("chunk_size '%s' is not in range 1..%d", options ["chunk_size"].c_str (), CHUNK_SIZE_MAX);
+                ERROR_MSG_EXIT("BAD_MESSAGE");
+            }
+            chunk_size = (size_t) n;
+        }
+    }
+    if (options.count ("encoding")
+        && !point_encoding_from_string (options ["encoding"], encoding)) {
+        log_error ("encoding '%s' is not supported", options ["encoding"].c_str ());
+        ERROR_MSG_EXIT("BAD_MESSAGE");
+    }
+    if (options.count ("downsample")
+        && !downsample_method_from_string (options ["downsample"], method)) {
+        log_error ("downsample '%s' is not supported", options ["downsample"].c_str ());
+        ERROR_MSG_EXIT("BAD_MESSAGE");
+    }
+    if (options.count ("max_points")) {
+        int64_t n = string_to_int64 (options ["max_points"].c_str ());
+        if (errno != 0 || n < (int64_t) downsample_min_points (method)) {
+            errno = 0;
+            log_error ("max_points '%s' is less than %zu", options ["max_points"].c_str (), downsample_min_points (method));
+            ERROR_MSG_EXIT("BAD_MESSAGE");
+        }
+        max_points = (size_t) n;
+    }
 
     if ( bTest ) {
         zmsg_addstr (msg_out, "OK");
@@ -193,12 +462,20 @@ s_process_mailbox_aggregate (mlm_client_t *client, zmsg_t **message_p)
     topic += "@";
     topic += asset_name;
 
-    select_units = [&units](const tntdb::Row& r)
-        {
-            r["units"].get(units);
-        };
-
-    rv = select_topic (url, topic, select_units);
+    rv = resolve_topic (url, topic, topic_ids, units);
+    if (rv == -2 && Aggregator::is_supported (aggr_type)) {
+        // never stored, computed from the nearest finer step which is
+        for (const std::string &finer : Aggregator::finer_steps (step)) {
+            rv = resolve_topic (url, Aggregator::source_topic (quantity, aggr_type, finer, asset_name), topic_ids, units);
+            if (rv != -2) {
+                source_step = finer;
+                break;
+            }
+        }
+        if (rv == 0) {
+            log_debug ("topic '%s' is computed from step %s", topic.c_str (), source_step.c_str ());
+        }
+    }
     if (rv != 0) {
         // as we have prepared it for SUCCESS, but we failed in the end
         zmsg_addstr (msg_out, "ERROR");
@@ -213,45 +490,55 @@ s_process_mailbox_aggregate (mlm_client_t *client, zmsg_t **message_p)
         goto exit;
     }
 
-    zmsg_addstr (msg_out, "OK");
-    zmsg_addstr (msg_out, asset_name);
-    zmsg_addstr (msg_out, quantity);
-    zmsg_addstr (msg_out, step);
-    zmsg_addstr (msg_out, aggr_type);
-    zmsg_addstr (msg_out, start_date_str);
-    zmsg_addstr (msg_out, end_date_str);
-    zmsg_addstr (msg_out, ordered);
-    zmsg_addstr (msg_out, units.c_str());
-
-    add_measurement = [&msg_out](const tntdb::Row& r)
+    reply = new AggregateReply (client, uuid, chunk_size, encoding);
+    zmsg_addstr (reply->header (), "OK");
+    zmsg_addstr (reply->header (), asset_name);
+    zmsg_addstr (reply->header (), quantity);
+    zmsg_addstr (reply->header (), step);
+    zmsg_addstr (reply->header (), aggr_type);
+    zmsg_addstr (reply->header (), start_date_str);
+    zmsg_addstr (reply->header (), end_date_str);
+    zmsg_addstr (reply->header (), ordered);
+    zmsg_addstr (reply->header (), units.c_str());
+
+    add_measurement = [reply](int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
         {
-            m_msrmnt_value_t value = 0;
-            r["value"].get(value);
-
-            m_msrmnt_scale_t scale = 0;
-            r["scale"].get(scale);
-            double real_value = value * std::pow (10, scale);
-
-            int64_t timestamp = 0;
-            r["timestamp"].get(timestamp);
-
-            zmsg_addstr (msg_out, std::to_string(timestamp).c_str());
-            zmsg_addstr (msg_out, std::to_string(real_value).c_str());
+            reply->add_point (timestamp, value, scale);
         };
 
     is_ordered = streq (ordered, "1");
-    rv = select_measurements (url, topic, start_date, end_date, add_measurement, is_ordered);
+    if (max_points != 0) {
+        // points are reduced while they are read, buckets need them in order
+        downsampler = new Downsampler (method, max_points, end_date, add_measurement);
+        add_measurement = [downsampler](int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+            {
+                downsampler->add (timestamp, value, scale);
+            };
+        is_ordered = true;
+    }
+    if (source_step.empty ()) {
+        rv = select_measurements_by_id (url, topic_ids, start_date, end_date, add_measurement, is_ordered);
+    }
+    else {
+        rv = s_select_aggregated (topic_ids, source_step, aggr_type, step_to_seconds (step),
+                                  start_date, end_date, add_measurement);
+    }
     if (rv != 0) {
         // as we have prepared it for SUCCESS, but we failed in the end
         log_error ("unexpected error during measurement selecting");
-        zmsg_destroy (&msg_out);
-        msg_out = zmsg_new ();
         ERROR_MSG_EXIT("INTERNAL_ERROR");
     }
+    if (downsampler) {
+        downsampler->finish ();
+    }
+    zmsg_destroy (&msg_out);
+    msg_out = reply->finish ();
 
     #undef ERROR_MSG_EXIT
 
 exit:
+    delete downsampler;
+    delete reply;
     zstr_free (&ordered);
     zstr_free (&end_date_str);
     zstr_free (&start_date_str);
@@ -265,6 +552,316 @@ exit:
     return msg_out;
 }
 
+/**
+ *  \brief Section of one series in the reply of GET_MULTI
+ *
+ *  The points are kept until the whole reply is built, reduced by the
+ *  downsampler if max_points was requested. All the series of a reply
+ *  share a budget of points, the points beyond it are not kept.
+ */
+class SeriesReply {
+    public:
+        SeriesReply (
+            point_encoding_t encoding,
+            downsample_method_t method,
+            size_t max_points,
+            int64_t end_date,
+            size_t &budget) :
+            _encoding (encoding),
+            _budget (budget)
+        {
+            _points = zmsg_new ();
+            if (encoding != POINT_ENCODING_TEXT) {
+                _encoder.reset (new PointEncoder (encoding));
+            }
+            if (max_points != 0) {
+                _downsampler.reset (new Downsampler (method, max_points, end_date,
+                    [this](int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+                    {
+                        append (timestamp, value, scale);
+                    }));
+            }
+        }
+
+        ~SeriesReply ()
+        {
+            zmsg_destroy (&_points);
+        }
+
+        void add_point (int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+        {
+            if (_downsampler) {
+                _downsampler->add (timestamp, value, scale);
+            }
+            else {
+                append (timestamp, value, scale);
+            }
+        }
+
+        // all the points were added
+        void close ()
+        {
+            if (_downsampler) {
+                _downsampler->finish ();
+            }
+        }
+
+        // add OK/unit/count/points to the reply
+        void finish (zmsg_t *msg, const std::string &units)
+        {
+            zmsg_addstr (msg, "OK");
+            zmsg_addstr (msg, units.c_str ());
+            zmsg_addstr (msg, std::to_string (_count).c_str ());
+            if (_encoder) {
+                zmsg_addstr (msg, point_encoding_to_string (_encoding));
+                zmsg_addmem (msg, _encoder->data ().data (), _encoder->size ());
+            }
+            else {
+                zframe_t *frame;
+                while ((frame = zmsg_pop (_points))) {
+                    zmsg_append (msg, &frame);
+                }
+            }
+        }
+
+        // some points were beyond the budget
+        bool is_over_budget () const { return _over_budget; }
+
+    private:
+        point_encoding_t _encoding;
+        std::unique_ptr<PointEncoder> _encoder;
+        std::unique_ptr<Downsampler> _downsampler;
+        zmsg_t *_points;
+        size_t _count = 0;
+        // points left for all the series of the reply
+        size_t &_budget;
+        bool _over_budget = false;
+
+        void append (int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+        {
+            if (_budget == 0) {
+                _over_budget = true;
+                return;
+            }
+            _budget--;
+            if (_encoder) {
+                _encoder->append (timestamp, value, scale);
+            }
+            else {
+                double real_value = value * std::pow (10, scale);
+                zmsg_addstr (_points, std::to_string(timestamp).c_str());
+                zmsg_addstr (_points, std::to_string(real_value).c_str());
+            }
+            _count++;
+        }
+};
+
+/**
+ *  \brief Process GET_MULTI, several series sharing one time range
+ *
+ *  All the topics are resolved with one query and all the points are read
+ *  with one query, the reply has one section per series.
+ */
+static zmsg_t*
+s_process_mailbox_aggregate_multi (zmsg_t **message_p)
+{
+    assert (message_p && *message_p);
+
+    zmsg_t *msg_out = zmsg_new ();
+    if (!msg_out) {
+        log_error ("zmsg_new () failed");
+        return NULL;
+    }
+
+    zmsg_t *msg = *message_p;
+
+    // All declarations are before first "goto"
+    char *cmd = zmsg_popstr (msg);
+    char *start_date_str = zmsg_popstr (msg);
+    char *end_date_str = zmsg_popstr (msg);
+    char *count_str = zmsg_popstr (msg);
+
+    int64_t start_date = 0;
+    int64_t end_date = 0;
+    int64_t count = 0;
+    std::map <std::string, std::string> options;
+    point_encoding_t encoding = POINT_ENCODING_TEXT;
+    size_t max_points = 0;
+    downsample_method_t method = DOWNSAMPLE_METHOD_DEFAULT;
+    std::vector <std::vector<std::string>> specs;
+    std::vector <std::unique_ptr<SeriesReply>> series;
+    size_t budget = MULTI_POINTS_MAX;
+    std::vector <std::string> topics;
+    std::vector <std::vector<m_msrmnt_tpc_id_t>> topic_ids;
+    std::vector <std::string> units;
+    std::map <m_msrmnt_tpc_id_t, std::vector<SeriesReply *>> by_id;
+    // series of a topic stored with several units or devices
+    std::vector <size_t> merged;
+    std::vector <m_msrmnt_tpc_id_t> ids;
+    std::function <void(m_msrmnt_tpc_id_t, int64_t, m_msrmnt_value_t, m_msrmnt_scale_t)> add_measurement;
+    int rv;
+
+    #define ERROR_MSG_EXIT(REASON) { \
+        zmsg_addstr (msg_out, "ERROR"); \
+        zmsg_addstr (msg_out, REASON); \
+        goto exit; \
+    }
+
+    if (!start_date_str || !end_date_str || !count_str) {
+        log_error ("Message has unsupported format, ignore it");
+        ERROR_MSG_EXIT("BAD_MESSAGE");
+    }
+    start_date = string_to_int64 (start_date_str);
+    if (errno != 0) {
+        errno = 0;
+        log_error ("start date cannot be converted to number");
+        ERROR_MSG_EXIT("BAD_MESSAGE");
+    }
+    end_date = string_to_int64 (end_date_str);
+    if (errno != 0) {
+        errno = 0;
+        log_error ("end date cannot be converted to number");
+        ERROR_MSG_EXIT("BAD_MESSAGE");
+    }
+    if (start_date > end_date) {
+        log_error ("start date > end date");
+        ERROR_MSG_EXIT("BAD_TIMERANGE");
+    }
+    count = string_to_int64 (count_str);
+    if (errno != 0 || count <= 0 || count > MULTI_SERIES_MAX) {
+        errno = 0;
+        log_error ("number of series '%s' is not in range 1..%d", count_str, MULTI_SERIES_MAX);
+        ERROR_MSG_EXIT("BAD_MESSAGE");
+    }
+    if (zmsg_size (msg) < (size_t) count * 4) {
+        log_error ("Message has less than %" PRIi64 " series", count);
+        ERROR_MSG_EXIT("BAD_MESSAGE");
+    }
+
+    // the options are behind the series
+    specs.resize ((size_t) count);
+    for (std::vector<std::string> &spec : specs) {
+        for (int field = 0; field != 4; field++) {
+            char *value = zmsg_popstr (msg);
+            spec.push_back (value ? value : "");
+            zstr_free (&value);
+        }
+        if (spec [0].empty () || spec [1].empty ()) {
+            log_error ("asset name or quantity is empty");
+            ERROR_MSG_EXIT("BAD_MESSAGE");
+        }
+        // quantity_type_step@asset
+        topics.push_back (spec [1] + "_" + spec [3] + "_" + spec [2] + "@" + spec [0]);
+    }
+    s_pop_options (msg, options);
+    if (options.count ("encoding")
+        && !point_encoding_from_string (options ["encoding"], encoding)) {
+        log_error ("encoding '%s' is not supported", options ["encoding"].c_str ());
+        ERROR_MSG_EXIT("BAD_MESSAGE");
+    }
+    if (options.count ("downsample")
+        && !downsample_method_from_string (options ["downsample"], method)) {
+        log_error ("downsample '%s' is not supported", options ["downsample"].c_str ());
+        ERROR_MSG_EXIT("BAD_MESSAGE");
+    }
+    if (options.count ("max_points")) {
+        int64_t n = string_to_int64 (options ["max_points"].c_str ());
+        if (errno != 0 || n < (int64_t) downsample_min_points (method)) {
+            errno = 0;
+            log_error ("max_points '%s' is less than %zu", options ["max_points"].c_str (), downsample_min_points (method));
+            ERROR_MSG_EXIT("BAD_MESSAGE");
+        }
+        max_points = (size_t) n;
+    }
+
+    rv = resolve_topics (url, topics, topic_ids, units);
+    if (rv != 0) {
+        log_error ("multi request: unexpected error during topic selecting");
+        ERROR_MSG_EXIT("INTERNAL_ERROR");
+    }
+
+    for (size_t i = 0; i < specs.size (); i++) {
+        series.emplace_back (new SeriesReply (encoding, method, max_points, end_date, budget));
+        if (topic_ids [i].empty ()) {
+            log_info ("multi request: topic '%s' is not found", topics [i].c_str ());
+            continue;
+        }
+        if (topic_ids [i].size () > 1) {
+            // the rows of its ids are read together, in order of time
+            merged.push_back (i);
+            continue;
+        }
+        // a series requested twice gets the points twice
+        if (by_id [topic_ids [i][0]].empty ()) {
+            ids.push_back (topic_ids [i][0]);
+        }
+        by_id [topic_ids [i][0]].push_back (series.back ().get ());
+    }
+
+    add_measurement = [&by_id](m_msrmnt_tpc_id_t topic_id, int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+        {
+            for (SeriesReply *reply : by_id [topic_id]) {
+                reply->add_point (timestamp, value, scale);
+            }
+        };
+
+    if (!ids.empty ()) {
+        rv = select_measurements_by_ids (url, ids, start_date, end_date, add_measurement);
+        if (rv != 0) {
+            log_error ("multi request: unexpected error during measurement selecting");
+            ERROR_MSG_EXIT("INTERNAL_ERROR");
+        }
+    }
+    for (size_t i : merged) {
+        SeriesReply *reply = series [i].get ();
+        std::function <void(int64_t, m_msrmnt_value_t, m_msrmnt_scale_t)> add_point =
+            [reply](int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+            {
+                reply->add_point (timestamp, value, scale);
+            };
+        rv = select_measurements_by_id (url, topic_ids [i], start_date, end_date, add_point, true);
+        if (rv != 0) {
+            log_error ("multi request: unexpected error during measurement selecting");
+            ERROR_MSG_EXIT("INTERNAL_ERROR");
+        }
+    }
+    for (auto &reply : series) {
+        reply->close ();
+        if (reply->is_over_budget ()) {
+            log_error ("multi request: more than %d points", MULTI_POINTS_MAX);
+            ERROR_MSG_EXIT("TOO_MANY_POINTS");
+        }
+    }
+
+    zmsg_addstr (msg_out, "OK");
+    zmsg_addstr (msg_out, start_date_str);
+    zmsg_addstr (msg_out, end_date_str);
+    zmsg_addstr (msg_out, count_str);
+    for (size_t i = 0; i < specs.size (); i++) {
+        for (const std::string &field : specs [i]) {
+            zmsg_addstr (msg_out, field.c_str ());
+        }
+        if (topic_ids [i].empty ()) {
+            zmsg_addstr (msg_out, "ERROR");
+            zmsg_addstr (msg_out, "BAD_REQUEST");
+        }
+        else {
+            series [i]->finish (msg_out, units [i]);
+        }
+    }
+
+    #undef ERROR_MSG_EXIT
+
+exit:
+    zstr_free (&count_str);
+    zstr_free (&end_date_str);
+    zstr_free (&start_date_str);
+    zstr_free (&cmd);
+    zmsg_destroy (message_p);
+
+    return msg_out;
+}
+
 //
 // SERVICE DELIVER processing
 //
@@ -280,6 +877,40 @@ exit:
 // MAILBOX DELIVER processing
 //
 
+static zmsg_t*
+s_process_mailbox_stats ()
+{
+    zmsg_t *msg_out = zmsg_new ();
+    if (!msg_out) {
+        log_error ("zmsg_new () failed");
+        return NULL;
+    }
+    zmsg_addstr (msg_out, "OK");
+    for (const auto &value : store_stats ().snapshot ()) {
+        zmsg_addstr (msg_out, value.first.c_str ());
+        zmsg_addstr (msg_out, value.second.c_str ());
+    }
+    return msg_out;
+}
+
+// string of the index-th frame, empty if the message is shorter
+static std::string
+s_frame_string (zmsg_t *msg, size_t index)
+{
+    zframe_t *frame = zmsg_first (msg);
+    for (size_t i = 0; frame && i < index; i++) {
+        frame = zmsg_next (msg);
+    }
+    return frame ? std::string ((const char *) zframe_data (frame), zframe_size (frame)) : std::string ();
+}
+
+// streamed replies are sent already, only the errors come back
+static bool
+s_is_error_reply (zmsg_t *msg_out)
+{
+    return msg_out && zframe_streq (zmsg_first (msg_out), "ERROR");
+}
+
 static void
 s_handle_mailbox (mlm_client_t *client, zmsg_t **message_p)
 {
@@ -299,8 +930,23 @@ s_handle_mailbox (mlm_client_t *client, zmsg_t **message_p)
     char *uuid = zmsg_popstr (*message_p);
 
     zmsg_t *msg_out = NULL;
-    if (streq (subject, AVG_GRAPH)) {
-        msg_out = s_process_mailbox_aggregate (client, message_p);
+    int64_t start = zclock_usecs ();
+    if (streq (subject, AVG_GRAPH) && zframe_streq (zmsg_first (*message_p), "GET_MULTI")) {
+        msg_out = s_process_mailbox_aggregate_multi (message_p);
+        store_stats ().add (STATS_GET_REQUESTS);
+        if (s_is_error_reply (msg_out)) {
+            store_stats ().add (STATS_GET_ERRORS);
+        }
+        store_stats ().record (STATS_GET_MULTI_US, stats_elapsed_us (start));
+    }
+    else if (streq (subject, AVG_GRAPH)) {
+        // GET/asset/quantity/step/...
+        std::string step = s_frame_string (*message_p, 3);
+        msg_out = s_process_mailbox_aggregate (client, uuid, message_p);
+        store_stats ().record_get (step.c_str (), stats_elapsed_us (start), !s_is_error_reply (msg_out));
+    }
+    else if (streq (subject, STATS_SUBJECT)) {
+        msg_out = s_process_mailbox_stats ();
     }
     else {
         log_error ("Bad subject %s from %s, ignoring", subject, sender);
@@ -323,8 +969,65 @@ s_handle_mailbox (mlm_client_t *client, zmsg_t **message_p)
 // STREAM DELIVER processing
 //
 
+// Accumulate a real time metric into the buckets of its steps
 static void
-s_process_stream_proto_metric (fty_proto_t *m)
+s_rollup_proto_metric (fty_proto_t *m, Rollup &rollup)
+{
+    const char *text = fty_proto_value (m);
+    char *end = NULL;
+    double value = text ? strtod (text, &end) : 0;
+    if (!text || end == text || *end != '\0' || !std::isfinite (value)) {
+        log_error ("value '%s' of the metric is not a number", text ? text : "");
+        store_stats ().add (STATS_SAMPLES_REJECTED);
+        return;
+    }
+    rollup.add (fty_proto_type (m), fty_proto_name (m), fty_proto_unit (m), (int64_t) fty_proto_time (m), value);
+    store_stats ().add (STATS_ROLLUP_SAMPLES);
+}
+
+// Insert the rows of the finished buckets of the rollup
+static void
+s_insert_rollup (Rollup &rollup, ConnectionManager &connection)
+{
+    rollup.expire ((int64_t) time (NULL));
+    std::vector<RollupSample> samples;
+    rollup.take (samples);
+    if (samples.empty ())
+        return;
+
+    // the database is needed only for the topics not cached yet, the rows
+    // of the others are kept by the flush while it is down
+    tntdb::Connection conn;
+    bool connected = false;
+    size_t dropped = 0;
+    MultiRowCache rows ((uint32_t) samples.size (), 0);
+    for (const auto &sample : samples) {
+        if (!connected && !is_topic_cached (sample.topic.c_str (), sample.unit.c_str (), sample.asset.c_str ())) {
+            connected = connection.get (conn);
+            if (!connected) {
+                dropped++;
+                continue;
+            }
+        }
+        if (prepare_measurement (
+                conn, sample.topic.c_str (), sample.value, sample.scale, sample.time,
+                sample.unit.c_str (), sample.asset.c_str (), rows) > 0) {
+            connection.failure ();
+            continue;
+        }
+    }
+    if (dropped != 0) {
+        log_error ("database is %s, %zu rolled up metrics are dropped",
+                   connection_state_to_string (connection.get_state ()), dropped);
+        store_stats ().add (STATS_ROWS_DROPPED, dropped);
+    }
+    store_stats ().add (STATS_ROLLUP_ROWS, rows.size ());
+    // handed over to the flush worker, conn is not used
+    insert_rows_into_measurement (conn, rows);
+}
+
+static void
+s_process_stream_proto_metric (fty_proto_t *m, ConnectionManager &connection, Rollup &rollup)
 {
     assert (m);
     assert (fty_proto_id(m) == FTY_PROTO_METRIC);
@@ -332,68 +1035,62 @@ s_process_stream_proto_metric (fty_proto_t *m)
     // TODO: implement FTY_STORE_AGE_ support
     // ignore the stuff not coming from computation module
     if (!fty_proto_aux_string (m, "x-cm-type", NULL)) {
+        // unless the store aggregates it itself
+        if (rollup.matches (fty_proto_type (m))) {
+            s_rollup_proto_metric (m, rollup);
+        }
         return;
     }
 
     std::string db_topic = std::string (fty_proto_type (m)) + "@" + std::string(fty_proto_name (m));
+    store_stats ().add (STATS_SAMPLES_RECEIVED);
 
     m_msrmnt_value_t value = 0;
-    m_msrmnt_scale_t scale = 0;
-    if (!strstr (fty_proto_value (m), ".")) {
-        value = string_to_int64 (fty_proto_value (m));
-        if (errno != 0) {
-            errno = 0;
-            log_error ("value '%s' of the metric is not integer", fty_proto_value (m) );
-            return;
-        }
-    }
-    else {
-        int8_t lscale = 0;
-        int32_t integer = 0;
-        if (!stobiosf_wrapper (fty_proto_value (m), integer, lscale)) {
-            log_error ("value '%s' of the metric is not double", fty_proto_value (m));
-            return;
-        }
-        value = integer;
-        scale = lscale;
+    int8_t lscale = 0;
+    if (!parse_biosf (fty_proto_value (m), value, lscale)) {
+        log_error ("value '%s' of the metric is not a number", fty_proto_value (m));
+        store_stats ().add (STATS_SAMPLES_REJECTED);
+        return;
     }
+    m_msrmnt_scale_t scale = lscale;
 
-    // connect & test db
+    // the connection is checked only after inactivity or a failure, it is
+    // needed only for the topics not cached yet, the rows of the others are
+    // kept by the flush worker while the database is down
     tntdb::Connection conn;
-    try {
-        conn = tntdb::connectCached(url);
-        conn.ping();
-    } catch (const std::exception &e) {
-        log_error("Can't connect to the database");
+    if (!is_topic_cached (db_topic.c_str (), fty_proto_unit (m), fty_proto_name (m))
+        && !connection.get (conn)) {
+        log_warning ("database is %s, metric %s is dropped",
+                     connection_state_to_string (connection.get_state ()), db_topic.c_str ());
+        store_stats ().add (STATS_ROWS_DROPPED);
         return;
     }
 
-    // time is a time when message was received
+    // time is a time when message was received, the row is handed over to
+    // the flush worker, conn is not used to insert it
     uint64_t _time = fty_proto_time (m);
-    insert_into_measurement(
+    int rv = insert_into_measurement(
         conn, db_topic.c_str(), value, scale, _time,
         fty_proto_unit (m), fty_proto_name (m));
+    if (rv < 0) {
+        store_stats ().add (STATS_SAMPLES_REJECTED);
+    }
+    else if (rv > 0) {
+        connection.failure ();
+    }
 }
 
 static void
-s_process_stream_proto_asset (fty_proto_t *m)
+s_process_stream_proto_asset (fty_proto_t *m, Rollup &rollup)
 {
     assert (m);
     assert (fty_proto_id(m) == FTY_PROTO_ASSET);
 
     if (streq (fty_proto_operation (m), "delete")) {
         log_debug ("Asset '%s' is deleted -> delete all it measurements", fty_proto_name(m));
-
-        tntdb::Connection conn;
-        try {
-            conn = tntdb::connectCached(url);
-            conn.ping();
-        } catch (const std::exception &e) {
-            log_error("Can't connect to the database");
-            return;
-        }
-
-        delete_measurements (conn, fty_proto_name(m));
+        // the purge runs in background, the stream is not blocked meanwhile
+        purge_asset (fty_proto_name(m));
+        rollup.forget (fty_proto_name(m));
     }
     else {
         log_debug ("Ignore operation '%s' on the asset '%s'", fty_proto_operation(m), fty_proto_name(m));
@@ -401,7 +1098,7 @@ s_process_stream_proto_asset (fty_proto_t *m)
 }
 
 static void
-s_handle_stream (mlm_client_t *client, zmsg_t **message_p)
+s_handle_stream (mlm_client_t *client, zmsg_t **message_p, ConnectionManager &connection, Rollup &rollup)
 {
     assert (client);//notUsed
     assert (message_p && *message_p);
@@ -413,12 +1110,10 @@ s_handle_stream (mlm_client_t *client, zmsg_t **message_p)
         log_error("Can't decode the fty_proto message, ignore it");
     }
     else if (fty_proto_id(m) == FTY_PROTO_METRIC) {
-        g_row_mutex.lock();
-        s_process_stream_proto_metric (m);
-        g_row_mutex.unlock();
+        s_process_stream_proto_metric (m, connection, rollup);
     }
     else if (fty_proto_id(m) == FTY_PROTO_ASSET) {
-        s_process_stream_proto_asset (m);
+        s_process_stream_proto_asset (m, rollup);
     }
     else {
         log_error ("Unsupported fty_proto message with id = '%d'", fty_proto_id(m));
@@ -432,67 +1127,178 @@ s_handle_stream (mlm_client_t *client, zmsg_t **message_p)
 // fty_metric_store pull actor, to store metrics from shm to db
 //
 
+// state of one thread processing a part of the metrics read from shm
+struct ShmWorker {
+    ShmWorker () : connection (url) {}
+
+    // metrics of this cycle which belong to the worker
+    std::vector<fty_proto_t *> metrics;
+    // rows of one pull cycle, reused by the next ones
+    MultiRowCache rows;
+    ConnectionManager connection;
+    // metrics already stored, with their time and value
+    ShmIndex index;
+};
+
 static void
-s_process_pull_store_shm_metrics (fty::shm::shmMetrics& metrics)
+s_process_shm_worker (ShmWorker& worker)
 {
-    for (auto &m : metrics) {
+    worker.index.begin_cycle ();
+
+    // one connection for the whole batch
+    tntdb::Connection conn;
+    if (!worker.connection.get (conn)) {
+        log_error ("database is %s, %zu metrics are dropped",
+                   connection_state_to_string (worker.connection.get_state ()), worker.metrics.size ());
+        return;
+    }
+
+    // samples are collected without any lock, the row cache
+    // is locked only once to take them all
+    for (auto &m : worker.metrics) {
         assert(m);
         // TODO: implement FTY_STORE_AGE_ support
 
         // ignore stuff not coming from computation module
         if (!fty_proto_aux_string (m, "x-cm-type", NULL))
             continue;
-        // ignore flagged metric
+        // ignore metric stored in a previous cycle
+        if (worker.index.is_unchanged (fty_proto_type (m), fty_proto_name (m), fty_proto_time (m), fty_proto_value (m)))
+            continue;
+        // ignore metric flagged as stored by former versions
         if (fty_proto_aux_string (m, "x-ms-flag", NULL))
             continue;
 
         std::string db_topic = std::string (fty_proto_type (m)) + "@" + std::string(fty_proto_name (m));
+        store_stats ().add (STATS_SAMPLES_RECEIVED);
 
         m_msrmnt_value_t value = 0;
-        m_msrmnt_scale_t scale = 0;
-        if (!strstr (fty_proto_value (m), ".")) {
-            value = string_to_int64 (fty_proto_value (m));
-            if (errno != 0) {
-                errno = 0;
-                log_error ("value '%s' of the metric is not integer", fty_proto_value (m) );
-                continue;
-            }
+        int8_t lscale = 0;
+        if (!parse_biosf (fty_proto_value (m), value, lscale)) {
+            log_error ("value '%s' of the metric is not a number", fty_proto_value (m));
+            store_stats ().add (STATS_SAMPLES_REJECTED);
+            continue;
         }
-        else {
-            int8_t lscale = 0;
-            int32_t lvalue = 0;
-            if (!stobiosf_wrapper (fty_proto_value (m), lvalue, lscale)) {
-                log_error ("value '%s' of the metric is not double", fty_proto_value (m));
-                continue;
+        m_msrmnt_scale_t scale = lscale;
+
+        // time is a time when message was received
+        uint64_t _time = fty_proto_time (m);
+        int rv = prepare_measurement(
+                conn, db_topic.c_str(), value, scale, _time,
+                fty_proto_unit (m), fty_proto_name (m), worker.rows);
+        if (rv < 0) {
+            store_stats ().add (STATS_SAMPLES_REJECTED);
+            continue;
+        }
+        if (rv > 0) {
+            worker.connection.failure ();
+            continue;
+        }
+        // shm is not written back, the index remembers what is stored
+        worker.index.stored (fty_proto_type (m), fty_proto_name (m), fty_proto_time (m), fty_proto_value (m));
+    }
+
+    insert_rows_into_measurement(conn, worker.rows);
+
+    size_t pruned = worker.index.prune ();
+    if (pruned > 0) {
+        log_debug ("%zu metrics are not in shm anymore", pruned);
+    }
+}
+
+/**
+ *  \brief Threads of the shm workers, started once for all the cycles
+ *
+ *  The first worker runs in the pull actor, each other one has its own
+ *  thread, woken up at each cycle. A cycle returns once all of them are
+ *  done with their metrics.
+ */
+class ShmWorkerPool {
+    public:
+        explicit ShmWorkerPool (std::vector<std::unique_ptr<ShmWorker>>& workers) :
+            _workers (workers)
+        {
+            for (size_t i = 1; i < _workers.size (); i++) {
+                _threads.push_back (std::thread (&ShmWorkerPool::run, this, i));
             }
-            value = lvalue;
-            scale = lscale;
         }
 
-        // connect & test db
-        tntdb::Connection conn;
-        try {
-            conn = tntdb::connectCached(url);
-            conn.ping();
-        } catch (const std::exception &e) {
-            log_error("Can't connect to the database");
-            continue;
+        ~ShmWorkerPool ()
+        {
+            {
+                std::lock_guard<std::mutex> lock (_mutex);
+                _stop = true;
+            }
+            _cond_start.notify_all ();
+            for (auto &thread : _threads) {
+                thread.join ();
+            }
         }
 
-        // time is a time when message was received
-        uint64_t _time = fty_proto_time (m);
-        insert_into_measurement(
-            conn, db_topic.c_str(), value, scale, _time,
-            fty_proto_unit (m), fty_proto_name (m));
+        // process the metrics of all the workers
+        void cycle ()
+        {
+            {
+                std::lock_guard<std::mutex> lock (_mutex);
+                _pending = _threads.size ();
+                _cycle++;
+            }
+            _cond_start.notify_all ();
+            s_process_shm_worker (*_workers[0]);
 
-        // inserted, flag this metric
-        if ((fty_proto_time (m) + fty_proto_ttl (m)) < (uint64_t) time (NULL)) {
-            uint32_t new_ttl = fty_proto_ttl(m) - (time(NULL) - fty_proto_time(m));
-            fty_proto_set_ttl (m, new_ttl);
-            fty_proto_aux_insert(m, "x-ms-flag", "1");
-            fty::shm::write_metric(m);
+            std::unique_lock<std::mutex> lock (_mutex);
+            _cond_done.wait (lock, [this] { return _pending == 0; });
+        }
+
+    private:
+        std::vector<std::unique_ptr<ShmWorker>>& _workers;
+        std::vector<std::thread> _threads;
+        std::mutex _mutex;
+        std::condition_variable _cond_start;
+        std::condition_variable _cond_done;
+        uint64_t _cycle = 0;
+        size_t _pending = 0;
+        bool _stop = false;
+
+        void run (size_t i)
+        {
+            uint64_t done = 0;
+            std::unique_lock<std::mutex> lock (_mutex);
+            while (true) {
+                _cond_start.wait (lock, [this, done] { return _stop || _cycle != done; });
+                if (_stop)
+                    break;
+                done = _cycle;
+                lock.unlock ();
+                s_process_shm_worker (*_workers[i]);
+                lock.lock ();
+                if (--_pending == 0) {
+                    _cond_done.notify_one ();
+                }
+            }
         }
+};
+
+// Split the metrics by their identity, so each one is always processed
+// by the same worker, and process the parts in parallel
+static void
+s_process_pull_store_shm_metrics (fty::shm::shmMetrics& metrics, std::vector<std::unique_ptr<ShmWorker>>& workers, ShmWorkerPool& pool)
+{
+    int64_t start = zclock_usecs ();
+    size_t count = workers.size ();
+    for (auto &m : metrics) {
+        size_t i = count == 1 ? 0 : ShmIndex::hash (fty_proto_type (m), fty_proto_name (m)) % count;
+        workers[i]->metrics.push_back (m);
     }
+
+    pool.cycle ();
+
+    // the metrics are destroyed with the read result
+    for (auto &worker : workers) {
+        worker->metrics.clear ();
+    }
+    store_stats ().add (STATS_SHM_CYCLES);
+    store_stats ().record (STATS_SHM_CYCLE_US, stats_elapsed_us (start));
 }
 
 void
@@ -505,6 +1311,27 @@ fty_metric_store_metric_pull (zsock_t *pipe, void* args)
     log_info("fty_metric_store_metric_pull started");
     zsock_signal (pipe, 0);
 
+    std::vector<std::unique_ptr<ShmWorker>> workers;
+    std::vector<ShmIndex *> indexes;
+    size_t workers_count = shm_workers ();
+    for (size_t i = 0; i < workers_count; i++) {
+        workers.push_back (std::unique_ptr<ShmWorker> (new ShmWorker ()));
+        indexes.push_back (&workers.back ()->index);
+    }
+    ShmWorkerPool pool (workers);
+    std::string type_filter = shm_type_filter ();
+    std::string index_file = shm_index_file ();
+    if (!index_file.empty ()) {
+        int loaded = -1;
+        // each worker keeps its own metrics at the end of the first cycle
+        for (ShmIndex *index : indexes) {
+            loaded = index->load (index_file);
+        }
+        if (loaded >= 0) {
+            log_info ("%d stored shm metrics loaded from '%s'", loaded, index_file.c_str ());
+        }
+    }
+
     uint64_t timeout = fty_get_polling_interval() * 1000;
     while (!zsys_interrupted)
     {
@@ -518,12 +1345,10 @@ fty_metric_store_metric_pull (zsock_t *pipe, void* args)
             if (zpoller_expired (poller)) {
                 log_debug("read metrics from shm");
                 fty::shm::shmMetrics result;
-                fty::shm::read_metrics(".*", ".*",  result);
+                fty::shm::read_metrics(".*", type_filter,  result);
                 log_debug("metric reads : %d", result.size());
 
-                g_row_mutex.lock();
-                s_process_pull_store_shm_metrics(result);
-                g_row_mutex.unlock();
+                s_process_pull_store_shm_metrics(result, workers, pool);
             }
             timeout = fty_get_polling_interval() * 1000;
             continue;
@@ -545,10 +1370,35 @@ fty_metric_store_metric_pull (zsock_t *pipe, void* args)
         }
     }
 
+    if (!index_file.empty ()) {
+        ShmIndex::save (index_file, indexes);
+    }
+
     zpoller_destroy(&poller);
     log_info("fty_metric_store_metric_pull stopped");
 }
 
+// Publish the stats as metrics of the store, they expire after two periods
+static void
+s_publish_stats (mlm_client_t *client, uint32_t ttl)
+{
+    uint64_t now = (uint64_t) time (NULL);
+    for (const auto &value : store_stats ().snapshot ()) {
+        std::string type = "dbstore." + value.first;
+        // percentiles and max of the latencies
+        const char *unit = value.first.find ("_us.") != std::string::npos &&
+                           value.first.find (".count") == std::string::npos ? "us" : "";
+        zmsg_t *msg = fty_proto_encode_metric (
+            NULL, now, ttl, type.c_str (), STATS_ELEMENT, value.second.c_str (), unit);
+        std::string subject = type + "@" + STATS_ELEMENT;
+        if (mlm_client_send (client, subject.c_str (), &msg) != 0) {
+            log_error ("Cannot publish the stats of the store");
+            zmsg_destroy (&msg);
+            return;
+        }
+    }
+}
+
 //
 // fty_metric_store main actor
 //
@@ -577,11 +1427,27 @@ fty_metric_store_server (zsock_t *pipe, void* args)
         return;
     }
 
+    // connection of the stream consumer
+    ConnectionManager connection (url);
+    // real time metrics aggregated by the store, if configured
+    Rollup rollup;
+
+    // full caches are inserted by a dedicated thread, so a slow INSERT
+    // does not stall the mailbox nor the stream
+    flush_worker_start (url);
+    // expired samples are deleted in small chunks in background
+    retention_start (url);
+    // and so are the measurements of the deleted assets
+    asset_purger_start (url);
+
     log_info("fty_metric_store_server started");
     zsock_signal (pipe, 0);
 
     const uint64_t timeout = (uint64_t) POLL_INTERVAL;
     uint64_t last = zclock_mono ();
+    // the stats are published only when the main sets a producer for them
+    const uint64_t stats_interval = (uint64_t) store_stats ().get_publish_interval () * 1000;
+    uint64_t last_stats = last;
 
     while (!zsys_interrupted)
     {
@@ -589,9 +1455,14 @@ fty_metric_store_server (zsock_t *pipe, void* args)
         if ((now - last) >= timeout) {
             last = now;
             // do a periodic flush
-            g_row_mutex.lock();
+            if (rollup.is_enabled ()) {
+                s_insert_rollup (rollup, connection);
+            }
             flush_measurement_when_needed(url);
-            g_row_mutex.unlock();
+        }
+        if (stats_interval > 0 && (now - last_stats) >= stats_interval) {
+            last_stats = now;
+            s_publish_stats (client, (uint32_t) (2 * stats_interval / 1000));
         }
 
         void *which = zpoller_wait (poller, timeout);
@@ -636,7 +1507,7 @@ fty_metric_store_server (zsock_t *pipe, void* args)
                 log_debug("fty_metric_store_server received command '%s'", command);
 
                 if (streq (command, "STREAM DELIVER")) {
-                    s_handle_stream (client, &message);
+                    s_handle_stream (client, &message, connection, rollup);
                 }
                 else if (streq (command, "MAILBOX DELIVER")) {
                     s_handle_mailbox (client, &message);
@@ -657,9 +1528,14 @@ fty_metric_store_server (zsock_t *pipe, void* args)
         log_warning ("which was checked for NULL, pipe and `mlm_client_msgpipe (client)` but is not.");
     }//while
 
+    // no new rows after the pull actor is gone, insert the rest
+    zactor_destroy (&store_metrics_pull);
+    // the purge waits for the flush worker, stop it first
+    asset_purger_stop ();
     flush_measurement(url);
+    flush_worker_stop ();
+    retention_stop ();
 
-    zactor_destroy (&store_metrics_pull);
     zpoller_destroy (&poller);
     mlm_client_destroy (&client);
 
@@ -684,8 +1560,14 @@ fty_metric_store_server_test (bool verbose)
         ManageFtyLog::getInstanceFtylog()->setVeboseMode();
     }
 
+    // the real time metrics of this type are rolled up by the agent
+    setenv (EV_DBSTORE_ROLLUP_FILTER, "selftest\\.rollup", 1);
+    setenv (EV_DBSTORE_ROLLUP_STEPS, "15m", 1);
     zactor_t *self = zactor_new (fty_metric_store_server, (void*) NULL);
+    unsetenv (EV_DBSTORE_ROLLUP_FILTER);
+    unsetenv (EV_DBSTORE_ROLLUP_STEPS);
     zstr_sendx (self, "CONNECT", endpoint, "fty-metric-store", NULL);
+    zstr_sendx (self, "CONSUMER", FTY_PROTO_STREAM_METRICS, ROLLUP_STREAM_PATTERN, NULL);
 
     log_trace ("Test for mailbox request error handling");
     mlm_client_t *mbox_client = mlm_client_new();
@@ -702,6 +1584,8 @@ fty_metric_store_server_test (bool verbose)
     zmsg_addstr (msg, "0");
     zmsg_addstr (msg, "9999");
     zmsg_addstr (msg, "1");
+    //  a trailing frame which is not an option is ignored
+    zmsg_addstr (msg, "trailing");
     //  we only test the mailbox REQ/RESP interface, no DB access
     assert (mlm_client_sendto (mbox_client, "fty-metric-store", AVG_GRAPH, NULL, 1000, &msg) >= 0);
     assert ((msg = mlm_client_recv (mbox_client)));
@@ -736,6 +1620,287 @@ fty_metric_store_server_test (bool verbose)
     zmsg_print (msg);
     zmsg_destroy (&msg);
 
+    log_trace ("Test for GET_STREAM request error handling");
+    msg = zmsg_new();
+    zmsg_addstr (msg, uuid);
+    zmsg_addstr (msg, "GET_STREAM");
+    zmsg_addstr (msg, "some-asset");
+    zmsg_addstr (msg, "realpower.default");
+    zmsg_addstr (msg, "15m");
+    zmsg_addstr (msg, "min");
+    zmsg_addstr (msg, "0");
+    zmsg_addstr (msg, "9999");
+    zmsg_addstr (msg, "1");
+    zmsg_addstr (msg, "chunk_size=0");
+    assert (mlm_client_sendto (mbox_client, "fty-metric-store", AVG_GRAPH, NULL, 1000, &msg) >= 0);
+    assert ((msg = mlm_client_recv (mbox_client)));
+    received_uuid = zmsg_popstr (msg);
+    assert (streq (uuid, received_uuid));
+    zstr_free (&received_uuid);
+    result = zmsg_popstr (msg);
+    assert (result!=NULL && streq (result, "ERROR"));
+    zstr_free (&result);
+    char *reason = zmsg_popstr (msg);
+    assert (reason!=NULL && streq (reason, "BAD_MESSAGE"));
+    zstr_free (&reason);
+    zmsg_destroy (&msg);
+
+    log_trace ("Test for unsupported encoding");
+    msg = zmsg_new();
+    zmsg_addstr (msg, uuid);
+    zmsg_addstr (msg, "GET_TEST");
+    zmsg_addstr (msg, "some-asset");
+    zmsg_addstr (msg, "realpower.default");
+    zmsg_addstr (msg, "15m");
+    zmsg_addstr (msg, "min");
+    zmsg_addstr (msg, "0");
+    zmsg_addstr (msg, "9999");
+    zmsg_addstr (msg, "1");
+    zmsg_addstr (msg, "encoding=json");
+    assert (mlm_client_sendto (mbox_client, "fty-metric-store", AVG_GRAPH, NULL, 1000, &msg) >= 0);
+    assert ((msg = mlm_client_recv (mbox_client)));
+    received_uuid = zmsg_popstr (msg);
+    assert (streq (uuid, received_uuid));
+    zstr_free (&received_uuid);
+    result = zmsg_popstr (msg);
+    assert (result!=NULL && streq (result, "ERROR"));
+    zstr_free (&result);
+    reason = zmsg_popstr (msg);
+    assert (reason!=NULL && streq (reason, "BAD_MESSAGE"));
+    zstr_free (&reason);
+    zmsg_destroy (&msg);
+
+    log_trace ("Test for too few points of lttb downsampling");
+    msg = zmsg_new();
+    zmsg_addstr (msg, uuid);
+    zmsg_addstr (msg, "GET_TEST");
+    zmsg_addstr (msg, "some-asset");
+    zmsg_addstr (msg, "realpower.default");
+    zmsg_addstr (msg, "15m");
+    zmsg_addstr (msg, "min");
+    zmsg_addstr (msg, "0");
+    zmsg_addstr (msg, "9999");
+    zmsg_addstr (msg, "1");
+    zmsg_addstr (msg, "downsample=lttb");
+    zmsg_addstr (msg, "max_points=2");
+    assert (mlm_client_sendto (mbox_client, "fty-metric-store", AVG_GRAPH, NULL, 1000, &msg) >= 0);
+    assert ((msg = mlm_client_recv (mbox_client)));
+    received_uuid = zmsg_popstr (msg);
+    assert (streq (uuid, received_uuid));
+    zstr_free (&received_uuid);
+    result = zmsg_popstr (msg);
+    assert (result!=NULL && streq (result, "ERROR"));
+    zstr_free (&result);
+    reason = zmsg_popstr (msg);
+    assert (reason!=NULL && streq (reason, "BAD_MESSAGE"));
+    zstr_free (&reason);
+    zmsg_destroy (&msg);
+
+    log_trace ("Test for GET_MULTI with missing series");
+    msg = zmsg_new();
+    zmsg_addstr (msg, uuid);
+    zmsg_addstr (msg, "GET_MULTI");
+    zmsg_addstr (msg, "0");
+    zmsg_addstr (msg, "9999");
+    zmsg_addstr (msg, "2");
+    zmsg_addstr (msg, "some-asset");
+    zmsg_addstr (msg, "realpower.default");
+    zmsg_addstr (msg, "15m");
+    zmsg_addstr (msg, "min");
+    assert (mlm_client_sendto (mbox_client, "fty-metric-store", AVG_GRAPH, NULL, 1000, &msg) >= 0);
+    assert ((msg = mlm_client_recv (mbox_client)));
+    received_uuid = zmsg_popstr (msg);
+    assert (streq (uuid, received_uuid));
+    zstr_free (&received_uuid);
+    result = zmsg_popstr (msg);
+    assert (result!=NULL && streq (result, "ERROR"));
+    zstr_free (&result);
+    reason = zmsg_popstr (msg);
+    assert (reason!=NULL && streq (reason, "BAD_MESSAGE"));
+    zstr_free (&reason);
+    zmsg_destroy (&msg);
+
+    log_trace ("Test for GET_MULTI");
+    // no DB, the topics and their points are taken from the caches
+    cache_topic_samples ("realpower.default_max_15m@selftest-ups", "selftest-ups", 65011, "W",
+                         { { 1000, 10 }, { 1900, 12 }, { 2800, 11 } });
+    cache_topic_samples ("voltage.input_min_15m@selftest-ups", "selftest-ups", 65012, "V",
+                         { { 1000, 230 }, { 1900, 231 } });
+    auto pop_equals = [] (zmsg_t *msg, const char *expected) -> bool
+        {
+            char *frame = zmsg_popstr (msg);
+            bool equal = frame && streq (frame, expected);
+            zstr_free (&frame);
+            return equal;
+        };
+    msg = zmsg_new();
+    zmsg_addstr (msg, uuid);
+    zmsg_addstr (msg, "GET_MULTI");
+    zmsg_addstr (msg, "1000");
+    zmsg_addstr (msg, "2000");
+    zmsg_addstr (msg, "3");
+    zmsg_addstr (msg, "selftest-ups");
+    zmsg_addstr (msg, "realpower.default");
+    zmsg_addstr (msg, "15m");
+    zmsg_addstr (msg, "max");
+    zmsg_addstr (msg, "selftest-ups");
+    zmsg_addstr (msg, "voltage.input");
+    zmsg_addstr (msg, "15m");
+    zmsg_addstr (msg, "min");
+    // requested twice, the points come twice
+    zmsg_addstr (msg, "selftest-ups");
+    zmsg_addstr (msg, "realpower.default");
+    zmsg_addstr (msg, "15m");
+    zmsg_addstr (msg, "max");
+    assert (mlm_client_sendto (mbox_client, "fty-metric-store", AVG_GRAPH, NULL, 1000, &msg) >= 0);
+    assert ((msg = mlm_client_recv (mbox_client)));
+    assert (pop_equals (msg, uuid));
+    assert (pop_equals (msg, "OK"));
+    assert (pop_equals (msg, "1000"));
+    assert (pop_equals (msg, "2000"));
+    assert (pop_equals (msg, "3"));
+    for (int i = 0; i != 2; i++) {
+        assert (pop_equals (msg, "selftest-ups"));
+        assert (pop_equals (msg, "realpower.default"));
+        assert (pop_equals (msg, "15m"));
+        assert (pop_equals (msg, "max"));
+        assert (pop_equals (msg, "OK"));
+        assert (pop_equals (msg, "W"));
+        // the point at 2800 is out of the range
+        assert (pop_equals (msg, "2"));
+        assert (pop_equals (msg, "1000"));
+        assert (pop_equals (msg, "10.000000"));
+        assert (pop_equals (msg, "1900"));
+        assert (pop_equals (msg, "12.000000"));
+        if (i == 1)
+            break;
+        assert (pop_equals (msg, "selftest-ups"));
+        assert (pop_equals (msg, "voltage.input"));
+        assert (pop_equals (msg, "15m"));
+        assert (pop_equals (msg, "min"));
+        assert (pop_equals (msg, "OK"));
+        assert (pop_equals (msg, "V"));
+        assert (pop_equals (msg, "2"));
+        assert (pop_equals (msg, "1000"));
+        assert (pop_equals (msg, "230.000000"));
+        assert (pop_equals (msg, "1900"));
+        assert (pop_equals (msg, "231.000000"));
+    }
+    assert (zmsg_size (msg) == 0);
+    zmsg_destroy (&msg);
+
+    log_trace ("Test for GET of a step computed from a finer one");
+    // 30m is not stored, it is computed from the 15m samples cached above
+    cache_missing_topic ("realpower.default_max_30m@selftest-ups");
+    for (int i = 0; i != 2; i++) {
+        msg = zmsg_new();
+        zmsg_addstr (msg, uuid);
+        zmsg_addstr (msg, "GET");
+        zmsg_addstr (msg, "selftest-ups");
+        zmsg_addstr (msg, "realpower.default");
+        zmsg_addstr (msg, "30m");
+        zmsg_addstr (msg, "max");
+        zmsg_addstr (msg, "1000");
+        zmsg_addstr (msg, "3000");
+        zmsg_addstr (msg, "1");
+        assert (mlm_client_sendto (mbox_client, "fty-metric-store", AVG_GRAPH, NULL, 1000, &msg) >= 0);
+        assert ((msg = mlm_client_recv (mbox_client)));
+        assert (pop_equals (msg, uuid));
+        assert (pop_equals (msg, "OK"));
+        assert (pop_equals (msg, "selftest-ups"));
+        assert (pop_equals (msg, "realpower.default"));
+        assert (pop_equals (msg, "30m"));
+        assert (pop_equals (msg, "max"));
+        assert (pop_equals (msg, "1000"));
+        assert (pop_equals (msg, "3000"));
+        assert (pop_equals (msg, "1"));
+        assert (pop_equals (msg, "W"));
+        // the only bucket starting in the range, max of 12 at 1900 and 11 at 2800
+        assert (pop_equals (msg, "1800"));
+        assert (pop_equals (msg, "12.000000"));
+        assert (zmsg_size (msg) == 0);
+        zmsg_destroy (&msg);
+    }
+
+    log_trace ("Test for the rollup of real time metrics");
+    // the rolled up topic is known, its rows are prepared without DB
+    cache_topic_samples ("selftest.rollup_max_15m@selftest-rollup", "selftest-rollup", 65021, "W", {});
+    mlm_client_t *producer = mlm_client_new ();
+    assert (mlm_client_connect (producer, endpoint, 5000, "rollup-producer") >= 0);
+    assert (mlm_client_set_producer (producer, FTY_PROTO_STREAM_METRICS) >= 0);
+    // the first bucket is skipped, the second one is finished by the third
+    const struct {
+        uint64_t time;
+        const char *value;
+    } rollup_samples [] = { { 2700, "50" }, { 3600, "10" }, { 3700, "30" }, { 4500, "5" } };
+    for (const auto &sample : rollup_samples) {
+        msg = fty_proto_encode_metric (NULL, sample.time, 60, "selftest.rollup", "selftest-rollup", sample.value, "W");
+        assert (mlm_client_send (producer, "selftest.rollup@selftest-rollup", &msg) >= 0);
+    }
+    // the rows of the finished buckets are prepared by the periodic flush
+    bool rolled_up = false;
+    for (int i = 0; i != 30 && !rolled_up; i++) {
+        zclock_sleep (POLL_INTERVAL / 2);
+        msg = zmsg_new();
+        zmsg_addstr (msg, uuid);
+        zmsg_addstr (msg, "GET");
+        zmsg_addstr (msg, "selftest-rollup");
+        zmsg_addstr (msg, "selftest.rollup");
+        zmsg_addstr (msg, "15m");
+        zmsg_addstr (msg, "max");
+        zmsg_addstr (msg, "3600");
+        zmsg_addstr (msg, "4000");
+        zmsg_addstr (msg, "1");
+        assert (mlm_client_sendto (mbox_client, "fty-metric-store", AVG_GRAPH, NULL, 1000, &msg) >= 0);
+        assert ((msg = mlm_client_recv (mbox_client)));
+        assert (pop_equals (msg, uuid));
+        // nothing in the tail cache yet, the DB is read
+        if (pop_equals (msg, "OK") && zmsg_size (msg) == 10) {
+            assert (pop_equals (msg, "selftest-rollup"));
+            assert (pop_equals (msg, "selftest.rollup"));
+            assert (pop_equals (msg, "15m"));
+            assert (pop_equals (msg, "max"));
+            assert (pop_equals (msg, "3600"));
+            assert (pop_equals (msg, "4000"));
+            assert (pop_equals (msg, "1"));
+            assert (pop_equals (msg, "W"));
+            assert (pop_equals (msg, "3600"));
+            assert (pop_equals (msg, "30.000000"));
+            rolled_up = true;
+        }
+        zmsg_destroy (&msg);
+    }
+    assert (rolled_up);
+    mlm_client_destroy (&producer);
+
+    log_trace ("Test for STATS");
+    msg = zmsg_new();
+    zmsg_addstr (msg, uuid);
+    assert (mlm_client_sendto (mbox_client, "fty-metric-store", STATS_SUBJECT, NULL, 1000, &msg) >= 0);
+    assert ((msg = mlm_client_recv (mbox_client)));
+    received_uuid = zmsg_popstr (msg);
+    assert (streq (uuid, received_uuid));
+    zstr_free (&received_uuid);
+    result = zmsg_popstr (msg);
+    assert (result!=NULL && streq (result, "OK"));
+    zstr_free (&result);
+    // name and value pairs, the GET requests above are counted
+    assert (zmsg_size (msg) % 2 == 0);
+    bool get_requests_found = false;
+    char *name;
+    while ((name = zmsg_popstr (msg))) {
+        char *value = zmsg_popstr (msg);
+        assert (value);
+        if (streq (name, "get_requests")) {
+            assert (atoi (value) > 0);
+            get_requests_found = true;
+        }
+        zstr_free (&value);
+        zstr_free (&name);
+    }
+    assert (get_requests_found);
+    zmsg_destroy (&msg);
+
     mlm_client_destroy(&mbox_client);
     zactor_destroy(&self);
     zactor_destroy(&server);
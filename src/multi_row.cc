@@ -25,8 +25,41 @@
  */
 
 #include "multi_row.h"
+#include <algorithm>
 #include <ctime>
 
+// placeholder names and queries for every bulk arity, built only once
+// instead of formatting them again for each flush
+struct BulkStatements {
+    vector<string> time;
+    vector<string> value;
+    vector<string> scale;
+    vector<string> topic_id;
+    // queries for 1, 2, 4 ... MAX_BULK_ROW rows
+    vector<string> query;
+
+    BulkStatements ()
+    {
+        for (size_t i = 0; i < MAX_BULK_ROW; i++) {
+            string n = std::to_string (i);
+            time.push_back ("t" + n);
+            value.push_back ("v" + n);
+            scale.push_back ("s" + n);
+            topic_id.push_back ("i" + n);
+        }
+        for (size_t rows = 1; rows <= MAX_BULK_ROW; rows *= 2) {
+            query.push_back (MultiRowCache::get_insert_query (rows));
+        }
+    }
+};
+
+static const BulkStatements &
+s_bulk_statements ()
+{
+    static BulkStatements statements;
+    return statements;
+}
+
 MultiRowCache::MultiRowCache ()
 {
     _max_row = MAX_ROW_DEFAULT;
@@ -45,6 +78,17 @@ MultiRowCache::MultiRowCache ()
         if (max_delay_s > 0) _max_delay_s = (uint32_t)max_delay_s;
         log_info("use %s %ds as max delay before multi row insertion",EV_DBSTORE_MAX_DELAY,_max_delay_s);
     }
+
+    reserve ();
+}
+
+void
+MultiRowCache::reserve ()
+{
+    _time.reserve (_max_row);
+    _value.reserve (_max_row);
+    _scale.reserve (_max_row);
+    _topic_id.reserve (_max_row);
 }
 
 void
@@ -54,54 +98,177 @@ MultiRowCache::push_back (
     m_msrmnt_scale_t scale,
     m_msrmnt_tpc_id_t topic_id)
 {
-    //multiple row insertion request
-    char val[50];
-    snprintf(val,sizeof(val),"(%" PRIu64 ",%" PRIi32 ",%" PRIi16 ",%" PRIi16 ")",time,value,scale,topic_id );
-    _row_cache.push_back(val);
+    _time.push_back (time);
+    _value.push_back (value);
+    _scale.push_back (scale);
+    _topic_id.push_back (topic_id);
     //check if it is the first one => if yes, memory the timestamp
-    if (_row_cache.size() == 1) {
+    if (_time.size() == 1) {
         _first_ms = get_clock_ms();
     }
 }
 
+size_t
+MultiRowCache::append (const MultiRowCache &other, size_t first)
+{
+    size_t room = _time.size () < _max_row ? _max_row - _time.size () : 0;
+    size_t rows = std::min (other._time.size () - first, room);
+    if (rows == 0)
+        return 0;
+
+    if (_time.size () == 0) {
+        _first_ms = get_clock_ms ();
+    }
+    _time.insert (_time.end (), other._time.begin () + first, other._time.begin () + first + rows);
+    _value.insert (_value.end (), other._value.begin () + first, other._value.begin () + first + rows);
+    _scale.insert (_scale.end (), other._scale.begin () + first, other._scale.begin () + first + rows);
+    _topic_id.insert (_topic_id.end (), other._topic_id.begin () + first, other._topic_id.begin () + first + rows);
+    return rows;
+}
+
 bool
 MultiRowCache::is_ready_for_insert ()
 {
-    if (_row_cache.size() == 0)
+    return is_ready_for_insert (_max_row, (long) _max_delay_s * 1000);
+}
+
+bool
+MultiRowCache::is_ready_for_insert (size_t max_row, long max_delay_ms)
+{
+    if (_time.size() == 0)
         return false;
 
     // max cache size limit reached ?
-    if (_row_cache.size() >= _max_row)
+    if (_time.size() >= max_row)
         return true;
 
     // time to flush measurement ?
     long now_ms = get_clock_ms();
     long elapsed_periodic_ms = now_ms - _first_ms;
-    if (elapsed_periodic_ms >= ((long)_max_delay_s * 1000))
+    if (elapsed_periodic_ms >= max_delay_ms)
         return true;
 
     return false;
-    //return (_row_cache.size()>=_max_row || elapsed_periodic_ms >= (long)_max_delay_s * 1000 );
 }
 
-// return INSERT query or empty string if no value in cache available
 string
-MultiRowCache::get_insert_query ()
+MultiRowCache::get_insert_query (size_t rows)
 {
-    if (_row_cache.size() == 0)
-        return "";
-
     string query = "INSERT INTO t_bios_measurement (timestamp, value, scale, topic_id) VALUES ";
-    for (list<string>::iterator value=_row_cache.begin(); value != _row_cache.end(); ){
-        query += *value;
-        if (++value != _row_cache.end()) query += ",";
+    for (size_t i = 0; i < rows; i++) {
+        string n = std::to_string (i);
+        if (i != 0) query += ",";
+        query += "(:t" + n + ",:v" + n + ",:s" + n + ",:i" + n + ")";
     }
     query += " ON DUPLICATE KEY UPDATE value=VALUES(value),scale=VALUES(scale) ";
-
-    log_debug("query %s", query.c_str());
     return query;
 }
 
+static inline size_t
+s_slot_of (m_msrmnt_tpc_id_t topic_id, int64_t time, size_t mask)
+{
+    uint64_t hash = ((uint64_t) topic_id * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t) time * 0xC2B2AE3D27D4EB4FULL);
+    hash ^= hash >> 29;
+    return (size_t) hash & mask;
+}
+
+size_t
+MultiRowCache::coalesce ()
+{
+    size_t total = size ();
+    if (total < 2)
+        return 0;
+
+    // at most half full, so the probes stay short
+    size_t capacity = 4;
+    while (capacity < 2 * total)
+        capacity *= 2;
+    _slots.assign (capacity, 0);
+    size_t mask = capacity - 1;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < total; i++) {
+        size_t slot = s_slot_of (_topic_id [i], _time [i], mask);
+        while (_slots [slot] != 0) {
+            size_t row = _slots [slot] - 1;
+            if (_topic_id [row] == _topic_id [i] && _time [row] == _time [i])
+                break;
+            slot = (slot + 1) & mask;
+        }
+        if (_slots [slot] != 0) {
+            // the last value wins
+            size_t row = _slots [slot] - 1;
+            _value [row] = _value [i];
+            _scale [row] = _scale [i];
+            continue;
+        }
+        if (kept != i) {
+            _time [kept] = _time [i];
+            _value [kept] = _value [i];
+            _scale [kept] = _scale [i];
+            _topic_id [kept] = _topic_id [i];
+        }
+        _slots [slot] = (uint32_t) (kept + 1);
+        kept++;
+    }
+
+    _time.resize (kept);
+    _value.resize (kept);
+    _scale.resize (kept);
+    _topic_id.resize (kept);
+    return total - kept;
+}
+
+uint32_t
+MultiRowCache::insert (tntdb::Connection &conn)
+{
+    size_t removed = coalesce ();
+    if (removed != 0) {
+        store_stats ().add (STATS_ROWS_COALESCED, removed);
+        log_debug ("[t_bios_measurement]: %zu duplicated rows coalesced", removed);
+    }
+
+    size_t total = size ();
+    if (total == 0)
+        return 0;
+
+    uint32_t affected_rows = 0;
+    tntdb::Transaction transaction (conn);
+    for (size_t first = 0; first < total; ) {
+        // split the rest into power of two chunks, so only a handful
+        // of statements is ever prepared on each connection
+        size_t rows = MAX_BULK_ROW;
+        while (rows > total - first)
+            rows /= 2;
+        affected_rows += insert_bulk (conn, first, rows);
+        first += rows;
+    }
+    transaction.commit ();
+
+    log_debug ("[t_bios_measurement]: %zu rows bound into prepared statements", total);
+    return affected_rows;
+}
+
+uint32_t
+MultiRowCache::insert_bulk (tntdb::Connection &conn, size_t first, size_t rows)
+{
+    const BulkStatements &statements = s_bulk_statements ();
+
+    size_t arity = 0;
+    while (((size_t) 1 << arity) < rows)
+        arity++;
+    assert (((size_t) 1 << arity) == rows);
+
+    tntdb::Statement st = conn.prepareCached (statements.query [arity]);
+    for (size_t i = 0; i < rows; i++) {
+        st.set (statements.time [i], _time [first + i])
+          .set (statements.value [i], _value [first + i])
+          .set (statements.scale [i], _scale [first + i])
+          .set (statements.topic_id [i], _topic_id [first + i]);
+    }
+    return st.execute ();
+}
+
 long
 MultiRowCache::get_clock_ms ()
 {
@@ -116,6 +283,72 @@ MultiRowCache::get_clock_ms ()
 void
 multi_row_test (bool verbose)
 {
-    printf (" * multi_row: Empty test - OK.\n");
+    printf (" * multi_row: ");
+
+    //  @selftest
+    assert (MultiRowCache::get_insert_query (2) ==
+        "INSERT INTO t_bios_measurement (timestamp, value, scale, topic_id) VALUES "
+        "(:t0,:v0,:s0,:i0),(:t1,:v1,:s1,:i1)"
+        " ON DUPLICATE KEY UPDATE value=VALUES(value),scale=VALUES(scale) ");
+
+    MultiRowCache cache (3, 3600);
+    assert (cache.size () == 0);
+    assert (!cache.is_ready_for_insert ());
+    cache.push_back (1234567890, 42, -1, 1);
+    cache.push_back (1234567890, 43, -1, 2);
+    assert (cache.size () == 2);
+    assert (!cache.is_ready_for_insert ());
+    cache.push_back (1234567891, 44, 0, 1);
+    assert (cache.is_ready_for_insert ());
+
+    // rows of a producer batch are merged up to max_row
+    MultiRowCache batch (10, 3600);
+    for (int i = 0; i != 5; i++)
+        batch.push_back (1234567900 + i, i, 0, 3);
+    cache.clear ();
+    cache.push_back (1234567890, 42, -1, 1);
+    assert (cache.append (batch, 0) == 2);
+    assert (cache.size () == 3);
+    assert (cache.append (batch, 2) == 0);
+    cache.clear ();
+    assert (cache.append (batch, 2) == 3);
+    assert (cache.append (batch, 5) == 0);
+    assert (cache.size () == 3);
+    assert (cache.is_ready_for_insert ());
+
+    cache.clear ();
+    assert (cache.size () == 0);
+    assert (!cache.is_ready_for_insert ());
+
+    // duplicates of topic and timestamp keep the first place and last value
+    MultiRowCache duplicates (100, 3600);
+    duplicates.push_back (1234567890, 1, 0, 1);
+    duplicates.push_back (1234567890, 2, 0, 2);
+    duplicates.push_back (1234567891, 3, 0, 1);
+    duplicates.push_back (1234567890, 4, -1, 1);
+    duplicates.push_back (1234567890, 5, 0, 2);
+    duplicates.push_back (1234567890, 6, -2, 1);
+    assert (duplicates.coalesce () == 3);
+    assert (duplicates.size () == 3);
+    assert (duplicates.get_topic_id (0) == 1 && duplicates.get_value (0) == 6 && duplicates.get_scale (0) == -2);
+    assert (duplicates.get_topic_id (1) == 2 && duplicates.get_value (1) == 5);
+    assert (duplicates.get_time (2) == 1234567891 && duplicates.get_value (2) == 3);
+    assert (duplicates.coalesce () == 0);
+
+    // colliding slots of many keys are probed
+    duplicates.clear ();
+    for (int round = 0; round != 2; round++) {
+        for (int i = 0; i != 50; i++)
+            duplicates.push_back (1234567890 + i % 5, round, 0, i / 5);
+    }
+    assert (duplicates.coalesce () == 50);
+    for (size_t i = 0; i != 50; i++) {
+        assert (duplicates.get_time (i) == 1234567890 + (int64_t) (i % 5));
+        assert (duplicates.get_topic_id (i) == i / 5);
+        assert (duplicates.get_value (i) == 1);
+    }
+    //  @end
+
+    printf ("OK\n");
 }
 
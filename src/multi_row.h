@@ -24,14 +24,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef SRC_PERSIST_MULTI_ROW_H
 #define SRC_PERSIST_MULTI_ROW_H
 
-#include <list>
 #include <string>
+#include <vector>
 
 #include "fty_metric_store_classes.h"
 
 #define MAX_ROW_DEFAULT   1000
 #define MAX_DELAY_DEFAULT 1
 
+// biggest number of rows bound into one prepared INSERT statement
+#define MAX_BULK_ROW      256
+
 #define EV_DBSTORE_MAX_ROW   "BIOS_DBSTORE_MAX_ROW"
 #define EV_DBSTORE_MAX_DELAY "BIOS_DBSTORE_MAX_DELAY"
 
@@ -44,6 +47,7 @@ class MultiRowCache {
         {
             _max_row = max_row;
             _max_delay_s = max_delay_s;
+            reserve ();
         }
 
         void push_back(
@@ -52,16 +56,62 @@ class MultiRowCache {
             m_msrmnt_scale_t scale,
             m_msrmnt_tpc_id_t topic_id);
 
+        /*
+         * \brief append the rows of other from position first on, until
+         *  this cache holds max_row rows
+         *  return number of rows appended
+         */
+        size_t append(const MultiRowCache &other, size_t first);
+
         /*
          * \brief check one of those conditions :
          *  number of values > _max_row
          * or delay between first value and now > _max_delay_s
          */
         bool is_ready_for_insert();
+        // same with the limits given by a flush policy
+        bool is_ready_for_insert(size_t max_row, long max_delay_ms);
 
-        string get_insert_query();
+        /*
+         * \brief INSERT query with placeholders for the given number of rows
+         *  (:t0, :v0, :s0, :i0), (:t1, ...
+         */
+        static string get_insert_query(size_t rows);
+
+        /*
+         * \brief keep one row per topic and timestamp, the first one with
+         *  the value and scale of the last one, as ON DUPLICATE KEY would
+         *  return number of rows removed
+         */
+        size_t coalesce();
 
-        void clear() { _row_cache.clear(); reset_clock(); }
+        /*
+         * \brief insert all the cached rows in one transaction
+         *  rows are coalesced first, then bound into cached prepared
+         *  statements of at most MAX_BULK_ROW rows, so the server parses
+         *  each arity only once
+         *  Throws on error, the cache keeps the coalesced rows
+         *  return number of affected rows
+         */
+        uint32_t insert(tntdb::Connection &conn);
+
+        size_t size() const { return _time.size(); }
+
+        // fields of the row i
+        int64_t get_time(size_t i) const { return _time[i]; }
+        m_msrmnt_value_t get_value(size_t i) const { return _value[i]; }
+        m_msrmnt_scale_t get_scale(size_t i) const { return _scale[i]; }
+        m_msrmnt_tpc_id_t get_topic_id(size_t i) const { return _topic_id[i]; }
+
+        // position in the spool after the last row, 0 if not spooled
+        uint64_t get_spool_end() const { return _spool_end; }
+        void set_spool_end(uint64_t spool_end) { _spool_end = spool_end; }
+
+        void clear() {
+            _time.clear(); _value.clear(); _scale.clear(); _topic_id.clear();
+            _spool_end = 0;
+            reset_clock();
+        }
         void reset_clock() { _first_ms = get_clock_ms(); }
 
         int get_max_row() { return _max_row; }
@@ -69,9 +119,20 @@ class MultiRowCache {
 
 
     private:
-        list<string> _row_cache;
+        // one column per field, so the rows stay in contiguous memory
+        vector<int64_t> _time;
+        vector<m_msrmnt_value_t> _value;
+        vector<m_msrmnt_scale_t> _scale;
+        vector<m_msrmnt_tpc_id_t> _topic_id;
         uint32_t _max_delay_s;
         uint32_t _max_row;
+        uint64_t _spool_end = 0;
+        // open addressing index of the rows by topic and timestamp, 0 is a
+        // free slot, kept between flushes to avoid the allocations
+        vector<uint32_t> _slots;
+
+        void reserve();
+        uint32_t insert_bulk(tntdb::Connection &conn, size_t first, size_t rows);
 
         long get_clock_ms();
         long _first_ms = get_clock_ms();
@@ -0,0 +1,317 @@
+/*  =========================================================================
+    partition_manager - Time range partitions of the measurement table
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    partition_manager - Time range partitions of the measurement table
+@discuss
+    Dropping a partition of expired samples takes the same time whatever
+    the number of its rows, and range queries on a partitioned table read
+    only the partitions of their time range.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+#include <ctime>
+
+#define SECONDS_PER_DAY (24 * 3600)
+
+bool
+partition_period_from_string (const std::string &name, partition_period_t &period)
+{
+    if (name == "none")
+        period = PARTITION_NONE;
+    else if (name == "daily")
+        period = PARTITION_DAILY;
+    else if (name == "weekly")
+        period = PARTITION_WEEKLY;
+    else
+        return false;
+    return true;
+}
+
+PartitionManager::PartitionManager ()
+{
+    _period = PARTITION_NONE;
+    _ahead = PARTITION_AHEAD_DEFAULT;
+
+    char *env_period = getenv (EV_DBSTORE_PARTITION);
+    if (env_period) {
+        if (!partition_period_from_string (env_period, _period)) {
+            log_error ("%s '%s' is not one of none, daily, weekly", EV_DBSTORE_PARTITION, env_period);
+        }
+        log_info ("use %s '%s' as partitioning of measurements", EV_DBSTORE_PARTITION, env_period);
+    }
+
+    char *env_ahead = getenv (EV_DBSTORE_PARTITION_AHEAD);
+    if (env_ahead) {
+        int ahead = atoi (env_ahead);
+        if (ahead > 0) _ahead = ahead;
+        log_info ("use %s %d as number of partitions created ahead", EV_DBSTORE_PARTITION_AHEAD, _ahead);
+    }
+}
+
+PartitionManager::PartitionManager (partition_period_t period, int ahead) :
+    _period (period),
+    _ahead (ahead > 0 ? ahead : 1)
+{
+}
+
+int64_t
+PartitionManager::period_start (int64_t timestamp)
+{
+    // days since the epoch rounded down, also for negative timestamps
+    int64_t day = timestamp / SECONDS_PER_DAY;
+    if (timestamp % SECONDS_PER_DAY < 0)
+        day--;
+    if (_period == PARTITION_WEEKLY) {
+        // 1970-01-01 was Thursday, 3 days after Monday
+        day -= ((day + 3) % 7 + 7) % 7;
+    }
+    return day * SECONDS_PER_DAY;
+}
+
+int64_t
+PartitionManager::period_end (int64_t start)
+{
+    return start + (_period == PARTITION_WEEKLY ? 7 : 1) * SECONDS_PER_DAY;
+}
+
+std::string
+PartitionManager::partition_name (int64_t start)
+{
+    time_t t = (time_t) start;
+    struct tm tm;
+    gmtime_r (&t, &tm);
+    char name [16];
+    strftime (name, sizeof (name), "p%Y%m%d", &tm);
+    return name;
+}
+
+std::vector<PartitionManager::Partition>
+PartitionManager::to_create (const std::vector<Partition> &existing, int64_t now)
+{
+    std::vector<Partition> created;
+    if (_period == PARTITION_NONE)
+        return created;
+
+    int64_t lower = period_start (now);
+    bool bounded = false;
+    for (const Partition &partition : existing) {
+        if (partition.less_than == PARTITION_MAXVALUE)
+            continue;
+        lower = bounded ? std::max (lower, partition.less_than) : partition.less_than;
+        bounded = true;
+    }
+
+    int64_t limit = period_start (now);
+    for (int i = 0; i <= _ahead; i++)
+        limit = period_end (limit);
+
+    // the first partition also takes the gap after the last existing one
+    while (lower < limit) {
+        int64_t bound = period_end (period_start (lower));
+        created.push_back (Partition { partition_name (lower), bound });
+        lower = bound;
+    }
+    return created;
+}
+
+std::vector<PartitionManager::Partition>
+PartitionManager::to_drop (const std::vector<Partition> &existing, int64_t now, int64_t max_age_s)
+{
+    std::vector<Partition> dropped;
+    if (_period == PARTITION_NONE || max_age_s <= 0)
+        return dropped;
+
+    int64_t expired = now - max_age_s;
+    for (const Partition &partition : existing) {
+        if (partition.less_than != PARTITION_MAXVALUE && partition.less_than <= expired)
+            dropped.push_back (partition);
+    }
+    return dropped;
+}
+
+std::string
+PartitionManager::create_query (const std::vector<Partition> &existing, const std::vector<Partition> &created)
+{
+    std::string list;
+    for (const Partition &partition : created) {
+        if (!list.empty ()) list += ", ";
+        list += "PARTITION " + partition.name + " VALUES LESS THAN (" + std::to_string (partition.less_than) + ")";
+    }
+
+    // new partitions must be split from the catch-all partition
+    for (const Partition &partition : existing) {
+        if (partition.less_than == PARTITION_MAXVALUE) {
+            return "ALTER TABLE t_bios_measurement REORGANIZE PARTITION " + partition.name + " INTO ("
+                + list + ", PARTITION " + partition.name + " VALUES LESS THAN MAXVALUE)";
+        }
+    }
+    return "ALTER TABLE t_bios_measurement ADD PARTITION (" + list + ")";
+}
+
+std::string
+PartitionManager::drop_query (const std::vector<Partition> &dropped)
+{
+    std::string query = "ALTER TABLE t_bios_measurement DROP PARTITION ";
+    for (size_t i = 0; i < dropped.size (); i++) {
+        if (i != 0) query += ",";
+        query += dropped [i].name;
+    }
+    return query;
+}
+
+bool
+PartitionManager::select_partitions (tntdb::Connection &conn, std::vector<Partition> &partitions)
+{
+    tntdb::Statement st = conn.prepareCached (
+        " SELECT "
+        "   PARTITION_NAME, PARTITION_METHOD, PARTITION_DESCRIPTION "
+        " FROM information_schema.PARTITIONS "
+        " WHERE "
+        "   TABLE_SCHEMA = DATABASE() AND "
+        "   TABLE_NAME = 't_bios_measurement' "
+        " ORDER BY PARTITION_ORDINAL_POSITION "
+    );
+    for (tntdb::Statement::const_iterator it = st.begin ();
+         it != st.end (); ++it) {
+        if ((*it)["PARTITION_NAME"].isNull ())
+            return false;
+
+        std::string method;
+        (*it)["PARTITION_METHOD"].get(method);
+        if (method != "RANGE")
+            return false;
+
+        Partition partition;
+        (*it)["PARTITION_NAME"].get(partition.name);
+        std::string description;
+        (*it)["PARTITION_DESCRIPTION"].get(description);
+        partition.less_than = description == "MAXVALUE" ? PARTITION_MAXVALUE : string_to_int64 (description.c_str ());
+        if (errno != 0) {
+            errno = 0;
+            return false;
+        }
+        partitions.push_back (partition);
+    }
+    return !partitions.empty ();
+}
+
+int
+PartitionManager::maintain (tntdb::Connection &conn, int64_t now, int64_t max_age_s)
+{
+    std::vector<Partition> existing;
+    if (!select_partitions (conn, existing)) {
+        if (!_warned) {
+            log_warning ("t_bios_measurement is not partitioned by RANGE (timestamp), partitions are not managed");
+            _warned = true;
+        }
+        return -1;
+    }
+
+    std::vector<Partition> created = to_create (existing, now);
+    if (!created.empty ()) {
+        conn.execute (create_query (existing, created));
+        log_info ("%zu partitions of t_bios_measurement created, up to %s",
+                  created.size (), created.back ().name.c_str ());
+    }
+
+    std::vector<Partition> dropped = to_drop (existing, now, max_age_s);
+    if (!dropped.empty ()) {
+        conn.execute (drop_query (dropped));
+        log_info ("%zu expired partitions of t_bios_measurement dropped, up to %s",
+                  dropped.size (), dropped.back ().name.c_str ());
+    }
+    return (int) dropped.size ();
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+partition_manager_test (bool verbose)
+{
+    printf (" * partition_manager: ");
+
+    //  @selftest
+    partition_period_t period;
+    assert (partition_period_from_string ("weekly", period) && period == PARTITION_WEEKLY);
+    assert (!partition_period_from_string ("monthly", period));
+
+    // 2020-06-10 12:00:00 UTC, Wednesday
+    const int64_t now = 1591790400;
+    const int64_t day = 86400;
+
+    PartitionManager daily (PARTITION_DAILY, 2);
+    assert (daily.period_start (now) == 1591747200);
+    assert (daily.period_end (1591747200) == 1591747200 + day);
+    assert (daily.period_start (-1) == -day);
+    assert (PartitionManager::partition_name (1591747200) == "p20200610");
+
+    PartitionManager weekly (PARTITION_WEEKLY, 1);
+    // Monday 2020-06-08
+    assert (weekly.period_start (now) == 1591574400);
+    assert (weekly.period_start (1591574400) == 1591574400);
+    assert (weekly.period_start (1591574399) == 1591574400 - 7 * day);
+
+    // nothing but the catch-all partition: today and two days ahead
+    std::vector<PartitionManager::Partition> existing { { "pmax", PARTITION_MAXVALUE } };
+    std::vector<PartitionManager::Partition> created = daily.to_create (existing, now);
+    assert (created.size () == 3);
+    assert (created [0].name == "p20200610" && created [0].less_than == 1591747200 + day);
+    assert (created [2].name == "p20200612" && created [2].less_than == 1591747200 + 3 * day);
+    assert (PartitionManager::create_query (existing, created) ==
+        "ALTER TABLE t_bios_measurement REORGANIZE PARTITION pmax INTO ("
+        "PARTITION p20200610 VALUES LESS THAN (1591833600), "
+        "PARTITION p20200611 VALUES LESS THAN (1591920000), "
+        "PARTITION p20200612 VALUES LESS THAN (1592006400), "
+        "PARTITION pmax VALUES LESS THAN MAXVALUE)");
+
+    // only the missing ones are created
+    existing = {
+        { "p20200601", 1591056000 },
+        { "p20200610", 1591833600 },
+        { "p20200611", 1591920000 }
+    };
+    created = daily.to_create (existing, now);
+    assert (created.size () == 1 && created [0].name == "p20200612" && created [0].less_than == 1592006400);
+    assert (PartitionManager::create_query (existing, created) ==
+        "ALTER TABLE t_bios_measurement ADD PARTITION (PARTITION p20200612 VALUES LESS THAN (1592006400))");
+    existing.push_back ({ "p20200612", 1592006400 });
+    assert (daily.to_create (existing, now).empty ());
+
+    // partitions with all the samples older than 8 days
+    std::vector<PartitionManager::Partition> dropped = daily.to_drop (existing, now, 8 * day);
+    assert (dropped.size () == 1 && dropped [0].name == "p20200601");
+    assert (PartitionManager::drop_query (dropped) == "ALTER TABLE t_bios_measurement DROP PARTITION p20200601");
+    assert (daily.to_drop (existing, now, 10 * day).empty ());
+    assert (daily.to_drop (existing, now, 0).empty ());
+
+    PartitionManager none (PARTITION_NONE, 7);
+    assert (none.to_create (existing, now).empty ());
+    assert (none.to_drop (existing, now, day).empty ());
+    //  @end
+
+    printf ("OK\n");
+}
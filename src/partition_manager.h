@@ -0,0 +1,112 @@
+/*  =========================================================================
+    partition_manager - Time range partitions of the measurement table
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef PARTITION_MANAGER_H_INCLUDED
+#define PARTITION_MANAGER_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+// partitions created ahead of the current one
+#define PARTITION_AHEAD_DEFAULT 7
+
+// none, daily or weekly
+#define EV_DBSTORE_PARTITION "BIOS_DBSTORE_PARTITION"
+#define EV_DBSTORE_PARTITION_AHEAD "BIOS_DBSTORE_PARTITION_AHEAD"
+
+// upper bound of the catch-all partition
+#define PARTITION_MAXVALUE INT64_MAX
+
+typedef enum {
+    // the table is not managed
+    PARTITION_NONE,
+    PARTITION_DAILY,
+    // weeks start on Monday, 00:00 UTC
+    PARTITION_WEEKLY
+} partition_period_t;
+
+// return false if the name is not one of "none", "daily", "weekly"
+FTY_METRIC_STORE_PRIVATE bool
+    partition_period_from_string (const std::string &name, partition_period_t &period);
+
+/*
+ * \brief Partitions of t_bios_measurement by RANGE (timestamp)
+ *
+ * The manager does not partition the table, the schema belongs to the
+ * database package and partitioning needs the timestamp in every unique
+ * key. When the table is partitioned, it keeps ahead partitions for the
+ * next periods, splitting them from the MAXVALUE partition if there is
+ * one, and drops the partitions whose samples are all expired, which is
+ * a metadata operation instead of a DELETE of every row.
+ * Partitions are named p<YYYYMMDD> after their first day.
+ */
+class PartitionManager {
+    public:
+        struct Partition {
+            std::string name;
+            // timestamps of the partition are less than this bound
+            int64_t less_than;
+        };
+
+        PartitionManager ();
+        PartitionManager (partition_period_t period, int ahead);
+
+        partition_period_t get_period () { return _period; }
+
+        // start of the period holding the timestamp
+        int64_t period_start (int64_t timestamp);
+        int64_t period_end (int64_t start);
+
+        static std::string partition_name (int64_t start);
+
+        // partitions missing up to ahead periods after the one of now
+        std::vector<Partition> to_create (const std::vector<Partition> &existing, int64_t now);
+
+        // partitions with all the samples older than max_age_s
+        std::vector<Partition> to_drop (const std::vector<Partition> &existing, int64_t now, int64_t max_age_s);
+
+        // DDL statements changing the existing partitions
+        static std::string create_query (const std::vector<Partition> &existing, const std::vector<Partition> &created);
+        static std::string drop_query (const std::vector<Partition> &dropped);
+
+        /*
+         * \brief create the ahead partitions and drop the expired ones
+         *  max_age_s <= 0 keeps all the partitions
+         *  return number of dropped partitions, -1 if the table is not
+         *  partitioned by range
+         */
+        int maintain (tntdb::Connection &conn, int64_t now, int64_t max_age_s);
+
+    private:
+        // return false if the table is not partitioned by range
+        bool select_partitions (tntdb::Connection &conn, std::vector<Partition> &partitions);
+
+        partition_period_t _period;
+        int _ahead;
+        bool _warned = false;
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    partition_manager_test (bool verbose);
+
+#endif
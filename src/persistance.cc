@@ -28,7 +28,22 @@
 
 #include "fty_metric_store_classes.h"
 
-static MultiRowCache g_RowCache;
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+// rows waiting for insertion, g_RowMutex guards the pointer and the cache
+static std::mutex g_RowMutex;
+static std::unique_ptr<MultiRowCache> g_RowCache (new MultiRowCache ());
+static TopicCache g_TopicCache;
+static TopicCache g_ReadTopicCache;
+static FlushWorker g_FlushWorker;
+static TailCache g_TailCache;
+static Retention g_Retention;
+static AssetPurger g_AssetPurger;
+static Spool g_Spool;
+// limits of the row cache, adapted to the observed flushes if enabled
+static FlushPolicy g_FlushPolicy (g_RowCache->get_max_row (), (long) g_RowCache->get_max_delay () * 1000);
 
 //
 int
@@ -96,13 +111,343 @@ select_measurements (
         tntdb::Statement st = conn.prepareCached (query);
         // ACE: I know, that topic_id would have better performance, but
         // for first iteration lets stay with this approach
-        tntdb::Result result = st.set ("topic", topic)
-                                 .set ("time_st", start_timestamp)
-                                 .set ("time_end", end_timestamp)
-                                 .select ();
+        st.set ("topic", topic)
+          .set ("time_st", start_timestamp)
+          .set ("time_end", end_timestamp);
+
+        // iterate over a cursor, so the rows are fetched while the callback
+        // processes them instead of reading the whole result first
+        for (tntdb::Statement::const_iterator it = st.begin ();
+             it != st.end (); ++it) {
+            cb(*it);
+        }
+        return 0;
+    }
+    catch (const std::exception &e) {
+        log_error("Exception caught: %s", e.what());
+        return -1;
+    }
+    catch (...) {
+        log_error("Unknown exception caught!");
+        return -1;
+    }
+}
+
+//
+int
+resolve_topic (
+        const std::string &connurl,
+        const std::string &topic,
+        std::vector<m_msrmnt_tpc_id_t> &topic_ids,
+        std::string &units)
+{
+    topic_ids.clear ();
+    if (g_ReadTopicCache.get (topic, topic_ids, units)) {
+        return 0;
+    }
+    // a GET of a step which is not stored looks up several missing names
+    int64_t now = zclock_mono ();
+    if (g_ReadTopicCache.is_missing (topic, now)) {
+        log_debug("Topic '%s' not found, cached.", topic.c_str());
+        return -2;
+    }
+
+    try {
+        tntdb::Connection conn = tntdb::connectCached(connurl);
+
+        // unique on topic, units and device, so one name can have several ids
+        tntdb::Statement st = conn.prepareCached (
+            " SELECT "
+            "   id, units "
+            " FROM t_bios_measurement_topic "
+            " WHERE "
+            "   topic = :topic "
+            " ORDER BY id ASC"
+        );
+        st.set ("topic", topic);
+
+        for (tntdb::Statement::const_iterator it = st.begin ();
+             it != st.end (); ++it) {
+            m_msrmnt_tpc_id_t topic_id = 0;
+            (*it)["id"].get(topic_id);
+            if (topic_ids.empty ()) {
+                (*it)["units"].get(units);
+            }
+            topic_ids.push_back (topic_id);
+        }
+    }
+    catch (const std::exception &e) {
+        log_error("Exception caught: %s", e.what());
+        topic_ids.clear ();
+        return -1;
+    }
+    catch (...) {
+        log_error("Unknown exception caught!");
+        topic_ids.clear ();
+        return -1;
+    }
+    if (topic_ids.empty ()) {
+        log_info("Topic '%s' not found.", topic.c_str());
+        g_ReadTopicCache.put_missing (topic, now + TOPIC_CACHE_MISSING_TTL);
+        return -2;
+    }
+
+    std::string::size_type at = topic.rfind ('@');
+    std::string asset = (at == std::string::npos) ? "" : topic.substr (at + 1);
+    g_ReadTopicCache.put (topic, asset, topic_ids, units);
+    return 0;
+}
+
+//
+// Read the samples of topic_id in [start_timestamp, end_timestamp] from the database
+static int
+s_select_measurements_by_id (
+        const std::string &connurl,
+        m_msrmnt_tpc_id_t topic_id,
+        int64_t start_timestamp,
+        int64_t end_timestamp,
+        std::function<void(
+                        int64_t timestamp,
+                        m_msrmnt_value_t value,
+                        m_msrmnt_scale_t scale)>& cb,
+        bool is_ordered)
+{
+    try {
+        tntdb::Connection conn = tntdb::connectCached(connurl);
+        // read the table directly, there is no need to join the topic
+        std::string query =
+            " SELECT "
+            "   value, scale, timestamp "
+            " FROM t_bios_measurement "
+            " WHERE "
+            "   topic_id = :topic_id AND "
+            "   timestamp >= :time_st AND "
+            "   timestamp <= :time_end ";
+        if ( is_ordered ) {
+            query += " ORDER BY timestamp ASC";
+        }
+        tntdb::Statement st = conn.prepareCached (query);
+        st.set ("topic_id", topic_id)
+          .set ("time_st", start_timestamp)
+          .set ("time_end", end_timestamp);
+
+        for (tntdb::Statement::const_iterator it = st.begin ();
+             it != st.end (); ++it) {
+            m_msrmnt_value_t value = 0;
+            (*it)["value"].get(value);
+
+            m_msrmnt_scale_t scale = 0;
+            (*it)["scale"].get(scale);
+
+            int64_t timestamp = 0;
+            (*it)["timestamp"].get(timestamp);
+
+            cb(timestamp, value, scale);
+        }
+        return 0;
+    }
+    catch (const std::exception &e) {
+        log_error("Exception caught: %s", e.what());
+        return -1;
+    }
+    catch (...) {
+        log_error("Unknown exception caught!");
+        return -1;
+    }
+}
+
+//
+// Read the samples of topic_id, the recent ones from the tail cache
+static int
+s_select_measurements_with_tail (
+        const std::string &connurl,
+        m_msrmnt_tpc_id_t topic_id,
+        int64_t start_timestamp,
+        int64_t end_timestamp,
+        std::function<void(
+                        int64_t timestamp,
+                        m_msrmnt_value_t value,
+                        m_msrmnt_scale_t scale)>& cb,
+        bool is_ordered)
+{
+    std::vector<TailCache::Point> tail;
+    int64_t coverage_start = 0;
+    if (!g_TailCache.read (topic_id, start_timestamp, end_timestamp, tail, coverage_start)) {
+        return s_select_measurements_by_id (connurl, topic_id, start_timestamp, end_timestamp, cb, is_ordered);
+    }
+
+    // the tail cache has everything from coverage_start on,
+    // only the part before it is read from the database
+    if (start_timestamp < coverage_start) {
+        int64_t db_end_timestamp = std::min (end_timestamp, coverage_start - 1);
+        int rv = s_select_measurements_by_id (connurl, topic_id, start_timestamp, db_end_timestamp, cb, is_ordered);
+        if (rv != 0)
+            return rv;
+    }
+
+    // newer than anything from the database, so the order is kept
+    for (const TailCache::Point &point : tail) {
+        cb(point.timestamp, point.value, point.scale);
+    }
+    return 0;
+}
+
+//
+// Placeholders :<prefix>0,...,:<prefix>N-1 of an IN list, N is a power of two
+// not less than count, so only a handful of statements is ever prepared.
+// The unused placeholders are bound to the last value.
+static std::string
+s_in_list (const char *prefix, size_t count, size_t &arity)
+{
+    arity = 1;
+    while (arity < count)
+        arity *= 2;
+    std::string list;
+    for (size_t i = 0; i < arity; i++) {
+        if (i != 0) list += ",";
+        list += ":";
+        list += prefix;
+        list += std::to_string (i);
+    }
+    return list;
+}
+
+//
+int
+resolve_topics (
+        const std::string &connurl,
+        const std::vector<std::string> &topics,
+        std::vector<std::vector<m_msrmnt_tpc_id_t>> &topic_ids,
+        std::vector<std::string> &units)
+{
+    topic_ids.assign (topics.size (), std::vector<m_msrmnt_tpc_id_t> ());
+    units.assign (topics.size (), std::string ());
+
+    // index of the topics not in the cache
+    std::map<std::string, std::vector<size_t>> missing;
+    int64_t now = zclock_mono ();
+    for (size_t i = 0; i < topics.size (); i++) {
+        if (!g_ReadTopicCache.get (topics [i], topic_ids [i], units [i])
+            && !g_ReadTopicCache.is_missing (topics [i], now)) {
+            missing [topics [i]].push_back (i);
+        }
+    }
+    if (missing.empty ()) {
+        return 0;
+    }
+
+    try {
+        tntdb::Connection conn = tntdb::connectCached(connurl);
+
+        size_t arity = 0;
+        std::string query =
+            " SELECT "
+            "   id, topic, units "
+            " FROM t_bios_measurement_topic "
+            " WHERE "
+            "   topic IN (" + s_in_list ("topic", missing.size (), arity) + ")"
+            " ORDER BY id ASC";
+        tntdb::Statement st = conn.prepareCached (query);
+        size_t n = 0;
+        for (const auto &it : missing) {
+            st.set ("topic" + std::to_string (n++), it.first);
+        }
+        for (; n < arity; n++) {
+            st.set ("topic" + std::to_string (n), missing.rbegin ()->first);
+        }
+
+        for (tntdb::Statement::const_iterator it = st.begin ();
+             it != st.end (); ++it) {
+            m_msrmnt_tpc_id_t topic_id = 0;
+            (*it)["id"].get(topic_id);
+            std::string topic;
+            (*it)["topic"].get(topic);
+
+            auto found = missing.find (topic);
+            if (found == missing.end ())
+                continue;
+            // a name has one row per units and device, all of them are read
+            for (size_t i : found->second) {
+                if (topic_ids [i].empty ()) {
+                    (*it)["units"].get(units [i]);
+                }
+                topic_ids [i].push_back (topic_id);
+            }
+        }
+    }
+    catch (const std::exception &e) {
+        log_error("Exception caught: %s", e.what());
+        return -1;
+    }
+    catch (...) {
+        log_error("Unknown exception caught!");
+        return -1;
+    }
+
+    for (const auto &it : missing) {
+        size_t i = it.second.front ();
+        if (topic_ids [i].empty ()) {
+            g_ReadTopicCache.put_missing (it.first, now + TOPIC_CACHE_MISSING_TTL);
+            continue;
+        }
+        std::string::size_type at = it.first.rfind ('@');
+        std::string asset = (at == std::string::npos) ? "" : it.first.substr (at + 1);
+        g_ReadTopicCache.put (it.first, asset, topic_ids [i], units [i]);
+    }
+    return 0;
+}
+
+//
+// Read the samples of the topics in [start_timestamp, end_timestamp] from the
+// database, in the order of the ORDER BY clause order_by
+static int
+s_select_measurements_by_ids (
+        const std::string &connurl,
+        const std::vector<m_msrmnt_tpc_id_t> &topic_ids,
+        int64_t start_timestamp,
+        int64_t end_timestamp,
+        std::function<void(
+                        m_msrmnt_tpc_id_t topic_id,
+                        int64_t timestamp,
+                        m_msrmnt_value_t value,
+                        m_msrmnt_scale_t scale)>& cb,
+        const char *order_by)
+{
+    try {
+        tntdb::Connection conn = tntdb::connectCached(connurl);
 
-        for (const auto &row: result) {
-            cb(row);
+        size_t arity = 0;
+        std::string query =
+            " SELECT "
+            "   topic_id, value, scale, timestamp "
+            " FROM t_bios_measurement "
+            " WHERE "
+            "   topic_id IN (" + s_in_list ("topic_id", topic_ids.size (), arity) + ") AND "
+            "   timestamp >= :time_st AND "
+            "   timestamp <= :time_end ";
+        query += order_by;
+        tntdb::Statement st = conn.prepareCached (query);
+        for (size_t i = 0; i < arity; i++) {
+            st.set ("topic_id" + std::to_string (i), topic_ids [std::min (i, topic_ids.size () - 1)]);
+        }
+        st.set ("time_st", start_timestamp)
+          .set ("time_end", end_timestamp);
+
+        for (tntdb::Statement::const_iterator it = st.begin ();
+             it != st.end (); ++it) {
+            m_msrmnt_tpc_id_t topic_id = 0;
+            (*it)["topic_id"].get(topic_id);
+
+            m_msrmnt_value_t value = 0;
+            (*it)["value"].get(value);
+
+            m_msrmnt_scale_t scale = 0;
+            (*it)["scale"].get(scale);
+
+            int64_t timestamp = 0;
+            (*it)["timestamp"].get(timestamp);
+
+            cb(topic_id, timestamp, value, scale);
         }
         return 0;
     }
@@ -116,6 +461,133 @@ select_measurements (
     }
 }
 
+//
+int
+select_measurements_by_id (
+        const std::string &connurl,
+        const std::vector<m_msrmnt_tpc_id_t> &topic_ids,
+        int64_t start_timestamp,
+        int64_t end_timestamp,
+        std::function<void(
+                        int64_t timestamp,
+                        m_msrmnt_value_t value,
+                        m_msrmnt_scale_t scale)>& cb,
+        bool is_ordered)
+{
+    assert (!topic_ids.empty ());
+    if (topic_ids.size () == 1) {
+        return s_select_measurements_with_tail (connurl, topic_ids [0], start_timestamp, end_timestamp, cb, is_ordered);
+    }
+
+    // the tail cache is used from the latest coverage start of the ids on,
+    // if it has all of them
+    std::vector<TailCache::Point> tail;
+    int64_t coverage_start = INT64_MIN;
+    for (m_msrmnt_tpc_id_t topic_id : topic_ids) {
+        std::vector<TailCache::Point> points;
+        int64_t topic_coverage_start = 0;
+        if (!g_TailCache.read (topic_id, start_timestamp, end_timestamp, points, topic_coverage_start)) {
+            coverage_start = end_timestamp + 1;
+            tail.clear ();
+            break;
+        }
+        coverage_start = std::max (coverage_start, topic_coverage_start);
+        tail.insert (tail.end (), points.begin (), points.end ());
+    }
+    tail.erase (
+        std::remove_if (tail.begin (), tail.end (),
+                        [coverage_start] (const TailCache::Point &point) { return point.timestamp < coverage_start; }),
+        tail.end ());
+    std::stable_sort (tail.begin (), tail.end (),
+                      [] (const TailCache::Point &a, const TailCache::Point &b) { return a.timestamp < b.timestamp; });
+
+    // the rows of all the ids together, as the view read them by name
+    if (start_timestamp < coverage_start) {
+        std::function<void(m_msrmnt_tpc_id_t, int64_t, m_msrmnt_value_t, m_msrmnt_scale_t)> add_row =
+            [&cb] (m_msrmnt_tpc_id_t topic_id, int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+            {
+                cb(timestamp, value, scale);
+            };
+        int rv = s_select_measurements_by_ids (connurl, topic_ids, start_timestamp,
+                                               std::min (end_timestamp, coverage_start - 1), add_row,
+                                               is_ordered ? " ORDER BY timestamp ASC" : "");
+        if (rv != 0)
+            return rv;
+    }
+    for (const TailCache::Point &point : tail) {
+        cb(point.timestamp, point.value, point.scale);
+    }
+    return 0;
+}
+
+//
+int
+select_measurements_by_ids (
+        const std::string &connurl,
+        const std::vector<m_msrmnt_tpc_id_t> &topic_ids,
+        int64_t start_timestamp,
+        int64_t end_timestamp,
+        std::function<void(
+                        m_msrmnt_tpc_id_t topic_id,
+                        int64_t timestamp,
+                        m_msrmnt_value_t value,
+                        m_msrmnt_scale_t scale)>& cb)
+{
+    struct Series {
+        m_msrmnt_tpc_id_t topic_id;
+        std::vector<TailCache::Point> tail;
+        // samples from here on are taken from the tail cache
+        int64_t coverage_start;
+    };
+
+    std::vector<m_msrmnt_tpc_id_t> ids (topic_ids);
+    std::sort (ids.begin (), ids.end ());
+    ids.erase (std::unique (ids.begin (), ids.end ()), ids.end ());
+
+    std::vector<Series> series (ids.size ());
+    std::vector<m_msrmnt_tpc_id_t> db_topic_ids;
+    for (size_t i = 0; i < ids.size (); i++) {
+        series [i].topic_id = ids [i];
+        if (!g_TailCache.read (ids [i], start_timestamp, end_timestamp, series [i].tail, series [i].coverage_start)) {
+            series [i].coverage_start = end_timestamp + 1;
+        }
+        if (start_timestamp < series [i].coverage_start) {
+            db_topic_ids.push_back (ids [i]);
+        }
+    }
+
+    // samples of a topic from the tail cache are newer than the ones from
+    // the database, they are given once the rows of the topic are over
+    size_t next_tail = 0;
+    auto give_tails = [&](size_t until)
+        {
+            for (; next_tail < until; next_tail++) {
+                for (const TailCache::Point &point : series [next_tail].tail) {
+                    cb(series [next_tail].topic_id, point.timestamp, point.value, point.scale);
+                }
+            }
+        };
+
+    if (!db_topic_ids.empty ()) {
+        size_t current = 0;
+        std::function<void(m_msrmnt_tpc_id_t, int64_t, m_msrmnt_value_t, m_msrmnt_scale_t)> db_cb =
+            [&](m_msrmnt_tpc_id_t topic_id, int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+            {
+                while (series [current].topic_id != topic_id)
+                    current++;
+                give_tails (current);
+                if (timestamp < series [current].coverage_start)
+                    cb(topic_id, timestamp, value, scale);
+            };
+        int rv = s_select_measurements_by_ids (connurl, db_topic_ids, start_timestamp, end_timestamp, db_cb,
+                                              " ORDER BY topic_id ASC, timestamp ASC");
+        if (rv != 0)
+            return rv;
+    }
+    give_tails (series.size ());
+    return 0;
+}
+
 m_dvc_id_t
 insert_as_not_classified_device(
         tntdb::Connection &conn,
@@ -246,32 +718,193 @@ prepare_topic(
     }
 }
 
-//
+// return topic_id or 0 in case of issue, hit the database only on cache miss
+m_msrmnt_tpc_id_t
+prepare_topic_cached(
+        tntdb::Connection &conn,
+        const char        *topic,
+        const char        *units,
+        const char        *device_name)
+{
+    std::string key = TopicCache::make_key (topic, units, device_name);
+
+    m_msrmnt_tpc_id_t topic_id = 0;
+    if (g_TopicCache.get (key, topic_id)) {
+        return topic_id;
+    }
+
+    int64_t start = zclock_usecs ();
+    topic_id = prepare_topic (conn, topic, units, device_name);
+    store_stats ().add (STATS_TOPIC_PREPARES);
+    store_stats ().record (STATS_TOPIC_PREPARE_US, stats_elapsed_us (start));
+    if ( topic_id != 0 ) {
+        g_TopicCache.put (key, device_name, topic_id);
+        // maybe a new topic, the reads must look it up again
+        g_ReadTopicCache.forget_missing (topic);
+    }
+    return topic_id;
+}
+
 void
-flush_measurement(tntdb::Connection &conn)
+invalidate_topic_cache(const char *asset_name)
 {
-    log_debug("Performing periodic flush");
-    try {
-        tntdb::Statement st;
-        string query = g_RowCache.get_insert_query();
-        if (query.length() == 0) {
-            g_RowCache.reset_clock();
-            return;
+    if ( asset_name ) {
+        g_TopicCache.invalidate_asset (asset_name);
+        g_ReadTopicCache.invalidate_asset (asset_name);
+    }
+    else {
+        g_TopicCache.clear ();
+        g_ReadTopicCache.clear ();
+    }
+}
+
+bool
+is_topic_cached(
+        const char        *topic,
+        const char        *units,
+        const char        *device_name)
+{
+    m_msrmnt_tpc_id_t topic_id = 0;
+    return g_TopicCache.get (TopicCache::make_key (topic, units, device_name), topic_id);
+}
+
+void
+cache_topic_samples(
+        const char        *topic,
+        const char        *asset_name,
+        m_msrmnt_tpc_id_t  topic_id,
+        const char        *units,
+        const std::vector<std::pair<int64_t, m_msrmnt_value_t>> &samples)
+{
+    assert ( topic );
+    assert ( asset_name );
+    assert ( units );
+
+    g_ReadTopicCache.put (topic, asset_name, topic_id, units);
+    g_TopicCache.put (TopicCache::make_key (topic, units, asset_name), asset_name, topic_id);
+    for (const auto &sample : samples) {
+        g_TailCache.append (topic_id, asset_name, sample.first, sample.second, 0);
+    }
+}
+
+void
+cache_missing_topic(
+        const char        *topic)
+{
+    assert ( topic );
+    g_ReadTopicCache.put_missing (topic, zclock_mono () + TOPIC_CACHE_MISSING_TTL);
+}
+
+// Exchange the pending rows for an empty cache, the flush worker inserts them
+// All the s_ functions below are called with g_RowMutex held
+static bool
+s_is_ready_for_insert()
+{
+    return g_RowCache->is_ready_for_insert(g_FlushPolicy.get_row_limit(), g_FlushPolicy.get_delay_ms());
+}
+
+// Rows are spooled when they enter the cache, before the agent acknowledges them
+static void
+s_spool_rows(size_t first)
+{
+    if (g_Spool.is_open()) {
+        g_RowCache->set_spool_end(g_Spool.append(*g_RowCache, first));
+    }
+}
+
+// The samples enter the tail cache before their rows are inserted, the ones
+// of the rows dropped instead must not be served by GET
+static void
+s_evict_rows(const MultiRowCache &rows, size_t first)
+{
+    for (size_t i = first; i < rows.size(); i++) {
+        g_TailCache.evict(rows.get_topic_id(i), rows.get_time(i));
+    }
+}
+
+// A sample may pass the dying check just before the purge of its asset is
+// requested, its row handed over after the purge sync would recreate the
+// deleted topic, called with g_RowMutex held
+static void
+s_drop_dying_rows(MultiRowCache &rows)
+{
+    size_t first = 0;
+    while (first < rows.size() && !g_AssetPurger.is_dying_topic(rows.get_topic_id(first)))
+        first++;
+    if (first == rows.size())
+        return;
+
+    MultiRowCache kept (rows.size(), 0);
+    size_t dropped = 0;
+    for (size_t i = 0; i < rows.size(); i++) {
+        if (i >= first && g_AssetPurger.is_dying_topic(rows.get_topic_id(i))) {
+            g_TailCache.evict(rows.get_topic_id(i), rows.get_time(i));
+            dropped++;
+            continue;
         }
-        st = conn.prepare(query.c_str());
-        uint32_t affected_rows = st.execute();
-        log_debug("[t_bios_measurement]: flush measurements from cache, inserted %" PRIu32 " rows ", affected_rows);
-        g_RowCache.clear();
+        kept.push_back(rows.get_time(i), rows.get_value(i), rows.get_scale(i), rows.get_topic_id(i));
     }
-    catch (const std::exception &e) {
-        log_error ("Abnormal flush termination");
+    log_debug ("%zu rows of the assets being purged are dropped", dropped);
+    // the rows of a producer are not bounded by max_row, no append
+    rows.clear();
+    for (size_t i = 0; i < kept.size(); i++) {
+        rows.push_back(kept.get_time(i), kept.get_value(i), kept.get_scale(i), kept.get_topic_id(i));
     }
 }
 
+static void
+s_hand_over_rows()
+{
+    if (g_RowCache->size() == 0) {
+        g_RowCache->reset_clock();
+        return;
+    }
+    g_RowCache = g_FlushWorker.submit(std::move(g_RowCache));
+    store_stats ().set_gauge (STATS_PENDING_ROWS, (int64_t) g_RowCache->size());
+}
+
+static void
+s_flush_measurement(tntdb::Connection &conn)
+{
+    log_debug("Performing periodic flush");
+    if (g_FlushWorker.is_running()) {
+        s_hand_over_rows();
+        return;
+    }
+    FlushWorker::write(*g_RowCache, conn, &g_FlushPolicy);
+    store_stats ().set_gauge (STATS_PENDING_ROWS, (int64_t) g_RowCache->size());
+}
+
+static void
+s_flush_measurement_when_needed(tntdb::Connection &conn)
+{
+    if (s_is_ready_for_insert()){
+        s_flush_measurement(conn);
+    }
+    store_stats ().set_gauge (STATS_PENDING_ROWS, (int64_t) g_RowCache->size());
+}
+
 //
 void
+flush_measurement(tntdb::Connection &conn)
+{
+    std::lock_guard<std::mutex> lock (g_RowMutex);
+    s_flush_measurement(conn);
+}
+
+// Insert all pending rows and wait for the insertion to finish
+void
 flush_measurement(std::string &url)
 {
+    if (g_FlushWorker.is_running()) {
+        {
+            std::lock_guard<std::mutex> lock (g_RowMutex);
+            s_hand_over_rows();
+        }
+        g_FlushWorker.wait_idle();
+        return;
+    }
+
     tntdb::Connection conn;
     try {
         conn = tntdb::connectCached(url);
@@ -288,19 +921,190 @@ flush_measurement(std::string &url)
 void
 flush_measurement_when_needed(tntdb::Connection &conn)
 {
-    if (g_RowCache.is_ready_for_insert()){
-        flush_measurement(conn);
-    }
+    std::lock_guard<std::mutex> lock (g_RowMutex);
+    s_flush_measurement_when_needed(conn);
 }
 
 void
 flush_measurement_when_needed(std::string &url)
 {
-    if (g_RowCache.is_ready_for_insert()){
+    if (g_FlushWorker.is_running()) {
+        std::lock_guard<std::mutex> lock (g_RowMutex);
+        if (s_is_ready_for_insert()){
+            s_hand_over_rows();
+        }
+        return;
+    }
+
+    bool ready;
+    {
+        std::lock_guard<std::mutex> lock (g_RowMutex);
+        ready = s_is_ready_for_insert();
+    }
+    if (ready) {
         flush_measurement(url);
     }
 }
 
+void
+flush_worker_start(const std::string &url)
+{
+    g_FlushWorker.set_policy(&g_FlushPolicy);
+    // the limits are known before the first flush
+    g_FlushPolicy.publish();
+    g_FlushWorker.set_drop_hook(s_evict_rows);
+    if (g_Spool.open()) {
+        g_FlushWorker.set_spool(&g_Spool);
+    }
+    g_FlushWorker.start(url);
+}
+
+void
+flush_worker_stop()
+{
+    g_FlushWorker.stop();
+    // the rows not inserted stay in the file for the next start
+    g_FlushWorker.set_spool(NULL);
+    g_Spool.close();
+}
+
+int
+retention_set_age(const char *step, const char *days)
+{
+    assert (step);
+    assert (days);
+    return g_Retention.set_age (step, days) ? 0 : -1;
+}
+
+void
+retention_start(const std::string &url)
+{
+    g_Retention.start(url);
+}
+
+void
+retention_stop()
+{
+    g_Retention.stop();
+}
+
+// Insert the rows prepared so far, before the purge deletes their topics
+static void
+s_sync_rows()
+{
+    if (g_FlushWorker.is_running()) {
+        {
+            std::lock_guard<std::mutex> lock (g_RowMutex);
+            s_hand_over_rows();
+        }
+        g_FlushWorker.wait_idle();
+    }
+}
+
+// A GET may have cached the ids of the topics while they were deleted
+static void
+s_purged_asset(const std::string &asset_name)
+{
+    invalidate_topic_cache (asset_name.c_str ());
+}
+
+void
+asset_purger_start(const std::string &url)
+{
+    g_AssetPurger.start(url, s_sync_rows, s_purged_asset);
+}
+
+void
+asset_purger_stop()
+{
+    g_AssetPurger.stop();
+}
+
+void
+purge_asset(const char *asset_name)
+{
+    assert ( asset_name );
+
+    // dying first, a sample coming meanwhile must not cache the ids again
+    if ( !g_AssetPurger.purge (asset_name) ) {
+        log_debug ("purge of the asset %s is already queued", asset_name);
+    }
+
+    // the topics are going away, do not hand out their ids anymore
+    invalidate_topic_cache (asset_name);
+    g_TailCache.invalidate_asset (asset_name);
+}
+
+//
+int
+prepare_measurement(
+        tntdb::Connection &conn,
+        const char        *topic,
+        m_msrmnt_value_t   value,
+        m_msrmnt_scale_t   scale,
+        int64_t            time,
+        const char        *units,
+        const char        *device_name,
+        MultiRowCache     &rows)
+{
+    assert ( units );
+    assert ( device_name );
+    assert ( topic );
+
+    if ( topic[0]=='@' ) {
+        log_error ("malformed value of topic '%s' is not allowed", topic);
+        return -1;
+    }
+
+    if ( g_AssetPurger.is_dying (device_name) ) {
+        log_debug ("asset '%s' is being purged, drop the sample of topic '%s'", device_name, topic);
+        return 0;
+    }
+
+    try {
+        m_msrmnt_tpc_id_t topic_id = prepare_topic_cached(conn, topic, units, device_name);
+        if ( topic_id == 0 ) {
+            log_error ("topic '%s' was not inserted -> cannot insert metric", topic);
+            return 1;
+        }
+        rows.push_back(time,value,scale,topic_id);
+        g_TailCache.append(topic_id, device_name, time, value, scale);
+        return 0;
+    }
+    catch (const std::exception &e) {
+        log_error ("Metric with topic '%s' was not inserted with error: %s", topic, e.what());
+        return 1;
+    }
+}
+
+//
+void
+insert_rows_into_measurement(
+        tntdb::Connection &conn,
+        MultiRowCache     &rows)
+{
+    std::lock_guard<std::mutex> lock (g_RowMutex);
+    s_drop_dying_rows(rows);
+
+    size_t first = 0;
+    while (first < rows.size()) {
+        size_t before = g_RowCache->size();
+        first += g_RowCache->append(rows, first);
+        s_spool_rows(before);
+        if (!s_is_ready_for_insert()) {
+            continue;
+        }
+        s_flush_measurement(conn);
+        // the insertion failed and the rows are kept, there is no room
+        if (g_RowCache->size() >= (size_t) g_RowCache->get_max_row()) {
+            log_error("Row cache is full, %zu rows dropped", rows.size() - first);
+            s_evict_rows(rows, first);
+            break;
+        }
+    }
+    rows.clear();
+}
+
 //
 int
 insert_into_measurement(
@@ -318,17 +1122,33 @@ insert_into_measurement(
 
     if ( topic[0]=='@' ) {
         log_error ("malformed value of topic '%s' is not allowed", topic);
-        return 1;
+        return -1;
+    }
+
+    if ( g_AssetPurger.is_dying (device_name) ) {
+        log_debug ("asset '%s' is being purged, drop the sample of topic '%s'", device_name, topic);
+        return 0;
     }
 
     try {
-        m_msrmnt_tpc_id_t topic_id = prepare_topic(conn, topic, units, device_name);
+        // the topic is resolved before taking the lock, so producers
+        // only serialize on the append itself
+        m_msrmnt_tpc_id_t topic_id = prepare_topic_cached(conn, topic, units, device_name);
         if ( topic_id == 0 ) {
             log_error ("topic '%s' was not inserted -> cannot insert metric", topic);
             return 1;
         }
-        g_RowCache.push_back(time,value,scale,topic_id);
-        flush_measurement_when_needed(conn);
+        g_TailCache.append(topic_id, device_name, time, value, scale);
+
+        std::lock_guard<std::mutex> lock (g_RowMutex);
+        if ( g_AssetPurger.is_dying_topic (topic_id) ) {
+            // the purge sync went by since the dying check
+            g_TailCache.evict(topic_id, time);
+            return 0;
+        }
+        g_RowCache->push_back(time,value,scale,topic_id);
+        s_spool_rows(g_RowCache->size() - 1);
+        s_flush_measurement_when_needed(conn);
         return 0;
     }
     catch (const std::exception &e) {
@@ -344,23 +1164,23 @@ delete_measurements(
 {
     assert ( asset_name );
 
-    try {
-        tntdb::Statement st = conn.prepareCached (
-            " DELETE m, mt "
-            " FROM "
-            "   t_bios_measurement m "
-            "   INNER JOIN t_bios_measurement_topic mt "
-            " WHERE "
-            "   m.topic_id = mt.id AND "
-            "   mt.topic like :name ");
-        auto r = st.set("name", "%@" + std::string(asset_name)).execute();
-        log_info ("deleted: %d", r);
-        return 0;
+    // the topics are going away, do not hand out their ids anymore
+    invalidate_topic_cache (asset_name);
+    g_TailCache.invalidate_asset (asset_name);
+
+    // samples prepared before are inserted before their topics are deleted
+    flush_measurement (conn);
+    if (g_FlushWorker.is_running()) {
+        g_FlushWorker.wait_idle();
     }
-    catch (const std::exception &e) {
-        log_error ("Cannot delete measurements and topics: '%s'", e.what());
+
+    AssetPurger purger (PURGE_CHUNK_DEFAULT, 0);
+    int64_t r = purger.purge_now (conn, asset_name);
+    if ( r < 0 ) {
         return 1;
     }
+    log_info ("deleted: %" PRIi64, r);
+    return 0;
 }
 
 //  --------------------------------------------------------------------------
@@ -371,6 +1191,53 @@ persistance_test (bool verbose)
 {
     printf (" * persistance: ");
     //  @selftest
+    // a topic name stored with two units has two rows, both are read
+    std::vector<m_msrmnt_tpc_id_t> topic_ids;
+    std::string units;
+    g_ReadTopicCache.put ("selftest.default@selftest-1", "selftest-1", { 65001, 65002 }, "W");
+    assert (resolve_topic ("selftest:", "selftest.default@selftest-1", topic_ids, units) == 0);
+    assert ((topic_ids == std::vector<m_msrmnt_tpc_id_t> { 65001, 65002 }) && units == "W");
+
+    // a name known not to be stored is not looked up in the database
+    cache_missing_topic ("selftest.default_max_2h@selftest-1");
+    std::vector<m_msrmnt_tpc_id_t> missing_ids;
+    std::string missing_units;
+    assert (resolve_topic ("selftest:", "selftest.default_max_2h@selftest-1", missing_ids, missing_units) == -2);
+    assert (missing_ids.empty ());
+
+    // the samples of both, in order of time, from the tail cache only
+    g_TailCache.append (65001, "selftest-1", 1000, 1, 0);
+    g_TailCache.append (65002, "selftest-1", 1001, 2, 0);
+    g_TailCache.append (65001, "selftest-1", 1002, 3, 0);
+    g_TailCache.append (65002, "selftest-1", 1003, 4, -1);
+    std::vector<TailCache::Point> points;
+    std::function<void(int64_t, m_msrmnt_value_t, m_msrmnt_scale_t)> cb =
+        [&points] (int64_t timestamp, m_msrmnt_value_t value, m_msrmnt_scale_t scale)
+        {
+            points.push_back ({ timestamp, value, scale });
+        };
+    assert (select_measurements_by_id ("selftest:", topic_ids, 1001, 2000, cb, true) == 0);
+    assert (points.size () == 3);
+    assert (points [0].timestamp == 1001 && points [0].value == 2);
+    assert (points [1].timestamp == 1002 && points [1].value == 3);
+    assert (points [2].timestamp == 1003 && points [2].scale == -1);
+
+    // the samples of the dropped rows are not served anymore
+    MultiRowCache dropped (10, 1);
+    dropped.push_back (1002, 3, 0, 65001);
+    dropped.push_back (1003, 4, -1, 65002);
+    s_evict_rows (dropped, 1);
+    points.clear ();
+    assert (select_measurements_by_id ("selftest:", topic_ids, 1001, 2000, cb, true) == 0);
+    assert (points.size () == 2 && points [1].timestamp == 1002);
+
+    // an invalid topic is not a database error, no connection is used
+    tntdb::Connection none;
+    assert (prepare_measurement (none, "@selftest-1", 1, 0, 1004, "W", "selftest-1", dropped) == -1);
+    assert (insert_into_measurement (none, "@selftest-1", 1, 0, 1004, "W", "selftest-1") == -1);
+
+    invalidate_topic_cache ("selftest-1");
+    g_TailCache.invalidate_asset ("selftest-1");
     //  @end
     printf ("OK\n");
 }
@@ -21,9 +21,13 @@
 */
 
 #include <functional>
+#include <utility>
+#include <vector>
 #ifndef PERSISTANCE_H_INCLUDED
 #define PERSISTANCE_H_INCLUDED
 
+class MultiRowCache;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -45,6 +49,9 @@ typedef uint16_t  m_msrmnt_tpc_id_t;
 // ----- column: id_discovered_device -----------------
 typedef uint16_t m_dvc_id_t;
 
+// Resolve the topic and append the sample to the row cache, the samples of
+// the assets being purged are dropped
+// return 0 on success, -1 for an invalid topic and 1 for a database error
 FTY_METRIC_STORE_EXPORT
 int
     insert_into_measurement(
@@ -56,6 +63,28 @@ int
         const char        *units,
         const char        *device_name);
 
+// Resolve the topic and append the sample to the rows of one producer,
+// no lock is taken, the rows are handed over by insert_rows_into_measurement
+// return the codes of insert_into_measurement
+FTY_METRIC_STORE_EXPORT
+int
+    prepare_measurement(
+        tntdb::Connection &conn,
+        const char        *topic,
+        m_msrmnt_value_t   value,
+        m_msrmnt_scale_t   scale,
+        int64_t            time,
+        const char        *units,
+        const char        *device_name,
+        MultiRowCache     &rows);
+
+// Move the prepared rows into the row cache, flushing it when full
+FTY_METRIC_STORE_EXPORT
+void
+    insert_rows_into_measurement(
+        tntdb::Connection &conn,
+        MultiRowCache     &rows);
+
 FTY_METRIC_STORE_EXPORT
 int
     select_measurements (
@@ -75,12 +104,105 @@ int
         std::function<void(
                         const tntdb::Row&)>& cb);
 
+// Resolve the topic XXX@YYY to its ids and units, the result is cached
+// t_bios_measurement_topic is unique on topic, units and device, so a
+// name can have several ids, in ascending order; units are those of the first
+// return 0 on success, -2 if the topic does not exist, -1 on error
+FTY_METRIC_STORE_EXPORT
+int
+    resolve_topic (
+        const std::string &connurl,
+        const std::string &topic, // the whole topic XXX@YYY
+        std::vector<m_msrmnt_tpc_id_t> &topic_ids,
+        std::string &units);
+
+// Same as select_measurements, but the topic is given by its ids, as
+// given by resolve_topic
+// Recent samples are taken from the tail cache, including the ones
+// not flushed yet, the older ones from the database. With more than one
+// id, the samples of all of them are merged in order of time, the tail
+// cache is used from the latest coverage start of the ids on
+FTY_METRIC_STORE_EXPORT
+int
+    select_measurements_by_id (
+        const std::string &connurl,
+        const std::vector<m_msrmnt_tpc_id_t> &topic_ids,
+        int64_t start_timestamp,
+        int64_t end_timestamp,
+        std::function<void(
+                        int64_t timestamp,
+                        m_msrmnt_value_t value,
+                        m_msrmnt_scale_t scale)>& cb,
+        bool is_ordered);
+
+// Resolve several topics with one query, cached topics are not queried
+// topic_ids[i] and units[i] belong to topics[i], as given by resolve_topic,
+// topic_ids[i] is empty if the topic does not exist
+// return 0 on success, -1 on error
+FTY_METRIC_STORE_EXPORT
+int
+    resolve_topics (
+        const std::string &connurl,
+        const std::vector<std::string> &topics,
+        std::vector<std::vector<m_msrmnt_tpc_id_t>> &topic_ids,
+        std::vector<std::string> &units);
+
+// Same as select_measurements_by_id for several topics with one query,
+// the samples of each topic come together, topics in ascending order
+// of their id and samples in time order
+FTY_METRIC_STORE_EXPORT
+int
+    select_measurements_by_ids (
+        const std::string &connurl,
+        const std::vector<m_msrmnt_tpc_id_t> &topic_ids,
+        int64_t start_timestamp,
+        int64_t end_timestamp,
+        std::function<void(
+                        m_msrmnt_tpc_id_t topic_id,
+                        int64_t timestamp,
+                        m_msrmnt_value_t value,
+                        m_msrmnt_scale_t scale)>& cb);
+
+// Delete the measurements and topics of the asset in the calling thread
 FTY_METRIC_STORE_EXPORT
 int
     delete_measurements(
         tntdb::Connection &conn,
         const char        *asset_name);
 
+// Forget cached topic ids of the asset, or all of them if asset_name is NULL
+FTY_METRIC_STORE_EXPORT
+void
+    invalidate_topic_cache(
+        const char        *asset_name);
+
+// Return true if the topic id is cached, its rows are then prepared
+// without the database
+FTY_METRIC_STORE_EXPORT
+bool
+    is_topic_cached(
+        const char        *topic,
+        const char        *units,
+        const char        *device_name);
+
+// For the selftests without a database: the topic XXX@YYY of the asset
+// resolves to topic_id, for reads and writes, whose samples (timestamp,
+// value) are in the tail cache
+FTY_METRIC_STORE_PRIVATE
+void
+    cache_topic_samples(
+        const char        *topic,
+        const char        *asset_name,
+        m_msrmnt_tpc_id_t  topic_id,
+        const char        *units,
+        const std::vector<std::pair<int64_t, m_msrmnt_value_t>> &samples);
+
+// For the selftests without a database: the topic XXX@YYY is not stored
+FTY_METRIC_STORE_PRIVATE
+void
+    cache_missing_topic(
+        const char        *topic);
+
 //  Self test of this class
 //  Note: Keep this definition in sync with fty_metric_store_classes.h
 FTY_METRIC_STORE_PRIVATE
@@ -94,6 +216,50 @@ void
 FTY_METRIC_STORE_EXPORT
 void
     flush_measurement(std::string &url);
+
+// Start the background insertion of full caches, until it runs the rows are
+// inserted in the thread which filled the cache. With BIOS_DBSTORE_SPOOL_FILE
+// set, the rows are spooled until inserted and the former ones are replayed
+FTY_METRIC_STORE_EXPORT
+void
+    flush_worker_start(const std::string &url);
+
+// Insert all the batches handed over to the worker and stop it, the rows
+// which could not be inserted stay in the spool
+FTY_METRIC_STORE_EXPORT
+void
+    flush_worker_stop();
+
+// Set the age in days of the samples of the step, RT for real time ones
+// return 0 on success, -1 if the age is not a number
+FTY_METRIC_STORE_EXPORT
+int
+    retention_set_age(const char *step, const char *days);
+
+// Start the background deletion of the expired samples
+FTY_METRIC_STORE_EXPORT
+void
+    retention_start(const std::string &url);
+
+FTY_METRIC_STORE_EXPORT
+void
+    retention_stop();
+
+// Start the background purge of the measurements of the deleted assets
+FTY_METRIC_STORE_EXPORT
+void
+    asset_purger_start(const std::string &url);
+
+// Finish the purge of the current asset and stop, the queued ones are lost
+FTY_METRIC_STORE_EXPORT
+void
+    asset_purger_stop();
+
+// Forget the topics of the deleted asset at once and queue the deletion of
+// its measurements, its samples are dropped until they are deleted
+FTY_METRIC_STORE_EXPORT
+void
+    purge_asset(const char *asset_name);
 //  @end
 
 #ifdef __cplusplus
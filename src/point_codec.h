@@ -0,0 +1,108 @@
+/*  =========================================================================
+    point_codec - Compact binary encoding of measurement points
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef POINT_CODEC_H_INCLUDED
+#define POINT_CODEC_H_INCLUDED
+
+#include <string>
+
+typedef enum {
+    // one string frame for timestamp and one for value of each point
+    POINT_ENCODING_TEXT,
+    // one frame, each point packed as little endian
+    // int64 timestamp, int32 value, int16 scale
+    POINT_ENCODING_BINARY,
+    // one frame, each point as zigzag varints of the differences of
+    // timestamp, value and scale to the previous point (first to zero)
+    POINT_ENCODING_DELTA
+} point_encoding_t;
+
+#define POINT_BINARY_SIZE 14
+
+// return false if the name is not one of "text", "binary", "delta"
+FTY_METRIC_STORE_PRIVATE bool
+    point_encoding_from_string (const std::string &name, point_encoding_t &encoding);
+
+FTY_METRIC_STORE_PRIVATE const char *
+    point_encoding_to_string (point_encoding_t encoding);
+
+/*
+ * \brief Encode points into one buffer in binary or delta encoding
+ */
+class PointEncoder {
+    public:
+        explicit PointEncoder (point_encoding_t encoding);
+
+        void append (
+            int64_t timestamp,
+            m_msrmnt_value_t value,
+            m_msrmnt_scale_t scale);
+
+        const std::string &data () { return _buffer; }
+        size_t size () { return _buffer.size (); }
+
+        // start a new buffer, which can be decoded independently
+        void clear ();
+
+    private:
+        point_encoding_t _encoding;
+        std::string _buffer;
+        int64_t _prev_time = 0;
+        int64_t _prev_value = 0;
+        int64_t _prev_scale = 0;
+
+        void put_varint (int64_t value);
+};
+
+/*
+ * \brief Decode points from the buffer made by PointEncoder
+ */
+class PointDecoder {
+    public:
+        PointDecoder (point_encoding_t encoding, const void *data, size_t size);
+
+        // return false at the end of data or if it is malformed
+        bool next (
+            int64_t &timestamp,
+            m_msrmnt_value_t &value,
+            m_msrmnt_scale_t &scale);
+
+        bool is_malformed () { return _malformed; }
+
+    private:
+        point_encoding_t _encoding;
+        const unsigned char *_data;
+        size_t _size;
+        size_t _pos = 0;
+        bool _malformed = false;
+        int64_t _prev_time = 0;
+        int64_t _prev_value = 0;
+        int64_t _prev_scale = 0;
+
+        bool get_varint (int64_t &value);
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    point_codec_test (bool verbose);
+
+#endif
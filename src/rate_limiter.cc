@@ -0,0 +1,170 @@
+/*  =========================================================================
+    rate_limiter - Bounded rate of the deleted rows
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    rate_limiter - Bounded rate of the deleted rows
+@discuss
+    The retention and the purge of deleted assets both delete lots of rows
+    next to the inserts, the same chunks and pauses bound their impact.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+#include <chrono>
+
+RateLimiter::RateLimiter (const char *ev_chunk, size_t chunk, const char *ev_rate, size_t rate) :
+    RateLimiter (chunk, rate)
+{
+    char *env_chunk = getenv (ev_chunk);
+    if (env_chunk) {
+        int value = atoi (env_chunk);
+        if (value > 0) _chunk = (size_t) value;
+        log_info ("use %s %zu as rows deleted by one statement", ev_chunk, _chunk);
+    }
+
+    char *env_rate = getenv (ev_rate);
+    if (env_rate) {
+        int value = atoi (env_rate);
+        if (value >= 0) _rate = (size_t) value;
+        log_info ("use %s %zu as max deleted rows per second", ev_rate, _rate);
+    }
+}
+
+RateLimiter::RateLimiter (size_t chunk, size_t rate) :
+    _chunk (chunk > 0 ? chunk : 1),
+    _rate (rate)
+{
+}
+
+long
+RateLimiter::get_pause_ms (size_t rows, long elapsed_ms) const
+{
+    if (_rate == 0)
+        return 0;
+    long budget_ms = (long) (rows * 1000 / _rate);
+    return std::max<long> (budget_ms - elapsed_ms, 0);
+}
+
+bool
+RateLimiter::wait_ms (long ms)
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    _cond.wait_for (lock, std::chrono::milliseconds (ms), [this] { return _stop; });
+    return !_stop;
+}
+
+void
+RateLimiter::stop ()
+{
+    {
+        std::lock_guard<std::mutex> lock (_mutex);
+        _stop = true;
+    }
+    _cond.notify_all ();
+}
+
+void
+RateLimiter::reset ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    _stop = false;
+}
+
+bool
+RateLimiter::is_stopped ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _stop;
+}
+
+int64_t
+RateLimiter::delete_chunks (const DeleteChunk &delete_chunk, bool &interrupted)
+{
+    int64_t deleted = 0;
+    interrupted = false;
+    while (true) {
+        int64_t start = zclock_mono ();
+        unsigned rows = delete_chunk ();
+        deleted += rows;
+        if (rows != 0 && !wait_ms (get_pause_ms (rows, (long) (zclock_mono () - start)))) {
+            interrupted = true;
+            break;
+        }
+        // the last chunk
+        if (rows < _chunk)
+            break;
+    }
+    return deleted;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+rate_limiter_test (bool verbose)
+{
+    printf (" * rate_limiter: ");
+
+    //  @selftest
+    // 1000 rows/s: 100 rows take 100ms
+    RateLimiter limiter (100, 1000);
+    assert (limiter.get_pause_ms (100, 20) == 80);
+    assert (limiter.get_pause_ms (100, 500) == 0);
+    RateLimiter unlimited (100, 0);
+    assert (unlimited.get_pause_ms (100, 0) == 0);
+    RateLimiter no_chunk (0, 0);
+    assert (no_chunk.get_chunk () == 1);
+
+    // unset variables keep the defaults
+    RateLimiter defaults ("BIOS_DBSTORE_SELFTEST_NO_CHUNK", 100, "BIOS_DBSTORE_SELFTEST_NO_RATE", 1000);
+    assert (defaults.get_chunk () == 100 && defaults.get_rate () == 1000);
+
+    // the statements go on while they delete whole chunks
+    std::vector<unsigned> chunks = { 100, 100, 42, 100 };
+    size_t executed = 0;
+    bool interrupted = true;
+    RateLimiter::DeleteChunk delete_chunk = [&chunks, &executed] () { return chunks [executed++]; };
+    assert (unlimited.delete_chunks (delete_chunk, interrupted) == 242);
+    assert (executed == 3 && !interrupted);
+    chunks = { 100, 0 };
+    executed = 0;
+    assert (unlimited.delete_chunks (delete_chunk, interrupted) == 100);
+    assert (executed == 2);
+
+    // a stopped limiter does not pause, the loop is interrupted
+    limiter.stop ();
+    assert (limiter.is_stopped ());
+    assert (!limiter.wait_ms (10000));
+    chunks = { 100, 100 };
+    executed = 0;
+    assert (limiter.delete_chunks (delete_chunk, interrupted) == 100);
+    assert (executed == 1 && interrupted);
+    limiter.reset ();
+    assert (!limiter.is_stopped ());
+    assert (limiter.wait_ms (0));
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,82 @@
+/*  =========================================================================
+    rate_limiter - Bounded rate of the deleted rows
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef RATE_LIMITER_H_INCLUDED
+#define RATE_LIMITER_H_INCLUDED
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+/*
+ * \brief Deletion of rows by chunks at a bounded rate
+ *
+ * The background deletions of the store delete at most chunk rows by one
+ * statement, then pause long enough to keep at most rate rows deleted per
+ * second, 0 meaning no pause, so the inserts are never blocked for long.
+ * The pauses end early once stopped, so the owner's thread can be joined
+ * at once. All methods are thread safe.
+ */
+class RateLimiter {
+    public:
+        // chunk and rate from the environment variables if set
+        RateLimiter (const char *ev_chunk, size_t chunk, const char *ev_rate, size_t rate);
+        RateLimiter (size_t chunk, size_t rate);
+
+        size_t get_chunk () const { return _chunk; }
+        size_t get_rate () const { return _rate; }
+
+        // ms to wait after rows were deleted in elapsed_ms to keep the rate
+        long get_pause_ms (size_t rows, long elapsed_ms) const;
+
+        // return false if stopped while waiting
+        bool wait_ms (long ms);
+        // end the current and the next waits
+        void stop ();
+        // let the waits run again after a stop
+        void reset ();
+        bool is_stopped ();
+
+        // execute one statement, return the number of deleted rows
+        typedef std::function<unsigned ()> DeleteChunk;
+        /*
+         * \brief delete chunk by chunk, until one statement deletes less
+         *  than a chunk, with the pauses of the rate
+         *  return the number of deleted rows, interrupted is set if stopped
+         */
+        int64_t delete_chunks (const DeleteChunk &delete_chunk, bool &interrupted);
+
+    private:
+        size_t _chunk;
+        size_t _rate;
+
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        bool _stop = false;
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    rate_limiter_test (bool verbose);
+
+#endif
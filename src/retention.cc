@@ -0,0 +1,348 @@
+/*  =========================================================================
+    retention - Background deletion of the expired measurements
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    retention - Background deletion of the expired measurements
+@discuss
+    One DELETE of all the expired samples of a step runs for minutes on a
+    big t_bios_measurement and holds its locks meanwhile. The retention
+    deletes the same rows topic by topic in small chunks, at bounded rate.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+#include <ctime>
+
+Retention::Retention () :
+    _limiter (EV_DBSTORE_RETENTION_CHUNK, RETENTION_CHUNK_DEFAULT,
+              EV_DBSTORE_RETENTION_RATE, RETENTION_RATE_DEFAULT)
+{
+    _interval_s = RETENTION_INTERVAL_DEFAULT;
+    _partitions.reset (new PartitionManager ());
+
+    char *env_interval = getenv (EV_DBSTORE_RETENTION_INTERVAL);
+    if (env_interval) {
+        int interval = atoi (env_interval);
+        if (interval >= 0) _interval_s = interval;
+        log_info ("use %s %ds as interval of the retention", EV_DBSTORE_RETENTION_INTERVAL, _interval_s);
+    }
+}
+
+Retention::Retention (int interval_s, size_t chunk, size_t rate) :
+    Retention (interval_s, chunk, rate, new PartitionManager (PARTITION_NONE, 1))
+{
+}
+
+Retention::Retention (int interval_s, size_t chunk, size_t rate, PartitionManager *partitions) :
+    _interval_s (interval_s),
+    _limiter (chunk, rate),
+    _partitions (partitions)
+{
+    assert (partitions);
+}
+
+Retention::~Retention ()
+{
+    stop ();
+}
+
+bool
+Retention::set_age (const std::string &step, const std::string &days)
+{
+    char *end = NULL;
+    errno = 0;
+    long age = strtol (days.c_str (), &end, 10);
+    if (days.empty () || *end != '\0' || errno != 0 || age > INT32_MAX || age < INT32_MIN) {
+        errno = 0;
+        log_error ("age '%s' of step %s is not a number of days", days.c_str (), step.c_str ());
+        return false;
+    }
+
+    // the agent calls the daily step 1d, the computation module 24h
+    std::string topic_step = step == "1d" ? "24h" : step;
+
+    std::lock_guard<std::mutex> lock (_mutex);
+    _ages [topic_step] = (int) age;
+    if (age > 0)
+        log_info ("samples of step %s are kept %ld days", topic_step.c_str (), age);
+    else
+        log_info ("samples of step %s are kept forever", topic_step.c_str ());
+    return true;
+}
+
+int
+Retention::get_age (const std::string &step)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    auto it = _ages.find (step == "1d" ? "24h" : step);
+    return it == _ages.end () ? 0 : it->second;
+}
+
+uint64_t
+Retention::get_deleted ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _deleted;
+}
+
+int64_t
+Retention::get_partition_age_s ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    int max_age = 0;
+    for (const auto &it : _ages) {
+        if (it.second <= 0)
+            return 0;
+        max_age = std::max (max_age, it.second);
+    }
+    return (int64_t) max_age * 24 * 3600;
+}
+
+std::string
+Retention::topic_pattern (const std::string &step)
+{
+    // the topics of aggregated samples are quantity_type_step@asset, the
+    // real time ones have no underscore before the asset
+    if (step == RETENTION_STEP_RT)
+        return "%\\_%@%";
+    return "%\\_" + step + "@%";
+}
+
+void
+Retention::start (const std::string &url)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    if (_running)
+        return;
+    if (_interval_s == 0) {
+        log_info ("retention is disabled");
+        return;
+    }
+
+    _url = url;
+    _limiter.reset ();
+    _running = true;
+    _thread = std::thread (&Retention::run, this);
+    log_info ("retention started");
+}
+
+void
+Retention::stop ()
+{
+    {
+        std::lock_guard<std::mutex> lock (_mutex);
+        if (!_running)
+            return;
+    }
+    _limiter.stop ();
+    _thread.join ();
+
+    std::lock_guard<std::mutex> lock (_mutex);
+    _running = false;
+    log_info ("retention stopped");
+}
+
+int64_t
+Retention::delete_step (tntdb::Connection &conn, const std::string &step, int age, int64_t now)
+{
+    std::vector<m_msrmnt_tpc_id_t> topic_ids;
+    tntdb::Statement st_topics = conn.prepareCached (topics_query (step));
+    st_topics.set ("pattern", topic_pattern (step));
+    for (tntdb::Statement::const_iterator it = st_topics.begin ();
+         it != st_topics.end (); ++it) {
+        m_msrmnt_tpc_id_t topic_id = 0;
+        (*it)["id"].get(topic_id);
+        topic_ids.push_back (topic_id);
+    }
+
+    int64_t time_end = now - (int64_t) age * 24 * 3600;
+    tntdb::Statement st = conn.prepareCached (delete_query (_limiter.get_chunk ()));
+
+    int64_t deleted = 0;
+    for (m_msrmnt_tpc_id_t topic_id : topic_ids) {
+        bool interrupted = false;
+        deleted += _limiter.delete_chunks ([this, &st, topic_id, time_end] ()
+            {
+                unsigned rows = st.set ("topic_id", topic_id)
+                                  .set ("time_end", time_end)
+                                  .execute ();
+                std::lock_guard<std::mutex> lock (_mutex);
+                _deleted += rows;
+                return rows;
+            }, interrupted);
+        if (interrupted) {
+            log_info ("retention of step %s interrupted, %" PRIi64 " rows deleted", step.c_str (), deleted);
+            return deleted;
+        }
+    }
+    if (deleted != 0) {
+        log_info ("retention of step %s: %" PRIi64 " rows older than %d days deleted from %zu topics",
+                  step.c_str (), deleted, age, topic_ids.size ());
+    }
+    return deleted;
+}
+
+std::string
+Retention::topics_query (const std::string &step)
+{
+    std::string query =
+        " SELECT "
+        "   id "
+        " FROM t_bios_measurement_topic "
+        " WHERE ";
+    query += step == RETENTION_STEP_RT ? " topic NOT LIKE :pattern " : " topic LIKE :pattern ";
+    return query;
+}
+
+std::string
+Retention::delete_query (size_t chunk)
+{
+    return
+        " DELETE FROM t_bios_measurement "
+        " WHERE "
+        "   topic_id = :topic_id AND "
+        "   timestamp < :time_end "
+        " LIMIT " + std::to_string (chunk);
+}
+
+int64_t
+Retention::run_once (tntdb::Connection &conn, int64_t now)
+{
+    std::map<std::string, int> ages;
+    {
+        std::lock_guard<std::mutex> lock (_mutex);
+        ages = _ages;
+    }
+
+    int64_t deleted = 0;
+    int64_t start = zclock_mono ();
+    if (_partitions->get_period () != PARTITION_NONE) {
+        // failed partitioning does not prevent the deletion of the rows
+        try {
+            int64_t max_age_s = get_partition_age_s ();
+            if (max_age_s == 0) {
+                // the RT age is 0 by default, then nothing is ever dropped
+                for (const auto &it : ages) {
+                    if (it.second <= 0) {
+                        log_warning ("samples of step %s are kept forever, no partition is dropped", it.first.c_str ());
+                        break;
+                    }
+                }
+            }
+            _partitions->maintain (conn, now, max_age_s);
+        }
+        catch (const std::exception &e) {
+            log_error ("Maintenance of the partitions failed: %s", e.what ());
+        }
+    }
+
+    try {
+        for (const auto &it : ages) {
+            if (it.second <= 0)
+                continue;
+            deleted += delete_step (conn, it.first, it.second, now);
+            if (_limiter.is_stopped ())
+                break;
+        }
+    }
+    catch (const std::exception &e) {
+        log_error ("Retention failed after %" PRIi64 " deleted rows: %s", deleted, e.what ());
+        return -1;
+    }
+    log_debug ("retention pass: %" PRIi64 " rows deleted in %" PRIi64 "ms", deleted, zclock_mono () - start);
+    return deleted;
+}
+
+void
+Retention::run ()
+{
+    // the ages come right after the start, let the agent settle first
+    if (!_limiter.wait_ms (std::min (RETENTION_START_DELAY, _interval_s) * 1000L))
+        return;
+
+    ConnectionManager connection (_url);
+    while (true) {
+        tntdb::Connection conn;
+        if (!connection.get (conn)) {
+            log_warning ("retention pass skipped, the database is %s",
+                         connection_state_to_string (connection.get_state ()));
+        }
+        else if (run_once (conn, time (NULL)) < 0) {
+            connection.failure ();
+        }
+        if (!_limiter.wait_ms (_interval_s * 1000L))
+            break;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+retention_test (bool verbose)
+{
+    printf (" * retention: ");
+
+    //  @selftest
+    Retention retention (3600, 100, 1000);
+    assert (retention.set_age ("15m", "7"));
+    assert (retention.get_age ("15m") == 7);
+    // daily samples are stored with step 24h
+    assert (retention.set_age ("1d", "30"));
+    assert (retention.get_age ("24h") == 30);
+    assert (retention.get_age ("1d") == 30);
+    assert (retention.set_age ("RT", "0"));
+    assert (retention.get_age ("RT") == 0);
+    assert (!retention.set_age ("7d", "week"));
+    assert (!retention.set_age ("7d", ""));
+    assert (retention.get_age ("7d") == 0);
+
+    assert (Retention::topic_pattern ("15m") == "%\\_15m@%");
+    assert (Retention::topic_pattern ("RT") == "%\\_%@%");
+    assert (Retention::topics_query ("15m").find (" topic LIKE :pattern ") != std::string::npos);
+    assert (Retention::topics_query ("RT").find (" topic NOT LIKE :pattern ") != std::string::npos);
+    std::string delete_query = Retention::delete_query (100);
+    assert (delete_query.find ("DELETE FROM t_bios_measurement ") != std::string::npos);
+    assert (delete_query.find ("topic_id = :topic_id AND ") != std::string::npos);
+    assert (delete_query.find ("timestamp < :time_end ") != std::string::npos);
+    assert (delete_query.substr (delete_query.size () - 10) == " LIMIT 100");
+
+    Retention unlimited (3600, 100, 0);
+
+    // partitions are dropped when expired for all the steps
+    assert (unlimited.get_partition_age_s () == 0);
+    unlimited.set_age ("15m", "7");
+    unlimited.set_age ("30d", "180");
+    assert (unlimited.get_partition_age_s () == 180 * 86400);
+    unlimited.set_age ("RT", "0");
+    assert (unlimited.get_partition_age_s () == 0);
+
+    // stop does not wait for the first pass
+    retention.start ("mysql:db=box_utf8;user=nobody");
+    retention.stop ();
+    assert (retention.get_deleted () == 0);
+    //  @end
+
+    printf ("OK\n");
+}
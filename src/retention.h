@@ -0,0 +1,124 @@
+/*  =========================================================================
+    retention - Background deletion of the expired measurements
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef RETENTION_H_INCLUDED
+#define RETENTION_H_INCLUDED
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// seconds between two passes, 0 disables the retention, it is opt-in while
+// the fty-metric-store-cleaner timer deletes the expired samples at once
+#define RETENTION_INTERVAL_DEFAULT 0
+// seconds from the start to the first pass
+#define RETENTION_START_DELAY 60
+// rows deleted by one statement
+#define RETENTION_CHUNK_DEFAULT 1000
+// maximal number of deleted rows per second
+#define RETENTION_RATE_DEFAULT 5000
+
+#define EV_DBSTORE_RETENTION_INTERVAL "BIOS_DBSTORE_RETENTION_INTERVAL"
+#define EV_DBSTORE_RETENTION_CHUNK "BIOS_DBSTORE_RETENTION_CHUNK"
+#define EV_DBSTORE_RETENTION_RATE "BIOS_DBSTORE_RETENTION_RATE"
+
+// step of the real time samples, their topics have no aggregation
+#define RETENTION_STEP_RT "RT"
+
+class PartitionManager;
+
+/*
+ * \brief Deletion of the samples older than the age of their step
+ *
+ * The ages in days come from the FTY_METRIC_STORE_AGE actor command. On
+ * every pass the topics of each step are resolved once, then the expired
+ * samples of each topic are deleted by statements of at most chunk rows,
+ * which use the (topic_id, timestamp) key and hold their locks briefly,
+ * at the bounded rate of a RateLimiter. When the table is partitioned,
+ * the partitions are maintained first, the ones expired for all the steps
+ * are dropped at once. All methods are thread safe.
+ */
+class Retention {
+    public:
+        Retention ();
+        Retention (int interval_s, size_t chunk, size_t rate);
+        Retention (int interval_s, size_t chunk, size_t rate, PartitionManager *partitions);
+        ~Retention ();
+
+        /*
+         * \brief set the age in days of the samples of the step
+         *  a non positive age keeps the samples forever
+         *  return false if the age is not a number
+         */
+        bool set_age (const std::string &step, const std::string &days);
+        // return the age of the step, 0 if not set
+        int get_age (const std::string &step);
+
+        void start (const std::string &url);
+        void stop ();
+
+        /*
+         * \brief delete the samples expired at now of all the steps
+         *  return the number of deleted rows, -1 on error
+         */
+        int64_t run_once (tntdb::Connection &conn, int64_t now);
+
+        // rows deleted since the start
+        uint64_t get_deleted ();
+
+        // topics of the step are matched by this LIKE pattern
+        static std::string topic_pattern (const std::string &step);
+        // query of the ids of the topics of the step, by their pattern
+        static std::string topics_query (const std::string &step);
+        // statement deleting at most chunk expired rows of a topic
+        static std::string delete_query (size_t chunk);
+
+        /*
+         * \brief age in seconds of the partitions to drop, the largest age
+         *  of all the steps, 0 if some step keeps its samples forever
+         */
+        int64_t get_partition_age_s ();
+
+    private:
+        void run ();
+        int64_t delete_step (tntdb::Connection &conn, const std::string &step, int age, int64_t now);
+
+        std::string _url;
+        int _interval_s;
+        RateLimiter _limiter;
+        std::unique_ptr<PartitionManager> _partitions;
+
+        std::mutex _mutex;
+        std::map<std::string, int> _ages;
+        uint64_t _deleted = 0;
+        std::thread _thread;
+        bool _running = false;
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    retention_test (bool verbose);
+
+#endif
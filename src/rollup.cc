@@ -0,0 +1,335 @@
+/*  =========================================================================
+    rollup - Rollup of real time metrics into the aggregation steps
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    rollup - Rollup of real time metrics into the aggregation steps
+@discuss
+    Each step of a metric computed elsewhere is one more message and one
+    more insertion. Rolled up in the store, a real time sample only updates
+    a few doubles, the rows are produced once per bucket.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+
+int64_t
+step_to_seconds (const std::string &step)
+{
+    if (step.size () < 2)
+        return 0;
+    int64_t n = 0;
+    for (size_t i = 0; i + 1 < step.size (); i++) {
+        if (step [i] < '0' || step [i] > '9' || n > 1000000)
+            return 0;
+        n = n * 10 + (step [i] - '0');
+    }
+    switch (step.back ()) {
+        case 's': return n;
+        case 'm': return n * 60;
+        case 'h': return n * 3600;
+        case 'd': return n * 86400;
+        default: return 0;
+    }
+}
+
+std::vector<std::string>
+Rollup::parse_steps (const std::string &steps)
+{
+    std::vector<std::string> list;
+    size_t first = 0;
+    while (first <= steps.size ()) {
+        size_t last = steps.find (',', first);
+        if (last == std::string::npos)
+            last = steps.size ();
+        std::string step = steps.substr (first, last - first);
+        if (step_to_seconds (step) <= 0)
+            return std::vector<std::string> ();
+        list.push_back (step);
+        first = last + 1;
+    }
+    return list;
+}
+
+Rollup::Rollup () :
+    Rollup ("", ROLLUP_STEPS_DEFAULT)
+{
+    char *env_steps = getenv (EV_DBSTORE_ROLLUP_STEPS);
+    if (env_steps) {
+        _steps = parse_steps (env_steps);
+        _step_s.clear ();
+        for (const auto &step : _steps)
+            _step_s.push_back (step_to_seconds (step));
+        log_info ("use %s '%s' as steps of the rollup", EV_DBSTORE_ROLLUP_STEPS, env_steps);
+    }
+
+    char *env_filter = getenv (EV_DBSTORE_ROLLUP_FILTER);
+    if (env_filter && env_filter[0]) {
+        try {
+            _filter = std::regex (env_filter, std::regex::extended);
+            _enabled = !_steps.empty ();
+            log_info ("use %s '%s' as filter of the rolled up metric types", EV_DBSTORE_ROLLUP_FILTER, env_filter);
+        }
+        catch (const std::regex_error &e) {
+            log_error ("%s '%s' is not a regular expression: %s", EV_DBSTORE_ROLLUP_FILTER, env_filter, e.what ());
+        }
+    }
+    if (env_filter && _steps.empty ()) {
+        log_error ("%s is not a list of steps, the rollup is disabled", EV_DBSTORE_ROLLUP_STEPS);
+    }
+}
+
+Rollup::Rollup (const std::string &filter, const std::string &steps) :
+    _steps (parse_steps (steps))
+{
+    for (const auto &step : _steps)
+        _step_s.push_back (step_to_seconds (step));
+    if (!filter.empty ()) {
+        _filter = std::regex (filter, std::regex::extended);
+        _enabled = !_steps.empty ();
+    }
+}
+
+bool
+Rollup::matches (const char *type)
+{
+    if (!_enabled)
+        return false;
+    // a handful of types, the expression is evaluated once for each
+    auto it = _matches.find (type);
+    if (it != _matches.end ())
+        return it->second;
+    bool match = std::regex_match (type, _filter);
+    _matches.emplace (type, match);
+    return match;
+}
+
+void
+Rollup::add (const char *type, const char *asset, const char *unit, int64_t time, double value)
+{
+    std::string key = std::string (type) + "@" + asset;
+    auto it = _topics.find (key);
+    if (it == _topics.end ()) {
+        Topic topic;
+        topic.type = type;
+        topic.asset = asset;
+        topic.buckets.resize (_steps.size ());
+        it = _topics.emplace (key, std::move (topic)).first;
+    }
+    Topic &topic = it->second;
+    topic.unit = unit ? unit : "";
+
+    for (size_t i = 0; i < _steps.size (); i++) {
+        Bucket &bucket = topic.buckets [i];
+        // floor, also for times before the epoch
+        int64_t start = time - ((time % _step_s [i]) + _step_s [i]) % _step_s [i];
+        if (bucket.count != 0 && start < bucket.start) {
+            _late++;
+            continue;
+        }
+        if (bucket.count != 0 && start > bucket.start) {
+            finish (topic, i, bucket);
+        }
+        if (bucket.count == 0) {
+            bucket.start = start;
+            bucket.min = bucket.max = value;
+            bucket.sum = 0;
+        }
+        bucket.min = std::min (bucket.min, value);
+        bucket.max = std::max (bucket.max, value);
+        bucket.sum += value;
+        bucket.count++;
+    }
+}
+
+void
+Rollup::expire (int64_t now)
+{
+    for (auto &it : _topics) {
+        Topic &topic = it.second;
+        for (size_t i = 0; i < _steps.size (); i++) {
+            Bucket &bucket = topic.buckets [i];
+            if (bucket.count != 0 && bucket.start + _step_s [i] + ROLLUP_GRACE_S <= now) {
+                finish (topic, i, bucket);
+            }
+        }
+    }
+}
+
+void
+Rollup::forget (const std::string &asset)
+{
+    for (auto it = _topics.begin (); it != _topics.end (); ) {
+        if (it->second.asset == asset)
+            it = _topics.erase (it);
+        else
+            ++it;
+    }
+    _finished.erase (
+        std::remove_if (_finished.begin (), _finished.end (),
+                        [&asset] (const RollupSample &sample) { return sample.asset == asset; }),
+        _finished.end ());
+}
+
+void
+Rollup::take (std::vector<RollupSample> &samples)
+{
+    samples.insert (samples.end (), _finished.begin (), _finished.end ());
+    _finished.clear ();
+}
+
+void
+Rollup::finish (const Topic &topic, size_t step, Bucket &bucket)
+{
+    uint32_t count = bucket.count;
+    bucket.count = 0;
+    if (bucket.partial) {
+        // the first bucket after the start lacks the samples before it
+        bucket.partial = false;
+        _partial++;
+        log_debug ("first bucket %" PRIi64 " of %s@%s step %s is skipped",
+                   bucket.start, topic.type.c_str (), topic.asset.c_str (), _steps [step].c_str ());
+        return;
+    }
+
+    const struct {
+        const char *name;
+        double value;
+    } aggregations [] = {
+        { "min", bucket.min },
+        { "max", bucket.max },
+        { "arithmetic_mean", bucket.sum / count },
+        { "sum", bucket.sum },
+        { "count", (double) count }
+    };
+
+    for (const auto &aggregation : aggregations) {
+        RollupSample sample;
+        int8_t scale = 0;
+        if (!dtobiosf (aggregation.value, sample.value, scale)) {
+            log_warning ("%s of %s@%s is out of range, not stored", aggregation.name, topic.type.c_str (), topic.asset.c_str ());
+            continue;
+        }
+        sample.scale = scale;
+        sample.topic = topic.type + "_" + aggregation.name + "_" + _steps [step] + "@" + topic.asset;
+        sample.unit = topic.unit;
+        sample.asset = topic.asset;
+        sample.time = bucket.start;
+        _finished.push_back (std::move (sample));
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+rollup_test (bool verbose)
+{
+    printf (" * rollup: ");
+
+    //  @selftest
+    assert (step_to_seconds ("15m") == 900);
+    assert (step_to_seconds ("8h") == 8 * 3600);
+    assert (step_to_seconds ("24h") == 86400);
+    assert (step_to_seconds ("1d") == 86400);
+    assert (step_to_seconds ("30d") == 30 * 86400);
+    assert (step_to_seconds ("RT") == 0);
+    assert (step_to_seconds ("m") == 0);
+    assert (step_to_seconds ("15x") == 0);
+    assert (Rollup::parse_steps (ROLLUP_STEPS_DEFAULT).size () == 7);
+    assert (Rollup::parse_steps ("15m,RT").empty ());
+
+    Rollup disabled ("", ROLLUP_STEPS_DEFAULT);
+    assert (!disabled.is_enabled ());
+    assert (!disabled.matches ("realpower.default"));
+
+    Rollup rollup ("realpower\\..*", "15m,1h");
+    assert (rollup.is_enabled ());
+    assert (rollup.matches ("realpower.default"));
+    assert (rollup.matches ("realpower.default"));
+    assert (!rollup.matches ("voltage.input"));
+
+    // the first buckets are skipped, their start is not observed, then
+    // three samples in the quarter, one in the next
+    rollup.add ("realpower.default", "ups-1", "W", 3599, 7);
+    rollup.add ("realpower.default", "ups-1", "W", 3600, 10);
+    rollup.add ("realpower.default", "ups-1", "W", 3700, 30);
+    rollup.add ("realpower.default", "ups-1", "W", 3800, 20.5);
+    std::vector<RollupSample> samples;
+    rollup.take (samples);
+    assert (samples.empty ());
+    assert (rollup.get_partial () == 2);
+    rollup.add ("realpower.default", "ups-1", "W", 4500, 40);
+    rollup.take (samples);
+    assert (samples.size () == 5);
+    assert (samples [0].topic == "realpower.default_min_15m@ups-1");
+    assert (samples [0].time == 3600 && samples [0].value == 10 && samples [0].scale == 0);
+    assert (samples [1].topic == "realpower.default_max_15m@ups-1" && samples [1].value == 30);
+    assert (samples [2].topic == "realpower.default_arithmetic_mean_15m@ups-1");
+    assert (samples [2].value == 2017 && samples [2].scale == -2);
+    assert (samples [3].value == 605 && samples [3].scale == -1);
+    assert (samples [4].topic == "realpower.default_count_15m@ups-1" && samples [4].value == 3);
+    assert (samples [4].unit == "W" && samples [4].asset == "ups-1");
+
+    // a late sample does not reopen its bucket, it still is in the hour
+    rollup.add ("realpower.default", "ups-1", "W", 3650, 99);
+    assert (rollup.get_late () == 1);
+    samples.clear ();
+    rollup.take (samples);
+    assert (samples.empty ());
+
+    // idle buckets are finished after the grace delay
+    rollup.expire (4500 + 900);
+    rollup.take (samples);
+    assert (samples.empty ());
+    rollup.expire (3600 + 3600 + ROLLUP_GRACE_S);
+    rollup.take (samples);
+    assert (samples.size () == 10);
+    assert (samples [0].topic == "realpower.default_min_15m@ups-1" && samples [0].time == 4500);
+    assert (samples [5].topic == "realpower.default_min_1h@ups-1" && samples [5].time == 3600);
+    assert (samples [5].value == 10 && samples [6].value == 99);
+    assert (samples [9].value == 5);
+    assert (rollup.get_topics () == 1);
+    assert (rollup.get_partial () == 2);
+
+    // nothing is left of a deleted asset
+    rollup.add ("realpower.default", "ups-2", "W", 3600, 1);
+    rollup.add ("realpower.default", "ups-2", "W", 4500, 1);
+    rollup.add ("realpower.default", "ups-2", "W", 5400, 1);
+    assert (rollup.get_topics () == 2);
+    rollup.forget ("ups-2");
+    assert (rollup.get_topics () == 1);
+    samples.clear ();
+    rollup.take (samples);
+    assert (samples.empty ());
+
+    // also skipped when expired
+    rollup.add ("realpower.default", "ups-3", "W", 3600, 1);
+    rollup.expire (3600 + 3600 + ROLLUP_GRACE_S);
+    rollup.take (samples);
+    assert (samples.empty ());
+    assert (rollup.get_partial () == 5);
+    //  @end
+
+    printf ("OK\n");
+}
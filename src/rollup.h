@@ -0,0 +1,139 @@
+/*  =========================================================================
+    rollup - Rollup of real time metrics into the aggregation steps
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef ROLLUP_H_INCLUDED
+#define ROLLUP_H_INCLUDED
+
+#include <regex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// steps of the computation module, the daily one is named 24h in topics
+#define ROLLUP_STEPS_DEFAULT "15m,30m,1h,8h,24h,7d,30d"
+// seconds a bucket waits after its end for late samples
+#define ROLLUP_GRACE_S 60
+
+// regular expression of the real time metric types to roll up, unset disables it
+#define EV_DBSTORE_ROLLUP_FILTER "BIOS_DBSTORE_ROLLUP_FILTER"
+#define EV_DBSTORE_ROLLUP_STEPS "BIOS_DBSTORE_ROLLUP_STEPS"
+
+// subjects type@asset of the real time metrics on the METRICS stream, the
+// types of the computation module outputs have an underscore
+#define ROLLUP_STREAM_PATTERN "^[^_@]*@"
+
+// one row of a finished bucket, topic is quantity_aggregation_step@asset
+struct RollupSample {
+    std::string topic;
+    std::string unit;
+    std::string asset;
+    int64_t time;
+    m_msrmnt_value_t value;
+    m_msrmnt_scale_t scale;
+};
+
+/*
+ * \brief Aggregation of real time metrics into the steps, in the store
+ *
+ * Real time metrics whose type matches the filter are accumulated per
+ * asset and step as min, max, sum and count of the current bucket. The
+ * buckets are aligned on multiples of the step since the epoch. A bucket
+ * is finished by the first sample of a later one, or ROLLUP_GRACE_S after
+ * its end by expire (), then it gives the rows of its min, max,
+ * arithmetic_mean, sum and count topics at the start of the bucket. The
+ * first bucket of each topic and step is skipped, as the samples before
+ * the start of the agent are missing from it. The samples older than the
+ * current bucket are dropped, and so are the unfinished buckets at
+ * shutdown. Not thread safe, the server actor owns the only instance.
+ */
+class Rollup {
+    public:
+        Rollup ();
+        Rollup (const std::string &filter, const std::string &steps);
+
+        bool is_enabled () const { return _enabled; }
+        // the type is rolled up
+        bool matches (const char *type);
+
+        // account a real time sample
+        void add (const char *type, const char *asset, const char *unit, int64_t time, double value);
+
+        // finish the buckets ended ROLLUP_GRACE_S before now
+        void expire (int64_t now);
+
+        // drop the buckets of a deleted asset
+        void forget (const std::string &asset);
+
+        // move the rows of the finished buckets to samples
+        void take (std::vector<RollupSample> &samples);
+
+        size_t get_topics () const { return _topics.size (); }
+        // samples older than their current bucket
+        uint64_t get_late () const { return _late; }
+        // first buckets skipped
+        uint64_t get_partial () const { return _partial; }
+
+        // the steps of the rollup, an empty list if one is not a step
+        static std::vector<std::string> parse_steps (const std::string &steps);
+
+    private:
+        struct Bucket {
+            int64_t start = 0;
+            double min = 0;
+            double max = 0;
+            double sum = 0;
+            uint32_t count = 0;
+            // the first bucket of the topic, maybe observed in part only
+            bool partial = true;
+        };
+
+        // the buckets of one type@asset, one per step
+        struct Topic {
+            std::string type;
+            std::string asset;
+            std::string unit;
+            std::vector<Bucket> buckets;
+        };
+
+        // give the rows of the bucket and empty it
+        void finish (const Topic &topic, size_t step, Bucket &bucket);
+
+        bool _enabled = false;
+        std::regex _filter;
+        std::vector<std::string> _steps;
+        std::vector<int64_t> _step_s;
+        std::unordered_map<std::string, bool> _matches;
+        std::unordered_map<std::string, Topic> _topics;
+        std::vector<RollupSample> _finished;
+        uint64_t _late = 0;
+        uint64_t _partial = 0;
+};
+
+// Seconds of a step as 15m, 8h, 24h or 7d, 0 for RT or not a step
+FTY_METRIC_STORE_PRIVATE int64_t
+    step_to_seconds (const std::string &step);
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    rollup_test (bool verbose);
+
+#endif
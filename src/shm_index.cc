@@ -0,0 +1,277 @@
+/*  =========================================================================
+    shm_index - Last stored state of the metrics read from shared memory
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    shm_index - Last stored state of the metrics read from shared memory
+@discuss
+    Aggregated metrics change once per step, so between two polls of the
+    shared memory almost all of them are the same. The index lets the pull
+    actor skip them before parsing the value or touching the database.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+std::string
+shm_type_filter ()
+{
+    std::string filter = SHM_TYPE_FILTER_DEFAULT;
+    char *env_filter = getenv (EV_DBSTORE_SHM_TYPE_FILTER);
+    if (env_filter && env_filter[0]) {
+        filter = env_filter;
+        log_info ("use %s '%s' as filter of metric types read from shm", EV_DBSTORE_SHM_TYPE_FILTER, env_filter);
+    }
+    return filter;
+}
+
+std::string
+shm_index_file ()
+{
+    char *env_file = getenv (EV_DBSTORE_SHM_INDEX_FILE);
+    if (!env_file)
+        return std::string ();
+    log_info ("use %s '%s' to keep stored shm metrics", EV_DBSTORE_SHM_INDEX_FILE, env_file);
+    return env_file;
+}
+
+size_t
+shm_workers ()
+{
+    size_t workers = SHM_WORKERS_DEFAULT;
+    char *env_workers = getenv (EV_DBSTORE_SHM_WORKERS);
+    if (env_workers) {
+        int n = atoi (env_workers);
+        if (n > 0) workers = std::min<size_t> ((size_t) n, SHM_WORKERS_MAX);
+        log_info ("use %s %zu as number of shm workers", EV_DBSTORE_SHM_WORKERS, workers);
+    }
+    return workers;
+}
+
+// FNV-1a
+static uint64_t
+s_fnv1a (uint64_t h, const char *value)
+{
+    for (const char *p = value; *p; p++) {
+        h ^= (unsigned char) *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t
+ShmIndex::hash (const char *value)
+{
+    return s_fnv1a (14695981039346656037ULL, value);
+}
+
+uint64_t
+ShmIndex::hash (const char *type, const char *name)
+{
+    return s_fnv1a (s_fnv1a (hash (type), "@"), name);
+}
+
+std::string
+ShmIndex::make_key (const char *type, const char *name)
+{
+    std::string key (type);
+    key += '@';
+    key += name;
+    return key;
+}
+
+bool
+ShmIndex::is_unchanged (const char *type, const char *name, uint64_t time, const char *value)
+{
+    assert (type);
+    assert (name);
+    assert (value);
+
+    auto it = _index.find (make_key (type, name));
+    if (it == _index.end ())
+        return false;
+
+    Entry &entry = it->second;
+    entry.cycle = _cycle;
+    return entry.time == time && entry.value_hash == hash (value);
+}
+
+void
+ShmIndex::stored (const char *type, const char *name, uint64_t time, const char *value)
+{
+    assert (type);
+    assert (name);
+    assert (value);
+
+    Entry &entry = _index [make_key (type, name)];
+    entry.time = time;
+    entry.value_hash = hash (value);
+    entry.cycle = _cycle;
+}
+
+size_t
+ShmIndex::prune ()
+{
+    size_t pruned = 0;
+    for (auto it = _index.begin (); it != _index.end (); ) {
+        if (it->second.cycle != _cycle) {
+            it = _index.erase (it);
+            pruned++;
+        }
+        else
+            ++it;
+    }
+    return pruned;
+}
+
+// one line per metric: key, time and value hash separated by tabulators
+int
+ShmIndex::save (const std::string &path)
+{
+    return save (path, std::vector<ShmIndex *> (1, this));
+}
+
+int
+ShmIndex::save (const std::string &path, const std::vector<ShmIndex *> &indexes)
+{
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out (tmp, std::ios::trunc);
+        if (!out) {
+            log_error ("Can't open '%s' for writing", tmp.c_str ());
+            return -1;
+        }
+        for (const ShmIndex *index : indexes) {
+            for (const auto &it : index->_index) {
+                out << it.first << '\t' << it.second.time << '\t' << it.second.value_hash << '\n';
+            }
+        }
+        out.close ();
+        if (!out) {
+            log_error ("Can't write '%s'", tmp.c_str ());
+            std::remove (tmp.c_str ());
+            return -1;
+        }
+    }
+    if (std::rename (tmp.c_str (), path.c_str ()) != 0) {
+        log_error ("Can't rename '%s' to '%s'", tmp.c_str (), path.c_str ());
+        std::remove (tmp.c_str ());
+        return -1;
+    }
+    return 0;
+}
+
+int
+ShmIndex::load (const std::string &path)
+{
+    std::ifstream in (path);
+    if (!in) {
+        log_info ("No saved index of shm metrics in '%s'", path.c_str ());
+        return -1;
+    }
+
+    int loaded = 0;
+    std::string line;
+    while (std::getline (in, line)) {
+        std::string::size_type tab2 = line.rfind ('\t');
+        std::string::size_type tab1 = tab2 == std::string::npos || tab2 == 0 ? std::string::npos : line.rfind ('\t', tab2 - 1);
+        if (tab1 == std::string::npos || tab1 == 0) {
+            log_error ("Malformed line in '%s', ignored", path.c_str ());
+            continue;
+        }
+        Entry entry;
+        char *end1 = NULL, *end2 = NULL;
+        entry.time = strtoull (line.c_str () + tab1 + 1, &end1, 10);
+        entry.value_hash = strtoull (line.c_str () + tab2 + 1, &end2, 10);
+        if (*end1 != '\t' || *end2 != '\0') {
+            log_error ("Malformed line in '%s', ignored", path.c_str ());
+            continue;
+        }
+        entry.cycle = _cycle;
+        _index [line.substr (0, tab1)] = entry;
+        loaded++;
+    }
+    return loaded;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+shm_index_test (bool verbose)
+{
+    printf (" * shm_index: ");
+
+    //  @selftest
+    assert (ShmIndex::hash ("") == 14695981039346656037ULL);
+    assert (ShmIndex::hash ("1.5") != ShmIndex::hash ("1.50"));
+    assert (ShmIndex::hash ("realpower.default_max_15m", "ups-1") == ShmIndex::hash ("realpower.default_max_15m@ups-1"));
+
+    ShmIndex index;
+    index.begin_cycle ();
+    assert (!index.is_unchanged ("realpower.default_max_15m", "ups-1", 900, "12.5"));
+    index.stored ("realpower.default_max_15m", "ups-1", 900, "12.5");
+    index.stored ("realpower.default_min_15m", "ups-1", 900, "10");
+    assert (index.size () == 2);
+
+    index.begin_cycle ();
+    assert (index.is_unchanged ("realpower.default_max_15m", "ups-1", 900, "12.5"));
+    // new time or new value
+    assert (!index.is_unchanged ("realpower.default_max_15m", "ups-1", 1800, "12.5"));
+    assert (!index.is_unchanged ("realpower.default_max_15m", "ups-1", 900, "13"));
+    assert (!index.is_unchanged ("realpower.default_max_15m", "ups-2", 900, "12.5"));
+    // the min metric was not seen in this cycle
+    assert (index.prune () == 1);
+    assert (index.size () == 1);
+    assert (!index.is_unchanged ("realpower.default_min_15m", "ups-1", 900, "10"));
+
+    // the index survives a restart
+    const char *path = "src/selftest-rw/shm_index";
+    assert (index.save (path) == 0);
+    ShmIndex restored;
+    assert (restored.load (path) == 1);
+    restored.begin_cycle ();
+    assert (restored.is_unchanged ("realpower.default_max_15m", "ups-1", 900, "12.5"));
+    assert (restored.prune () == 0);
+
+    // two workers save into one file, both load it and keep their metrics
+    ShmIndex other;
+    other.begin_cycle ();
+    other.stored ("voltage.input_min_15m", "epdu-1", 900, "230");
+    std::vector<ShmIndex *> indexes { &restored, &other };
+    assert (ShmIndex::save (path, indexes) == 0);
+    ShmIndex worker;
+    assert (worker.load (path) == 2);
+    worker.begin_cycle ();
+    assert (worker.is_unchanged ("voltage.input_min_15m", "epdu-1", 900, "230"));
+    assert (worker.prune () == 1);
+    assert (worker.size () == 1);
+
+    std::remove (path);
+    assert (restored.load (path) == -1);
+    //  @end
+
+    printf ("OK\n");
+}
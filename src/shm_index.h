@@ -0,0 +1,125 @@
+/*  =========================================================================
+    shm_index - Last stored state of the metrics read from shared memory
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef SHM_INDEX_H_INCLUDED
+#define SHM_INDEX_H_INCLUDED
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// metric types read from shared memory, the outputs of the computation
+// module are named quantity_aggregation_step
+#define SHM_TYPE_FILTER_DEFAULT ".*_.*"
+
+#define EV_DBSTORE_SHM_TYPE_FILTER "BIOS_DBSTORE_SHM_TYPE_FILTER"
+// file keeping the index between restarts, unset means not kept
+#define EV_DBSTORE_SHM_INDEX_FILE "BIOS_DBSTORE_SHM_INDEX_FILE"
+
+// number of threads processing the metrics read from shared memory
+#define SHM_WORKERS_DEFAULT 1
+#define SHM_WORKERS_MAX 64
+
+#define EV_DBSTORE_SHM_WORKERS "BIOS_DBSTORE_SHM_WORKERS"
+
+/*
+ * \brief Time and value of each shm metric when it was last stored
+ *
+ * The pull actor reads all the metrics on every cycle, but most of them
+ * did not change since the previous one. A metric is looked up by its
+ * type@name key and skipped when its time and value are the ones already
+ * stored. Metrics not seen during a cycle left the shared memory and are
+ * pruned. The index can be saved at shutdown and loaded at startup, so
+ * metrics stored before a restart are not stored again. Not thread safe,
+ * each worker of the pull actor has its own index of its metrics.
+ */
+class ShmIndex {
+    public:
+        ShmIndex () {}
+
+        // start a new read of the shared memory
+        void begin_cycle () { _cycle++; }
+
+        /*
+         * \brief mark the metric as seen in this cycle
+         *  return true if it was stored with the same time and value
+         */
+        bool is_unchanged (const char *type, const char *name, uint64_t time, const char *value);
+
+        // remember the metric was stored with this time and value
+        void stored (const char *type, const char *name, uint64_t time, const char *value);
+
+        // forget the metrics not seen in this cycle, return their number
+        size_t prune ();
+
+        size_t size () { return _index.size (); }
+
+        /*
+         * \brief write the index into the file, replacing it atomically
+         *  return 0 on success, -1 on error
+         */
+        int save (const std::string &path);
+
+        // save several indexes into one file
+        static int save (const std::string &path, const std::vector<ShmIndex *> &indexes);
+
+        /*
+         * \brief add the entries saved in the file to the index
+         *  entries of metrics not seen in the next cycle are pruned, so
+         *  all the indexes of the workers can load the same file
+         *  return number of loaded entries, -1 on error
+         */
+        int load (const std::string &path);
+
+        static uint64_t hash (const char *value);
+        // hash of the metric identity, it selects the worker of the metric
+        static uint64_t hash (const char *type, const char *name);
+
+    private:
+        struct Entry {
+            uint64_t time;
+            uint64_t value_hash;
+            uint64_t cycle;
+        };
+
+        static std::string make_key (const char *type, const char *name);
+
+        uint64_t _cycle = 0;
+        std::unordered_map<std::string, Entry> _index;
+};
+
+// regular expression of the metric types read from shared memory
+FTY_METRIC_STORE_PRIVATE std::string
+    shm_type_filter ();
+
+// path of the saved index, empty if it is not kept
+FTY_METRIC_STORE_PRIVATE std::string
+    shm_index_file ();
+
+FTY_METRIC_STORE_PRIVATE size_t
+    shm_workers ();
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    shm_index_test (bool verbose);
+
+#endif
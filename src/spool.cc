@@ -0,0 +1,343 @@
+/*  =========================================================================
+    spool - Memory mapped spool of the rows waiting for insertion
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    spool - Memory mapped spool of the rows waiting for insertion
+@discuss
+    Without the spool, the rows of a batch which can't be inserted are lost,
+    and so are the rows in the cache when the agent dies. Appending a row to
+    a mapped file is a copy of 16 bytes, the kernel writes it back.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPOOL_MAGIC "FTYMSPL"
+#define SPOOL_VERSION 1
+
+struct Spool::Header {
+    char magic [8];
+    uint32_t version;
+    uint32_t row_size;
+    uint64_t capacity;
+    // position of the oldest uncommitted row
+    uint64_t head;
+    // position of the next appended row
+    uint64_t tail;
+    char reserved [24];
+};
+
+static_assert (sizeof (Spool::Row) == 16, "rows of the spool file are 16 bytes");
+
+Spool::Spool ()
+{
+    _size_mb = SPOOL_SIZE_DEFAULT;
+
+    char *env_file = getenv (EV_DBSTORE_SPOOL_FILE);
+    if (env_file) {
+        _path = env_file;
+        log_info ("use %s '%s' to spool the measurements", EV_DBSTORE_SPOOL_FILE, env_file);
+    }
+
+    char *env_size = getenv (EV_DBSTORE_SPOOL_SIZE);
+    if (env_size) {
+        int size = atoi (env_size);
+        if (size > 0) _size_mb = (size_t) size;
+        log_info ("use %s %zuMiB as size of the spool", EV_DBSTORE_SPOOL_SIZE, _size_mb);
+    }
+}
+
+Spool::Spool (const std::string &path, size_t size_mb) :
+    _path (path),
+    _size_mb (size_mb > 0 ? size_mb : 1)
+{
+}
+
+Spool::~Spool ()
+{
+    close ();
+}
+
+bool
+Spool::open ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    if (_header)
+        return true;
+    if (_path.empty ())
+        return false;
+
+    _fd = ::open (_path.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (_fd == -1) {
+        log_error ("Can't open the spool '%s': %s", _path.c_str (), strerror (errno));
+        return false;
+    }
+
+    uint64_t capacity = ((uint64_t) _size_mb * 1024 * 1024 - sizeof (Header)) / sizeof (Row);
+
+    // a former spool with rows keeps its size until they are replayed
+    Header former;
+    struct stat st;
+    bool valid =
+        fstat (_fd, &st) == 0 &&
+        pread (_fd, &former, sizeof (former), 0) == (ssize_t) sizeof (former) &&
+        memcmp (former.magic, SPOOL_MAGIC, sizeof (SPOOL_MAGIC)) == 0 &&
+        former.version == SPOOL_VERSION &&
+        former.row_size == sizeof (Row) &&
+        former.capacity > 0 &&
+        (uint64_t) st.st_size == sizeof (Header) + former.capacity * sizeof (Row) &&
+        former.head <= former.tail &&
+        former.tail - former.head <= former.capacity;
+    bool keep = valid && (former.head < former.tail || former.capacity == capacity);
+    if (keep) {
+        capacity = former.capacity;
+    }
+    else {
+        // reserve the blocks now, a write to a hole of a full disk kills the agent
+        int rv = ftruncate (_fd, 0);
+        if (rv == 0)
+            rv = posix_fallocate (_fd, 0, (off_t) (sizeof (Header) + capacity * sizeof (Row)));
+        if (rv != 0) {
+            log_error ("Can't allocate the spool '%s' of %zuMiB", _path.c_str (), _size_mb);
+            ::close (_fd);
+            _fd = -1;
+            return false;
+        }
+    }
+
+    _map_size = sizeof (Header) + capacity * sizeof (Row);
+    void *map = mmap (NULL, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED) {
+        log_error ("Can't map the spool '%s': %s", _path.c_str (), strerror (errno));
+        ::close (_fd);
+        _fd = -1;
+        return false;
+    }
+
+    _header = (Header *) map;
+    _rows = (Row *) ((char *) map + sizeof (Header));
+    _capacity = capacity;
+    if (!keep) {
+        memset (_header, 0, sizeof (Header));
+        memcpy (_header->magic, SPOOL_MAGIC, sizeof (SPOOL_MAGIC));
+        _header->version = SPOOL_VERSION;
+        _header->row_size = sizeof (Row);
+        _header->capacity = capacity;
+    }
+
+    uint64_t pending = _header->tail - _header->head;
+    _needs_replay = pending != 0;
+    store_stats ().set_gauge (STATS_SPOOLED_ROWS, (int64_t) pending);
+    if (pending != 0)
+        log_info ("%" PRIu64 " measurements of the spool '%s' to replay", pending, _path.c_str ());
+    return true;
+}
+
+void
+Spool::close ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    if (!_header)
+        return;
+    msync (_header, _map_size, MS_SYNC);
+    munmap (_header, _map_size);
+    ::close (_fd);
+    _fd = -1;
+    _header = NULL;
+    _rows = NULL;
+}
+
+uint64_t
+Spool::append (const MultiRowCache &rows, size_t first)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    if (!_header)
+        return 0;
+
+    uint64_t head = _header->head;
+    uint64_t tail = _header->tail;
+    size_t dropped = 0;
+    for (size_t i = first; i < rows.size (); i++) {
+        if (tail - head == _capacity) {
+            // the oldest row goes away before it is overwritten
+            _header->head = ++head;
+            dropped++;
+        }
+        Row &row = _rows [tail % _capacity];
+        row.time = rows.get_time (i);
+        row.value = rows.get_value (i);
+        row.scale = rows.get_scale (i);
+        row.topic_id = rows.get_topic_id (i);
+        // a row is complete before it is counted
+        std::atomic_thread_fence (std::memory_order_release);
+        _header->tail = ++tail;
+    }
+
+    if (dropped != 0) {
+        _dropped += dropped;
+        store_stats ().add (STATS_ROWS_DROPPED, dropped);
+        log_warning ("spool is full, %zu oldest measurements dropped", dropped);
+    }
+    store_stats ().set_gauge (STATS_SPOOLED_ROWS, (int64_t) (tail - head));
+    return tail;
+}
+
+void
+Spool::commit (uint64_t position)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    if (!_header || position <= _header->head)
+        return;
+    _header->head = std::min (position, _header->tail);
+    store_stats ().set_gauge (STATS_SPOOLED_ROWS, (int64_t) (_header->tail - _header->head));
+}
+
+uint64_t
+Spool::read (MultiRowCache &batch, size_t max_rows)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    if (!_header)
+        return 0;
+
+    uint64_t position = _header->head;
+    uint64_t end = std::min (_header->tail, position + max_rows);
+    for (; position < end; position++) {
+        const Row &row = _rows [position % _capacity];
+        batch.push_back (row.time, row.value, row.scale, row.topic_id);
+    }
+    return position;
+}
+
+uint64_t
+Spool::get_head ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _header ? _header->head : 0;
+}
+
+uint64_t
+Spool::get_tail ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _header ? _header->tail : 0;
+}
+
+uint64_t
+Spool::size ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _header ? _header->tail - _header->head : 0;
+}
+
+uint64_t
+Spool::get_dropped ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _dropped;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+spool_test (bool verbose)
+{
+    printf (" * spool: ");
+
+    //  @selftest
+    const char *path = "src/selftest-rw/spool";
+    std::remove (path);
+
+    Spool disabled ("", 1);
+    assert (!disabled.open ());
+    assert (!disabled.is_open ());
+
+    // 1MiB holds 65532 rows
+    Spool spool (path, 1);
+    assert (spool.open ());
+    assert (spool.get_capacity () == 65532);
+    assert (!spool.needs_replay ());
+
+    MultiRowCache rows (100, 10);
+    for (int i = 0; i < 10; i++)
+        rows.push_back (1000 + i, i * 10, -1, 7);
+    assert (spool.append (rows, 0) == 10);
+    assert (spool.append (rows, 8) == 12);
+    assert (spool.size () == 12);
+
+    // the first batch is inserted
+    spool.commit (10);
+    assert (spool.get_head () == 10);
+    // a commit never goes back
+    spool.commit (5);
+    assert (spool.get_head () == 10);
+
+    MultiRowCache batch (100, 10);
+    assert (spool.read (batch, 100) == 12);
+    assert (batch.size () == 2);
+    assert (batch.get_time (0) == 1008 && batch.get_value (1) == 90);
+    assert (batch.get_scale (0) == -1 && batch.get_topic_id (1) == 7);
+    batch.clear ();
+
+    // the uncommitted rows survive a restart
+    spool.close ();
+    Spool restarted (path, 1);
+    assert (restarted.open ());
+    assert (restarted.needs_replay ());
+    assert (restarted.size () == 2);
+    assert (restarted.read (batch, 1) == 11);
+    assert (batch.size () == 1 && batch.get_time (0) == 1008);
+    batch.clear ();
+    restarted.commit (12);
+    assert (restarted.size () == 0);
+    restarted.close ();
+
+    // an empty spool takes the new size
+    Spool bigger (path, 2);
+    assert (bigger.open ());
+    assert (bigger.get_capacity () == (2 * 1024 * 1024 - 64) / 16);
+    bigger.close ();
+
+    // a full spool drops the oldest rows
+    std::remove (path);
+    Spool full (path, 1);
+    assert (full.open ());
+    MultiRowCache many (70000, 10);
+    for (int i = 0; i < 70000; i++)
+        many.push_back (i, i, 0, 1);
+    assert (full.append (many, 0) == 70000);
+    assert (full.get_dropped () == 70000 - 65532);
+    assert (full.get_head () == 70000 - 65532);
+    assert (full.read (batch, 1) == 70000 - 65532 + 1);
+    assert (batch.get_time (0) == 70000 - 65532);
+    full.close ();
+    std::remove (path);
+    //  @end
+
+    printf ("OK\n");
+}
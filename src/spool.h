@@ -0,0 +1,123 @@
+/*  =========================================================================
+    spool - Memory mapped spool of the rows waiting for insertion
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef SPOOL_H_INCLUDED
+#define SPOOL_H_INCLUDED
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+// size of the spool file in MiB
+#define SPOOL_SIZE_DEFAULT 64
+// rows inserted by one transaction of the replay
+#define SPOOL_REPLAY_ROWS 20000
+// seconds between two replays while the database is away
+#define SPOOL_RETRY_S 5
+
+// the spool is disabled when unset
+#define EV_DBSTORE_SPOOL_FILE "BIOS_DBSTORE_SPOOL_FILE"
+#define EV_DBSTORE_SPOOL_SIZE "BIOS_DBSTORE_SPOOL_SIZE"
+
+class MultiRowCache;
+
+/*
+ * \brief Rows of the measurements from their acceptance to their commit
+ *
+ * The spool is a ring of fixed size rows in a memory mapped file. The rows
+ * are appended when they enter the row cache and committed once their
+ * batch is inserted, the committed ones are overwritten later. When a
+ * batch fails, the rows left in the spool are replayed in large batches
+ * when the database comes back, and also at the next start after a crash,
+ * as the file outlives the process. A full spool overwrites its oldest
+ * rows, they are counted as dropped.
+ *
+ * Rows are addressed by their position, a number of appended rows which
+ * only grows, the ring index is the position modulo the capacity. All
+ * methods are thread safe.
+ */
+class Spool {
+    public:
+        // one row of the file
+        struct Row {
+            int64_t time;
+            m_msrmnt_value_t value;
+            m_msrmnt_scale_t scale;
+            m_msrmnt_tpc_id_t topic_id;
+        };
+
+        Spool ();
+        Spool (const std::string &path, size_t size_mb);
+        ~Spool ();
+
+        /*
+         * \brief map the file, create it if needed, the rows of a former
+         *  spool are kept for the replay
+         *  return false if no file is set or it can't be mapped
+         */
+        bool open ();
+        void close ();
+        bool is_open () { return _header != NULL; }
+
+        // append the rows of the cache from first on, return the new tail
+        uint64_t append (const MultiRowCache &rows, size_t first);
+
+        // the rows before position are in the database
+        void commit (uint64_t position);
+
+        /*
+         * \brief append to the batch at most max_rows rows from the oldest
+         *  uncommitted one, return the position after the last one
+         */
+        uint64_t read (MultiRowCache &batch, size_t max_rows);
+
+        uint64_t get_head ();
+        uint64_t get_tail ();
+        // uncommitted rows
+        uint64_t size ();
+        uint64_t get_capacity () { return _capacity; }
+        uint64_t get_dropped ();
+
+        // set when a batch failed, until the replay inserted its rows
+        bool needs_replay () { return _needs_replay; }
+        void set_needs_replay (bool needs_replay) { _needs_replay = needs_replay; }
+
+    private:
+        struct Header;
+
+        std::string _path;
+        size_t _size_mb;
+        std::mutex _mutex;
+        int _fd = -1;
+        size_t _map_size = 0;
+        Header *_header = NULL;
+        Row *_rows = NULL;
+        uint64_t _capacity = 0;
+        uint64_t _dropped = 0;
+        std::atomic<bool> _needs_replay { false };
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    spool_test (bool verbose);
+
+#endif
@@ -0,0 +1,328 @@
+/*  =========================================================================
+    store_stats - Counters and latency histograms of the store itself
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    store_stats - Counters and latency histograms of the store itself
+@discuss
+    The hot paths only increment relaxed atomics, the percentiles are
+    computed when the stats are read.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+static const char *s_counter_names [STATS_COUNTERS] = {
+    "samples_received",
+    "samples_rejected",
+    "rows_inserted",
+    "rows_dropped",
+    "rows_coalesced",
+    "flushes",
+    "flush_errors",
+    "topic_prepares",
+    "shm_cycles",
+    "get_requests",
+    "get_errors",
+    "get_aggregated",
+    "rollup_samples",
+    "rollup_rows"
+};
+
+static const char *s_gauge_names [STATS_GAUGES] = {
+    "pending_rows",
+    "flush_inflight",
+    "spooled_rows",
+    "flush_row_limit",
+    "flush_delay_ms",
+    "flush_latency_ms",
+    "flush_row_cost_us",
+    "flush_rate"
+};
+
+static const char *s_histogram_names [STATS_HISTOGRAMS] = {
+    "flush_us",
+    "flush_rows",
+    "topic_prepare_us",
+    "shm_cycle_us",
+    "get_multi_us",
+    "get_rt_us",
+    "get_15m_us",
+    "get_30m_us",
+    "get_1h_us",
+    "get_8h_us",
+    "get_24h_us",
+    "get_7d_us",
+    "get_30d_us",
+    "get_other_us"
+};
+
+Histogram::Histogram () :
+    _count (0),
+    _max (0)
+{
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        _buckets [i].store (0, std::memory_order_relaxed);
+}
+
+size_t
+Histogram::bucket (uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (size_t) value;
+    int exponent = 63 - __builtin_clzll (value);
+    if (exponent >= HISTOGRAM_MAX_EXPONENT)
+        return HISTOGRAM_BUCKETS - 1;
+    size_t sub = (size_t) (value >> (exponent - 3)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (size_t) (exponent - 2) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+uint64_t
+Histogram::bucket_upper (size_t index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+    int exponent = (int) (index / HISTOGRAM_SUB_BUCKETS) + 2;
+    uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+    uint64_t lower = (HISTOGRAM_SUB_BUCKETS + sub) << (exponent - 3);
+    return lower + (1ULL << (exponent - 3)) - 1;
+}
+
+void
+Histogram::record (uint64_t value)
+{
+    _buckets [bucket (value)].fetch_add (1, std::memory_order_relaxed);
+    _count.fetch_add (1, std::memory_order_relaxed);
+    uint64_t max = _max.load (std::memory_order_relaxed);
+    while (value > max && !_max.compare_exchange_weak (max, value, std::memory_order_relaxed))
+        ;
+}
+
+uint64_t
+Histogram::percentile (double q) const
+{
+    uint64_t counts [HISTOGRAM_BUCKETS];
+    uint64_t total = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        counts [i] = _buckets [i].load (std::memory_order_relaxed);
+        total += counts [i];
+    }
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = std::max<uint64_t> ((uint64_t) std::ceil (q * total), 1);
+    uint64_t seen = 0;
+    size_t i = 0;
+    for (; i < HISTOGRAM_BUCKETS - 1; i++) {
+        seen += counts [i];
+        if (seen >= rank)
+            break;
+    }
+    // the last bucket is open, the max bounds all of them
+    return std::min (bucket_upper (i), get_max ());
+}
+
+StoreStats::StoreStats () :
+    StoreStats (STATS_INTERVAL_DEFAULT)
+{
+    char *env_interval = getenv (EV_DBSTORE_STATS_INTERVAL);
+    if (env_interval) {
+        int interval = atoi (env_interval);
+        if (interval >= 0) _publish_interval_s = interval;
+        log_info ("use %s %ds as interval of the published stats", EV_DBSTORE_STATS_INTERVAL, _publish_interval_s);
+    }
+}
+
+StoreStats::StoreStats (int publish_interval_s) :
+    _publish_interval_s (publish_interval_s)
+{
+    for (size_t i = 0; i < STATS_COUNTERS; i++)
+        _counters [i].store (0, std::memory_order_relaxed);
+    for (size_t i = 0; i < STATS_GAUGES; i++)
+        _gauges [i].store (0, std::memory_order_relaxed);
+}
+
+stats_histogram_t
+StoreStats::get_histogram_of_step (const char *step)
+{
+    static const char *steps [] = { "RT", "15m", "30m", "1h", "8h", "24h", "7d", "30d" };
+    if (step) {
+        // the agent calls the daily step 1d, the computation module 24h
+        if (streq (step, "1d"))
+            return STATS_GET_24H_US;
+        for (size_t i = 0; i < sizeof (steps) / sizeof (steps [0]); i++) {
+            if (streq (step, steps [i]))
+                return (stats_histogram_t) (STATS_GET_RT_US + i);
+        }
+    }
+    return STATS_GET_OTHER_US;
+}
+
+void
+StoreStats::record_get (const char *step, uint64_t us, bool ok)
+{
+    add (STATS_GET_REQUESTS);
+    if (!ok)
+        add (STATS_GET_ERRORS);
+    record (get_histogram_of_step (step), us);
+}
+
+std::vector<std::pair<std::string, std::string>>
+StoreStats::snapshot () const
+{
+    std::vector<std::pair<std::string, std::string>> values;
+    for (size_t i = 0; i < STATS_COUNTERS; i++)
+        values.push_back ({ s_counter_names [i], std::to_string (get ((stats_counter_t) i)) });
+    for (size_t i = 0; i < STATS_GAUGES; i++)
+        values.push_back ({ s_gauge_names [i], std::to_string (get_gauge ((stats_gauge_t) i)) });
+    for (size_t i = 0; i < STATS_HISTOGRAMS; i++) {
+        const Histogram &histogram = _histograms [i];
+        std::string name = s_histogram_names [i];
+        values.push_back ({ name + ".count", std::to_string (histogram.get_count ()) });
+        values.push_back ({ name + ".p50", std::to_string (histogram.percentile (0.5)) });
+        values.push_back ({ name + ".p99", std::to_string (histogram.percentile (0.99)) });
+        values.push_back ({ name + ".p999", std::to_string (histogram.percentile (0.999)) });
+        values.push_back ({ name + ".max", std::to_string (histogram.get_max ()) });
+    }
+    return values;
+}
+
+const char *
+StoreStats::counter_name (stats_counter_t counter)
+{
+    return s_counter_names [counter];
+}
+
+const char *
+StoreStats::gauge_name (stats_gauge_t gauge)
+{
+    return s_gauge_names [gauge];
+}
+
+const char *
+StoreStats::histogram_name (stats_histogram_t histogram)
+{
+    return s_histogram_names [histogram];
+}
+
+StoreStats &
+store_stats ()
+{
+    static StoreStats stats;
+    return stats;
+}
+
+uint64_t
+stats_elapsed_us (int64_t start)
+{
+    int64_t now = zclock_usecs ();
+    return now > start ? (uint64_t) (now - start) : 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+store_stats_test (bool verbose)
+{
+    printf (" * store_stats: ");
+
+    //  @selftest
+    // small values are exact, then 8 buckets per power of two
+    assert (Histogram::bucket (0) == 0);
+    assert (Histogram::bucket (7) == 7);
+    assert (Histogram::bucket (8) == 8);
+    assert (Histogram::bucket (15) == 15);
+    assert (Histogram::bucket (16) == 16 && Histogram::bucket (17) == 16);
+    assert (Histogram::bucket_upper (16) == 17);
+    assert (Histogram::bucket (1000) == Histogram::bucket (1023));
+    assert (Histogram::bucket_upper (Histogram::bucket (1000)) == 1023);
+    assert (Histogram::bucket (UINT64_MAX) == HISTOGRAM_BUCKETS - 1);
+    for (uint64_t value = 1; value < 100000000; value = value * 3 + 1) {
+        uint64_t upper = Histogram::bucket_upper (Histogram::bucket (value));
+        assert (upper >= value && upper <= value + value / 8);
+    }
+
+    Histogram histogram;
+    assert (histogram.percentile (0.5) == 0);
+    for (uint64_t value = 1; value <= 1000; value++)
+        histogram.record (value);
+    assert (histogram.get_count () == 1000);
+    assert (histogram.get_max () == 1000);
+    uint64_t p50 = histogram.percentile (0.5);
+    assert (p50 >= 500 && p50 <= 500 + 500 / 8);
+    uint64_t p99 = histogram.percentile (0.99);
+    assert (p99 >= 990 && p99 <= 1000);
+    assert (histogram.percentile (1.0) == 1000);
+
+    StoreStats stats (0);
+    stats.add (STATS_SAMPLES_RECEIVED, 3);
+    stats.add (STATS_SAMPLES_REJECTED);
+    assert (stats.get (STATS_SAMPLES_RECEIVED) == 3);
+    stats.set_gauge (STATS_PENDING_ROWS, 42);
+    assert (stats.get_gauge (STATS_PENDING_ROWS) == 42);
+
+    assert (StoreStats::get_histogram_of_step ("15m") == STATS_GET_15M_US);
+    assert (StoreStats::get_histogram_of_step ("1d") == STATS_GET_24H_US);
+    assert (StoreStats::get_histogram_of_step ("30d") == STATS_GET_30D_US);
+    assert (StoreStats::get_histogram_of_step ("2h") == STATS_GET_OTHER_US);
+    stats.record_get ("15m", 1200, true);
+    stats.record_get ("15m", 800, false);
+    assert (stats.get (STATS_GET_REQUESTS) == 2);
+    assert (stats.get (STATS_GET_ERRORS) == 1);
+    assert (stats.get_histogram (STATS_GET_15M_US).get_count () == 2);
+    assert (streq (StoreStats::histogram_name (STATS_GET_15M_US), "get_15m_us"));
+
+    auto values = stats.snapshot ();
+    assert (values.size () == STATS_COUNTERS + STATS_GAUGES + 5 * STATS_HISTOGRAMS);
+    assert (values [0].first == "samples_received" && values [0].second == "3");
+    bool found = false;
+    for (const auto &value : values) {
+        if (value.first == "get_15m_us.max") {
+            assert (value.second == "1200");
+            found = true;
+        }
+    }
+    assert (found);
+
+    // concurrent records are all counted
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.push_back (std::thread ([&stats] {
+            for (int j = 0; j < 10000; j++) {
+                stats.add (STATS_ROWS_INSERTED);
+                stats.record (STATS_FLUSH_US, (uint64_t) j);
+            }
+        }));
+    }
+    for (auto &thread : threads)
+        thread.join ();
+    assert (stats.get (STATS_ROWS_INSERTED) == 40000);
+    assert (stats.get_histogram (STATS_FLUSH_US).get_count () == 40000);
+    assert (stats.get_histogram (STATS_FLUSH_US).get_max () == 9999);
+    //  @end
+
+    printf ("OK\n");
+}
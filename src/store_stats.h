@@ -0,0 +1,197 @@
+/*  =========================================================================
+    store_stats - Counters and latency histograms of the store itself
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef STORE_STATS_H_INCLUDED
+#define STORE_STATS_H_INCLUDED
+
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+// mailbox subject of the stats requests
+#define STATS_SUBJECT "STATS"
+// seconds between two publications of the stats, 0 does not publish them
+#define STATS_INTERVAL_DEFAULT 0
+#define EV_DBSTORE_STATS_INTERVAL "BIOS_DBSTORE_STATS_INTERVAL"
+// published stats are metrics of this element
+#define STATS_ELEMENT "fty-metric-store"
+
+// values below 2^HISTOGRAM_MAX_EXPONENT are told apart by 1/8 of their
+// power of two, the larger ones all fall in the last bucket
+#define HISTOGRAM_SUB_BUCKETS 8
+#define HISTOGRAM_MAX_EXPONENT 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - 2) * HISTOGRAM_SUB_BUCKETS)
+
+typedef enum {
+    // metrics from the stream and the shared memory to store
+    STATS_SAMPLES_RECEIVED,
+    // values which are not a number
+    STATS_SAMPLES_REJECTED,
+    STATS_ROWS_INSERTED,
+    // rows lost on failed insertions
+    STATS_ROWS_DROPPED,
+    // rows of a batch replaced by a later one of the same topic and time
+    STATS_ROWS_COALESCED,
+    STATS_FLUSHES,
+    STATS_FLUSH_ERRORS,
+    // topics missed by the cache, resolved by the database
+    STATS_TOPIC_PREPARES,
+    STATS_SHM_CYCLES,
+    STATS_GET_REQUESTS,
+    STATS_GET_ERRORS,
+    // GET requests computed from a finer step
+    STATS_GET_AGGREGATED,
+    // real time samples accumulated by the rollup, and rows it produced
+    STATS_ROLLUP_SAMPLES,
+    STATS_ROLLUP_ROWS,
+    STATS_COUNTERS
+} stats_counter_t;
+
+typedef enum {
+    // rows in the cache, not handed over to the flush worker yet
+    STATS_PENDING_ROWS,
+    // batches handed over to the flush worker, not inserted yet
+    STATS_FLUSH_INFLIGHT,
+    // rows of the spool not committed yet
+    STATS_SPOOLED_ROWS,
+    // current limits of the row cache and the estimates of the flush policy
+    STATS_FLUSH_ROW_LIMIT,
+    STATS_FLUSH_DELAY_MS,
+    STATS_FLUSH_LATENCY_MS,
+    STATS_FLUSH_ROW_COST_US,
+    STATS_FLUSH_RATE,
+    STATS_GAUGES
+} stats_gauge_t;
+
+typedef enum {
+    STATS_FLUSH_US,
+    STATS_FLUSH_ROWS,
+    STATS_TOPIC_PREPARE_US,
+    STATS_SHM_CYCLE_US,
+    STATS_GET_MULTI_US,
+    // GET requests, per step of the aggregation
+    STATS_GET_RT_US,
+    STATS_GET_15M_US,
+    STATS_GET_30M_US,
+    STATS_GET_1H_US,
+    STATS_GET_8H_US,
+    STATS_GET_24H_US,
+    STATS_GET_7D_US,
+    STATS_GET_30D_US,
+    STATS_GET_OTHER_US,
+    STATS_HISTOGRAMS
+} stats_histogram_t;
+
+/*
+ * \brief Distribution of non negative values
+ *
+ * Buckets are exact up to 8, then each power of two is split into 8
+ * buckets, so a percentile is off by 12.5% at most. Recording is lock
+ * free and never allocates, readers see each bucket consistent but the
+ * buckets of concurrent records maybe not all.
+ */
+class Histogram {
+    public:
+        Histogram ();
+
+        void record (uint64_t value);
+
+        uint64_t get_count () const { return _count.load (std::memory_order_relaxed); }
+        uint64_t get_max () const { return _max.load (std::memory_order_relaxed); }
+        // largest value of the bucket holding the q-th value, 0 if empty
+        uint64_t percentile (double q) const;
+
+        static size_t bucket (uint64_t value);
+        // largest value falling in the bucket
+        static uint64_t bucket_upper (size_t index);
+
+    private:
+        std::atomic<uint64_t> _buckets [HISTOGRAM_BUCKETS];
+        std::atomic<uint64_t> _count;
+        std::atomic<uint64_t> _max;
+};
+
+/*
+ * \brief Counters, gauges and histograms of the ingest, flush and query
+ *  paths, updated from any thread without a lock
+ *
+ * The store has one instance, store_stats (). Its values are read by the
+ * STATS mailbox requests and published as metrics of the element
+ * fty-metric-store every BIOS_DBSTORE_STATS_INTERVAL seconds if set.
+ */
+class StoreStats {
+    public:
+        StoreStats ();
+        explicit StoreStats (int publish_interval_s);
+
+        void add (stats_counter_t counter, uint64_t n = 1)
+            { _counters [counter].fetch_add (n, std::memory_order_relaxed); }
+        uint64_t get (stats_counter_t counter) const
+            { return _counters [counter].load (std::memory_order_relaxed); }
+
+        void set_gauge (stats_gauge_t gauge, int64_t value)
+            { _gauges [gauge].store (value, std::memory_order_relaxed); }
+        int64_t get_gauge (stats_gauge_t gauge) const
+            { return _gauges [gauge].load (std::memory_order_relaxed); }
+
+        void record (stats_histogram_t histogram, uint64_t value)
+            { _histograms [histogram].record (value); }
+        const Histogram &get_histogram (stats_histogram_t histogram) const
+            { return _histograms [histogram]; }
+
+        // count the GET request and record its latency with its step
+        void record_get (const char *step, uint64_t us, bool ok);
+        static stats_histogram_t get_histogram_of_step (const char *step);
+
+        /*
+         * \brief all the values as name and value, histograms give their
+         *  count, p50, p99, p999 and max as name.count, name.p50 ...
+         */
+        std::vector<std::pair<std::string, std::string>> snapshot () const;
+
+        int get_publish_interval () const { return _publish_interval_s; }
+
+        static const char *counter_name (stats_counter_t counter);
+        static const char *gauge_name (stats_gauge_t gauge);
+        static const char *histogram_name (stats_histogram_t histogram);
+
+    private:
+        int _publish_interval_s;
+        std::atomic<uint64_t> _counters [STATS_COUNTERS];
+        std::atomic<int64_t> _gauges [STATS_GAUGES];
+        Histogram _histograms [STATS_HISTOGRAMS];
+};
+
+// Stats of the store, shared by all its threads
+FTY_METRIC_STORE_PRIVATE StoreStats &
+    store_stats ();
+
+// Microseconds elapsed since start, a zclock_usecs () value
+FTY_METRIC_STORE_PRIVATE uint64_t
+    stats_elapsed_us (int64_t start);
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    store_stats_test (bool verbose);
+
+#endif
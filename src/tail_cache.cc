@@ -0,0 +1,312 @@
+/*  =========================================================================
+    tail_cache - Recent samples of each topic kept in memory
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    tail_cache - Recent samples of each topic kept in memory
+@discuss
+    Most of the GET requests ask for the last hours of a metric, which are
+    also the samples possibly still waiting in the multi row cache. Keeping
+    them here answers such requests without the database and makes the
+    samples visible as soon as they are stored.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+#include <algorithm>
+
+static bool
+s_point_before (const TailCache::Point &point, int64_t timestamp)
+{
+    return point.timestamp < timestamp;
+}
+
+TailCache::TailCache ()
+{
+    _window = TAIL_WINDOW_DEFAULT;
+    _max_points = TAIL_MAX_POINTS_DEFAULT;
+
+    char *env_window = getenv (EV_DBSTORE_TAIL_WINDOW);
+    if (env_window) {
+        int window = atoi (env_window);
+        if (window >= 0) _window = window;
+        log_info ("use %s %" PRIi64 " as tail cache window", EV_DBSTORE_TAIL_WINDOW, _window);
+    }
+
+    char *env_points = getenv (EV_DBSTORE_TAIL_MAX_POINTS);
+    if (env_points) {
+        int points = atoi (env_points);
+        if (points > 0) _max_points = (size_t) points;
+        log_info ("use %s %zu as tail cache size", EV_DBSTORE_TAIL_MAX_POINTS, _max_points);
+    }
+}
+
+TailCache::TailCache (int64_t window, size_t max_points)
+{
+    _window = window > 0 ? window : 0;
+    _max_points = max_points > 0 ? max_points : 1;
+}
+
+void
+TailCache::drop (std::unordered_map<m_msrmnt_tpc_id_t, Tail>::iterator it)
+{
+    _points -= it->second.points.size ();
+    _lru.erase (it->second.lru);
+    _tails.erase (it);
+}
+
+void
+TailCache::append (
+    m_msrmnt_tpc_id_t topic_id,
+    const std::string &asset,
+    int64_t timestamp,
+    m_msrmnt_value_t value,
+    m_msrmnt_scale_t scale)
+{
+    if (!is_enabled ())
+        return;
+
+    std::lock_guard<std::mutex> lock (_mutex);
+
+    Point point {timestamp, value, scale};
+    auto it = _tails.find (topic_id);
+    if (it == _tails.end ()) {
+        _lru.push_front (topic_id);
+        Tail &tail = _tails [topic_id];
+        tail.asset = asset;
+        tail.coverage_start = timestamp;
+        tail.lru = _lru.begin ();
+        it = _tails.find (topic_id);
+    }
+    Tail &tail = it->second;
+
+    // older samples are only in the database, they are read from there
+    if (timestamp < tail.coverage_start)
+        return;
+
+    std::deque<Point> &points = tail.points;
+    if (points.empty () || points.back ().timestamp < timestamp) {
+        points.push_back (point);
+        _points++;
+    }
+    else {
+        auto pos = std::lower_bound (points.begin (), points.end (), timestamp, s_point_before);
+        if (pos->timestamp == timestamp)
+            *pos = point;
+        else {
+            points.insert (pos, point);
+            _points++;
+        }
+    }
+    _lru.splice (_lru.begin (), _lru, tail.lru);
+
+    int64_t newest = points.back ().timestamp;
+    int64_t limit = newest < INT64_MIN + _window ? INT64_MIN : newest - _window;
+    while (points.front ().timestamp < limit) {
+        tail.coverage_start = points.front ().timestamp + 1;
+        points.pop_front ();
+        _points--;
+    }
+
+    while (_points > _max_points) {
+        if (_lru.back () != topic_id) {
+            drop (_tails.find (_lru.back ()));
+            continue;
+        }
+        // the only topic left is too big, shorten it
+        tail.coverage_start = points.front ().timestamp + 1;
+        points.pop_front ();
+        _points--;
+        if (points.empty ()) {
+            drop (it);
+            break;
+        }
+    }
+}
+
+bool
+TailCache::read (
+    m_msrmnt_tpc_id_t topic_id,
+    int64_t start,
+    int64_t end,
+    std::vector<Point> &points,
+    int64_t &coverage_start)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+
+    auto it = _tails.find (topic_id);
+    if (it == _tails.end ())
+        return false;
+
+    const Tail &tail = it->second;
+    coverage_start = tail.coverage_start;
+    auto pos = std::lower_bound (
+        tail.points.begin (), tail.points.end (),
+        std::max (start, coverage_start), s_point_before);
+    for (; pos != tail.points.end () && pos->timestamp <= end; ++pos)
+        points.push_back (*pos);
+    return true;
+}
+
+void
+TailCache::evict (m_msrmnt_tpc_id_t topic_id, int64_t timestamp)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+
+    auto it = _tails.find (topic_id);
+    if (it == _tails.end ())
+        return;
+
+    std::deque<Point> &points = it->second.points;
+    auto pos = std::lower_bound (points.begin (), points.end (), timestamp, s_point_before);
+    if (pos == points.end () || pos->timestamp != timestamp)
+        return;
+    points.erase (pos);
+    _points--;
+    if (points.empty ())
+        drop (it);
+}
+
+void
+TailCache::invalidate_asset (const std::string &asset)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+
+    for (auto it = _tails.begin (); it != _tails.end (); ) {
+        auto next = std::next (it);
+        if (it->second.asset == asset)
+            drop (it);
+        it = next;
+    }
+}
+
+void
+TailCache::clear ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    _tails.clear ();
+    _lru.clear ();
+    _points = 0;
+}
+
+size_t
+TailCache::get_points ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _points;
+}
+
+size_t
+TailCache::get_topics ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _tails.size ();
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+tail_cache_test (bool verbose)
+{
+    printf (" * tail_cache: ");
+
+    //  @selftest
+    std::vector<TailCache::Point> points;
+    int64_t coverage_start = 0;
+
+    TailCache disabled (0, 10);
+    disabled.append (1, "ups-1", 100, 1, 0);
+    assert (!disabled.read (1, 0, 1000, points, coverage_start));
+
+    TailCache cache (100, 6);
+    assert (!cache.read (1, 0, 1000, points, coverage_start));
+
+    cache.append (1, "ups-1", 1000, 10, 0);
+    cache.append (1, "ups-1", 1020, 12, 0);
+    cache.append (1, "ups-1", 1010, 11, 0);
+    // replaces the value of the same timestamp
+    cache.append (1, "ups-1", 1020, 13, -1);
+    // before the coverage start, ignored
+    cache.append (1, "ups-1", 990, 9, 0);
+    assert (cache.get_points () == 3);
+
+    assert (cache.read (1, 0, 1015, points, coverage_start));
+    assert (coverage_start == 1000);
+    assert (points.size () == 2);
+    assert (points [0].timestamp == 1000 && points [1].timestamp == 1010);
+    points.clear ();
+    assert (cache.read (1, 1015, 2000, points, coverage_start));
+    assert (points.size () == 1);
+    assert (points [0].value == 13 && points [0].scale == -1);
+    points.clear ();
+
+    // the window evicts the samples older than 1110 - 100
+    cache.append (1, "ups-1", 1110, 14, 0);
+    assert (cache.read (1, 0, 2000, points, coverage_start));
+    assert (coverage_start == 1001);
+    assert (points.size () == 3);
+    assert (points [0].timestamp == 1010);
+    points.clear ();
+
+    // the least recently updated topic is dropped when full
+    cache.append (2, "epdu-1", 1100, 1, 0);
+    cache.append (2, "epdu-1", 1101, 1, 0);
+    cache.append (3, "ups-1", 1100, 1, 0);
+    cache.append (3, "ups-1", 1101, 1, 0);
+    assert (cache.get_topics () == 2);
+    assert (cache.get_points () == 4);
+    assert (!cache.read (1, 0, 2000, points, coverage_start));
+
+    cache.invalidate_asset ("ups-1");
+    assert (cache.get_topics () == 1);
+    assert (cache.get_points () == 2);
+    assert (!cache.read (3, 0, 2000, points, coverage_start));
+    assert (cache.read (2, 0, 2000, points, coverage_start));
+    assert (points.size () == 2);
+    points.clear ();
+
+    // one topic over the limit loses its oldest samples
+    TailCache small (1000, 2);
+    small.append (1, "ups-1", 1, 1, 0);
+    small.append (1, "ups-1", 2, 2, 0);
+    small.append (1, "ups-1", 3, 3, 0);
+    assert (small.get_points () == 2);
+    assert (small.read (1, 0, 10, points, coverage_start));
+    assert (coverage_start == 2 && points.size () == 2);
+    points.clear ();
+
+    // the sample of a dropped row is gone, the coverage stays
+    small.evict (1, 2);
+    small.evict (1, 5);
+    small.evict (4, 2);
+    assert (small.get_points () == 1);
+    assert (small.read (1, 0, 10, points, coverage_start));
+    assert (coverage_start == 2 && points.size () == 1 && points [0].timestamp == 3);
+    points.clear ();
+
+    small.clear ();
+    assert (small.get_points () == 0 && small.get_topics () == 0);
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,123 @@
+/*  =========================================================================
+    tail_cache - Recent samples of each topic kept in memory
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef TAIL_CACHE_H_INCLUDED
+#define TAIL_CACHE_H_INCLUDED
+
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// seconds of the samples kept for each topic, 0 disables the cache
+#define TAIL_WINDOW_DEFAULT 86400
+#define TAIL_MAX_POINTS_DEFAULT 1048576
+
+#define EV_DBSTORE_TAIL_WINDOW "BIOS_DBSTORE_TAIL_WINDOW"
+#define EV_DBSTORE_TAIL_MAX_POINTS "BIOS_DBSTORE_TAIL_MAX_POINTS"
+
+/*
+ * \brief Ring of the most recent samples of each topic id
+ *
+ * A topic covers all the timestamps from its coverage start on: every
+ * sample stored since then is in the cache, flushed to the database or
+ * not. Samples older than the window are evicted from the front and move
+ * the coverage start behind them. When the cache holds more than
+ * max_points samples, the least recently updated topics are dropped
+ * whole. Samples enter the cache before they are inserted, the ones of
+ * the rows dropped instead are evicted one by one. All methods are thread
+ * safe.
+ */
+class TailCache {
+    public:
+        struct Point {
+            int64_t timestamp;
+            m_msrmnt_value_t value;
+            m_msrmnt_scale_t scale;
+        };
+
+        TailCache ();
+        TailCache (int64_t window, size_t max_points);
+
+        bool is_enabled () { return _window > 0; }
+
+        // store the sample, same timestamp replaces the previous value
+        void append (
+            m_msrmnt_tpc_id_t topic_id,
+            const std::string &asset,
+            int64_t timestamp,
+            m_msrmnt_value_t value,
+            m_msrmnt_scale_t scale);
+
+        /*
+         * \brief copy the samples of the topic in [start, end] to points
+         *  return false if the topic is not cached, otherwise
+         *  coverage_start is set to the first timestamp covered
+         *  by the cache, only samples from there on are copied
+         */
+        bool read (
+            m_msrmnt_tpc_id_t topic_id,
+            int64_t start,
+            int64_t end,
+            std::vector<Point> &points,
+            int64_t &coverage_start);
+
+        // forget the sample of a row which is not going to be stored
+        void evict (m_msrmnt_tpc_id_t topic_id, int64_t timestamp);
+
+        // forget all topics of the asset
+        void invalidate_asset (const std::string &asset);
+
+        void clear ();
+
+        size_t get_points ();
+        size_t get_topics ();
+        int64_t get_window () { return _window; }
+        size_t get_max_points () { return _max_points; }
+
+    private:
+        struct Tail {
+            std::string asset;
+            int64_t coverage_start;
+            std::deque<Point> points;
+            std::list<m_msrmnt_tpc_id_t>::iterator lru;
+        };
+
+        void drop (std::unordered_map<m_msrmnt_tpc_id_t, Tail>::iterator it);
+
+        std::mutex _mutex;
+        int64_t _window;
+        size_t _max_points;
+        size_t _points = 0;
+        // topic ids, the most recently updated first
+        std::list<m_msrmnt_tpc_id_t> _lru;
+        std::unordered_map<m_msrmnt_tpc_id_t, Tail> _tails;
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    tail_cache_test (bool verbose);
+
+#endif
@@ -0,0 +1,301 @@
+/*  =========================================================================
+    topic_cache - Bounded cache of measurement topic ids
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    topic_cache - Bounded cache of measurement topic ids
+@discuss
+    Resolving a topic id costs a lookup in t_bios_discovered_device and an
+    INSERT ... ON DUPLICATE KEY UPDATE in t_bios_measurement_topic. Once
+    resolved, the id of a (topic, units, device) triple never changes until
+    the asset is deleted, so it is kept here and reused for every sample.
+    The read path keeps topic XXX@YYY -> (id, units) the same way, so a GET
+    is answered by one range scan of t_bios_measurement.
+@end
+*/
+
+#include "fty_metric_store_classes.h"
+
+TopicCache::TopicCache ()
+{
+    _max_size = TOPIC_CACHE_SIZE_DEFAULT;
+
+    char *env_size = getenv (EV_DBSTORE_TOPIC_CACHE_SIZE);
+    if (env_size) {
+        int size = atoi (env_size);
+        if (size > 0) _max_size = (size_t) size;
+        log_info ("use %s %zu as topic cache size", EV_DBSTORE_TOPIC_CACHE_SIZE, _max_size);
+    }
+}
+
+TopicCache::TopicCache (size_t max_size)
+{
+    _max_size = max_size > 0 ? max_size : 1;
+}
+
+std::string
+TopicCache::make_key (
+    const char *topic,
+    const char *units,
+    const char *device_name)
+{
+    assert (topic);
+    assert (units);
+    assert (device_name);
+
+    // none of the parts can contain '\0', so it is a safe separator
+    std::string key (topic);
+    key += '\0';
+    key += units;
+    key += '\0';
+    key += device_name;
+    return key;
+}
+
+bool
+TopicCache::get (const std::string &key, m_msrmnt_tpc_id_t &topic_id)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+
+    auto it = _index.find (key);
+    if (it == _index.end ())
+        return false;
+
+    // move to the front of the lru list
+    _lru.splice (_lru.begin (), _lru, it->second);
+    topic_id = it->second->topic_id;
+    return true;
+}
+
+bool
+TopicCache::get (
+    const std::string &key,
+    std::vector<m_msrmnt_tpc_id_t> &topic_ids,
+    std::string &units)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+
+    auto it = _index.find (key);
+    if (it == _index.end ())
+        return false;
+
+    _lru.splice (_lru.begin (), _lru, it->second);
+    topic_ids.assign (1, it->second->topic_id);
+    topic_ids.insert (topic_ids.end (), it->second->more_ids.begin (), it->second->more_ids.end ());
+    units = it->second->units;
+    return true;
+}
+
+void
+TopicCache::put (
+    const std::string &key,
+    const std::string &asset,
+    m_msrmnt_tpc_id_t topic_id,
+    const std::string &units)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+
+    _missing.erase (key);
+    auto it = _index.find (key);
+    if (it != _index.end ()) {
+        it->second->asset = asset;
+        it->second->topic_id = topic_id;
+        it->second->units = units;
+        it->second->more_ids.clear ();
+        _lru.splice (_lru.begin (), _lru, it->second);
+        return;
+    }
+
+    while (_lru.size () >= _max_size) {
+        _index.erase (_lru.back ().key);
+        _lru.pop_back ();
+    }
+
+    _lru.push_front (Entry {key, asset, topic_id, units, {}});
+    _index [key] = _lru.begin ();
+}
+
+void
+TopicCache::put (
+    const std::string &key,
+    const std::string &asset,
+    const std::vector<m_msrmnt_tpc_id_t> &topic_ids,
+    const std::string &units)
+{
+    assert (!topic_ids.empty ());
+    put (key, asset, topic_ids [0], units);
+
+    if (topic_ids.size () > 1) {
+        std::lock_guard<std::mutex> lock (_mutex);
+        auto it = _index.find (key);
+        if (it != _index.end ())
+            it->second->more_ids.assign (topic_ids.begin () + 1, topic_ids.end ());
+    }
+}
+
+void
+TopicCache::put_missing (const std::string &key, int64_t expiry)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+
+    if (_missing.size () >= _max_size) {
+        // the expired keys first, all of them if none is
+        for (auto it = _missing.begin (); it != _missing.end (); ) {
+            if (it->second <= expiry - TOPIC_CACHE_MISSING_TTL)
+                it = _missing.erase (it);
+            else
+                ++it;
+        }
+        if (_missing.size () >= _max_size)
+            _missing.clear ();
+    }
+    _missing [key] = expiry;
+}
+
+bool
+TopicCache::is_missing (const std::string &key, int64_t now)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+
+    auto it = _missing.find (key);
+    if (it == _missing.end ())
+        return false;
+    if (it->second <= now) {
+        _missing.erase (it);
+        return false;
+    }
+    return true;
+}
+
+void
+TopicCache::forget_missing (const std::string &key)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    _missing.erase (key);
+}
+
+void
+TopicCache::invalidate_asset (const std::string &asset)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+
+    for (auto it = _lru.begin (); it != _lru.end (); ) {
+        if (it->asset == asset) {
+            _index.erase (it->key);
+            it = _lru.erase (it);
+        }
+        else
+            ++it;
+    }
+}
+
+void
+TopicCache::clear ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    _index.clear ();
+    _lru.clear ();
+    _missing.clear ();
+}
+
+size_t
+TopicCache::size ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _lru.size ();
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+topic_cache_test (bool verbose)
+{
+    printf (" * topic_cache: ");
+
+    //  @selftest
+    TopicCache cache (2);
+    m_msrmnt_tpc_id_t topic_id = 0;
+
+    std::string k1 = TopicCache::make_key ("realpower.default@ups-1", "W", "ups-1");
+    std::string k2 = TopicCache::make_key ("realpower.default@ups-1", "kW", "ups-1");
+    std::string k3 = TopicCache::make_key ("voltage.input@epdu-2", "V", "epdu-2");
+    assert (k1 != k2);
+
+    assert (!cache.get (k1, topic_id));
+    cache.put (k1, "ups-1", 1);
+    cache.put (k2, "ups-1", 2);
+    assert (cache.get (k1, topic_id) && topic_id == 1);
+    assert (cache.size () == 2);
+
+    // k2 is the least recently used one, so it is evicted
+    cache.put (k3, "epdu-2", 3);
+    assert (cache.size () == 2);
+    assert (!cache.get (k2, topic_id));
+    assert (cache.get (k3, topic_id) && topic_id == 3);
+    assert (cache.get (k1, topic_id) && topic_id == 1);
+
+    cache.invalidate_asset ("ups-1");
+    assert (cache.size () == 1);
+    assert (!cache.get (k1, topic_id));
+    assert (cache.get (k3, topic_id) && topic_id == 3);
+
+    std::string units;
+    std::vector<m_msrmnt_tpc_id_t> topic_ids;
+    cache.put ("realpower.default_min_15m@ups-1", "ups-1", 4, "W");
+    assert (cache.get ("realpower.default_min_15m@ups-1", topic_ids, units));
+    assert (topic_ids == std::vector<m_msrmnt_tpc_id_t> { 4 } && units == "W");
+
+    // a topic name stored with two units keeps both ids
+    cache.put ("realpower.default_min_15m@ups-1", "ups-1", { 4, 7 }, "W");
+    assert (cache.get ("realpower.default_min_15m@ups-1", topic_ids, units));
+    assert ((topic_ids == std::vector<m_msrmnt_tpc_id_t> { 4, 7 }) && units == "W");
+    assert (cache.get ("realpower.default_min_15m@ups-1", topic_id) && topic_id == 4);
+    cache.put ("realpower.default_min_15m@ups-1", "ups-1", 5, "kW");
+    assert (cache.get ("realpower.default_min_15m@ups-1", topic_ids, units));
+    assert (topic_ids == std::vector<m_msrmnt_tpc_id_t> { 5 } && units == "kW");
+
+    // names not stored are known for a while, until they are
+    cache.put_missing ("realpower.default_max_2h@ups-1", 1000);
+    assert (cache.is_missing ("realpower.default_max_2h@ups-1", 999));
+    assert (!cache.is_missing ("realpower.default_max_2h@ups-1", 1000));
+    assert (!cache.is_missing ("realpower.default_max_2h@ups-1", 999));
+    cache.put_missing ("realpower.default_max_2h@ups-1", 1000);
+    cache.forget_missing ("realpower.default_max_2h@ups-1");
+    assert (!cache.is_missing ("realpower.default_max_2h@ups-1", 0));
+    cache.put_missing ("realpower.default_max_1h@ups-1", 1000);
+    cache.put ("realpower.default_max_1h@ups-1", "ups-1", 8, "W");
+    assert (!cache.is_missing ("realpower.default_max_1h@ups-1", 0));
+    // no more missing keys than entries
+    cache.put_missing ("a@ups-1", 1000);
+    cache.put_missing ("b@ups-1", 1000);
+    cache.put_missing ("c@ups-1", 1000);
+    assert (cache.is_missing ("c@ups-1", 0));
+    assert (!cache.is_missing ("a@ups-1", 0));
+
+    cache.clear ();
+    assert (cache.size () == 0);
+    assert (!cache.get (k3, topic_id));
+    assert (!cache.is_missing ("c@ups-1", 0));
+    //  @end
+
+    printf ("OK\n");
+}
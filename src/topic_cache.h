@@ -0,0 +1,118 @@
+/*  =========================================================================
+    topic_cache - Bounded cache of measurement topic ids
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef TOPIC_CACHE_H_INCLUDED
+#define TOPIC_CACHE_H_INCLUDED
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define TOPIC_CACHE_SIZE_DEFAULT 4096
+// ms a topic name which is not stored is answered from the cache
+#define TOPIC_CACHE_MISSING_TTL 60000
+
+#define EV_DBSTORE_TOPIC_CACHE_SIZE "BIOS_DBSTORE_TOPIC_CACHE_SIZE"
+
+/*
+ * \brief Least recently used map of topic keys to t_bios_measurement_topic ids
+ *
+ * Entries are remembered together with the asset they belong to, so all
+ * topics of a deleted asset can be dropped at once. A topic name of the
+ * read path maps to all its ids, t_bios_measurement_topic is unique on the
+ * name, units and device. The names found in no row are remembered apart,
+ * for a while, a GET of a step which is not stored looks up several of
+ * them. All methods are thread safe.
+ */
+class TopicCache {
+    public:
+        TopicCache ();
+        explicit TopicCache (size_t max_size);
+
+        // key for the (topic, units, device) triple used on insertion
+        static std::string make_key (
+            const char *topic,
+            const char *units,
+            const char *device_name);
+
+        // return true and fill topic_id if the key is known
+        bool get (const std::string &key, m_msrmnt_tpc_id_t &topic_id);
+        // same with all the ids of a topic name and the units of the first
+        bool get (
+            const std::string &key,
+            std::vector<m_msrmnt_tpc_id_t> &topic_ids,
+            std::string &units);
+
+        // remember the key, evicting the least recently used one when full
+        void put (
+            const std::string &key,
+            const std::string &asset,
+            m_msrmnt_tpc_id_t topic_id,
+            const std::string &units = std::string ());
+        // same with all the ids of a topic name, at least one
+        void put (
+            const std::string &key,
+            const std::string &asset,
+            const std::vector<m_msrmnt_tpc_id_t> &topic_ids,
+            const std::string &units);
+
+        // the key is not stored, until the monotonic time expiry in ms
+        void put_missing (const std::string &key, int64_t expiry);
+        // return true if the key is not stored at the monotonic time now
+        bool is_missing (const std::string &key, int64_t now);
+        // the key was just stored
+        void forget_missing (const std::string &key);
+
+        // forget all topics of the asset
+        void invalidate_asset (const std::string &asset);
+
+        void clear ();
+
+        size_t size ();
+        size_t get_max_size () { return _max_size; }
+
+    private:
+        struct Entry {
+            std::string key;
+            std::string asset;
+            m_msrmnt_tpc_id_t topic_id;
+            std::string units;
+            // the other ids of a topic name stored with several units or
+            // devices, empty for all the others
+            std::vector<m_msrmnt_tpc_id_t> more_ids;
+        };
+
+        std::mutex _mutex;
+        size_t _max_size;
+        std::list<Entry> _lru;
+        std::unordered_map<std::string, std::list<Entry>::iterator> _index;
+        // expiry of the missing keys, at most max_size of them
+        std::unordered_map<std::string, int64_t> _missing;
+};
+
+//  Self test of this class
+//  Note: Keep this definition in sync with fty_metric_store_classes.h
+FTY_METRIC_STORE_PRIVATE void
+    topic_cache_test (bool verbose);
+
+#endif